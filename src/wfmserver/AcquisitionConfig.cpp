@@ -0,0 +1,120 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of AcquisitionConfig
+ */
+#include "wfmserver.h"
+#include "AcquisitionConfig.h"
+
+using namespace std;
+
+//The configuration captures are being made with. Only ever accessed with the atomic shared_ptr functions.
+static shared_ptr<const AcquisitionConfig> g_publishedConfig = make_shared<AcquisitionConfig>();
+
+//Version of g_publishedConfig, so readers can check for a new one without touching the shared_ptr
+static atomic<size_t> g_publishedVersion(0);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+/**
+	@brief Default settings, the same as a new client gets
+ */
+AcquisitionConfig::AcquisitionConfig()
+	: m_version(0)
+	, m_acquisitionMode(ACQUISITION_TRIGGERED)
+	, m_memDepth(0)
+	, m_sampleInterval(0)
+	, m_numChannelsOn(0)
+	, m_segmentCount(1)
+	, m_triggerChannel(0)
+	, m_triggerVoltage(0)
+	, m_triggerSampleIndex(0)
+	, m_triggerDeltaSec(0)
+	, m_sampleFormat(FORMAT_FLOAT64)
+	, m_codec(CODEC_NONE)
+	, m_headerVersion(0)
+	, m_roiStart(0)
+	, m_roiLength(0)
+	, m_previewBuckets(0)
+	, m_previewMode(PREVIEW_AHEAD)
+	, m_pyramidEnabled(false)
+	, m_averageCount(1)
+	, m_persistColumns(0)
+	, m_persistRows(256)
+	, m_persistRate(30)
+	, m_spectrumMode(SPECTRUM_OFF)
+	, m_fftWindow(WINDOW_HANN)
+	, m_spectrumAverages(1)
+	, m_peakHold(false)
+	, m_spectrogramBins(1024)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Publication
+
+/**
+	@brief Makes a new configuration the one captures are made with
+
+	Only called from the control plane, with g_mutex held, so versions go up by one each time.
+ */
+void PublishConfig(shared_ptr<const AcquisitionConfig> config)
+{
+	atomic_store(&g_publishedConfig, config);
+	g_publishedVersion.store(config->m_version, memory_order_release);
+}
+
+/**
+	@brief Gets the configuration captures are being made with
+ */
+shared_ptr<const AcquisitionConfig> GetPublishedConfig()
+{
+	return atomic_load(&g_publishedConfig);
+}
+
+/**
+	@brief Replaces the caller's configuration with the published one, if that's newer
+
+	This is what the acquisition thread calls for every capture. Unless there's a new configuration it's a single
+	atomic load: no locks, and no reference counting.
+
+	@return True if the configuration changed
+ */
+bool UpdateConfig(shared_ptr<const AcquisitionConfig>& config)
+{
+	if(config && (config->m_version == g_publishedVersion.load(memory_order_acquire)) )
+		return false;
+
+	config = GetPublishedConfig();
+	return true;
+}
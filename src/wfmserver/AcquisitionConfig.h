@@ -0,0 +1,92 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef AcquisitionConfig_h
+#define AcquisitionConfig_h
+
+#include <atomic>
+#include <map>
+#include <memory>
+
+/**
+	@brief Everything about how captures are acquired and processed, as of the last arm event
+
+	The control plane builds a new one when the trigger is armed with settings that differ from the last one, and
+	publishes it with PublishConfig(). It's never modified after that, so the acquisition thread (and the buffer sets
+	it fills) can hold on to it and read it without locking, and a capture can never see part of one configuration
+	and part of the next.
+ */
+struct AcquisitionConfig
+{
+	AcquisitionConfig();
+
+	///@brief Incremented with every configuration published, so readers can cheaply tell theirs is out of date
+	size_t m_version;
+
+	//Acquisition
+	AcquisitionMode m_acquisitionMode;
+	size_t m_memDepth;
+	int64_t m_sampleInterval;
+	std::map<size_t, bool> m_channelOn;
+	size_t m_numChannelsOn;
+	size_t m_segmentCount;
+
+	//Trigger
+	size_t m_triggerChannel;
+	double m_triggerVoltage;
+	size_t m_triggerSampleIndex;
+	double m_triggerDeltaSec;
+
+	//Data plane encoding
+	SampleFormat m_sampleFormat;
+	WaveformCodec m_codec;
+	size_t m_headerVersion;
+	int64_t m_roiStart;
+	size_t m_roiLength;
+	size_t m_previewBuckets;
+	PreviewMode m_previewMode;
+	bool m_pyramidEnabled;
+
+	//Processing
+	size_t m_averageCount;
+	size_t m_persistColumns;
+	size_t m_persistRows;
+	double m_persistRate;
+	SpectrumMode m_spectrumMode;
+	FFTWindow m_fftWindow;
+	size_t m_spectrumAverages;
+	bool m_peakHold;
+	size_t m_spectrogramBins;
+};
+
+void PublishConfig(std::shared_ptr<const AcquisitionConfig> config);
+std::shared_ptr<const AcquisitionConfig> GetPublishedConfig();
+bool UpdateConfig(std::shared_ptr<const AcquisitionConfig>& config);
+
+#endif
@@ -0,0 +1,219 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of CaptureBufferSet
+ */
+#include "wfmserver.h"
+#include "CaptureBufferSet.h"
+#include "SamplePacking.h"
+#include "Decimation.h"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+CaptureBufferSet::CaptureBufferSet(SampleBufferPool* pool)
+	: m_interval(0)
+	, m_depth(0)
+	, m_format(FORMAT_FLOAT64)
+	, m_codec(CODEC_NONE)
+	, m_numchans(0)
+	, m_trigphase(0)
+	, m_roi(false)
+	, m_sliceOffset(0)
+	, m_fullDepth(0)
+	, m_segments(1)
+	, m_triggerTicks(0)
+	, m_ticksPerSecond(1)
+	, m_headerVersion(0)
+	, m_sequence(0)
+	, m_armTime(0)
+	, m_readyTime(0)
+	, m_sendTime(0)
+	, m_previewBuckets(0)
+	, m_previewMode(PREVIEW_AHEAD)
+	, m_pyramid(false)
+	, m_averages(1)
+	, m_averaged(1)
+	, m_persistColumns(0)
+	, m_persistRows(0)
+	, m_persistRate(0)
+	, m_spectrum(SPECTRUM_OFF)
+	, m_window(WINDOW_RECTANGULAR)
+	, m_spectrumAverages(1)
+	, m_peakHold(false)
+	, m_spectrogramBins(0)
+	, m_stream(false)
+	, m_firstSample(0)
+	, m_lost(0)
+	, m_corrupt(0)
+	, m_pool(pool)
+	, m_allocDepth(0)
+	, m_allocFormat(FORMAT_FLOAT64)
+	, m_allocCodec(CODEC_NONE)
+	, m_allocPreviewBuckets(0)
+	, m_allocPyramid(false)
+	, m_allocGeneration(0)
+{
+}
+
+CaptureBufferSet::~CaptureBufferSet()
+{
+	Free();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Buffer management
+
+/**
+	@brief Reallocates the buffers if the capture configuration has changed since they were last allocated
+
+	Buffers come from (and go back to) the pool, so this is cheap unless the memory depth grew.
+
+	@param generation	Incremented by the caller whenever something else forces a reallocation
+
+	@return False if the buffers couldn't be allocated (the set is left with none)
+ */
+bool CaptureBufferSet::EnsureAllocated(
+	size_t depth,
+	SampleFormat format,
+	WaveformCodec codec,
+	size_t previewBuckets,
+	bool pyramid,
+	const map<size_t, bool>& channelOn,
+	size_t generation)
+{
+	if( (depth == m_allocDepth) && (format == m_allocFormat) && (codec == m_allocCodec) &&
+		(previewBuckets == m_allocPreviewBuckets) && (pyramid == m_allocPyramid) &&
+		(channelOn == m_allocChannelOn) && (generation == m_allocGeneration) )
+	{
+		return true;
+	}
+
+	LogTrace("Reallocating buffers\n");
+
+	//Return old buffers to the pool
+	Free();
+
+	//Pyramid layout is the same for every channel
+	size_t pyramidSize = 0;
+	if(pyramid)
+		pyramidSize = GetPyramidLayout(depth, m_pyramidBuckets, m_pyramidOffsets);
+
+	//Get new ones, only for the channels that are actually enabled
+	bool ok = true;
+	for(auto it : channelOn)
+	{
+		if(!it.second)
+			continue;
+		size_t i = it.first;
+
+		if( (format == FORMAT_INT16) || (format == FORMAT_PACKED) )
+			m_rawBuffers[i] = m_pool->Allocate<int16_t>(depth);
+		else
+			m_waveformBuffers[i] = m_pool->Allocate<double>(depth);
+
+		if(format == FORMAT_FLOAT32)
+			m_floatBuffers[i] = m_pool->Allocate<float>(depth);
+		if(format == FORMAT_PACKED)
+			m_packedBuffers[i] = m_pool->Allocate(GetPackedSize(depth, g_adcBits));
+
+		//Compressed waveforms never exceed the uncompressed size, or we send them uncompressed
+		if( (codec != CODEC_NONE) && ( (format == FORMAT_INT16) || (format == FORMAT_PACKED) ) )
+			m_compressedBuffers[i] = m_pool->Allocate(GetWaveformSize(format, depth));
+
+		if(previewBuckets)
+			m_previewBuffers[i] = m_pool->Allocate<float>(previewBuckets * 2);
+		if(pyramidSize)
+			m_pyramidBuffers[i] = m_pool->Allocate<float>(pyramidSize);
+
+		if( (m_rawBuffers.count(i) && !m_rawBuffers[i]) ||
+			(m_waveformBuffers.count(i) && !m_waveformBuffers[i]) ||
+			(m_floatBuffers.count(i) && !m_floatBuffers[i]) ||
+			(m_packedBuffers.count(i) && !m_packedBuffers[i]) ||
+			(m_compressedBuffers.count(i) && !m_compressedBuffers[i]) ||
+			(m_previewBuffers.count(i) && !m_previewBuffers[i]) ||
+			(m_pyramidBuffers.count(i) && !m_pyramidBuffers[i]) )
+		{
+			ok = false;
+			break;
+		}
+	}
+	if(!ok)
+	{
+		LogError("Not enough memory for %zu samples per channel\n", depth);
+		Free();
+		return false;
+	}
+	m_compressedLen.resize(g_numAnalogInChannels);
+
+	m_allocDepth = depth;
+	m_allocFormat = format;
+	m_allocCodec = codec;
+	m_allocPreviewBuckets = previewBuckets;
+	m_allocPyramid = pyramid;
+	m_allocChannelOn = channelOn;
+	m_allocGeneration = generation;
+	return true;
+}
+
+/**
+	@brief Returns all buffers to the pool
+ */
+void CaptureBufferSet::Free()
+{
+	for(auto it : m_waveformBuffers)
+		m_pool->Release(it.second);
+	for(auto it : m_floatBuffers)
+		m_pool->Release(it.second);
+	for(auto it : m_rawBuffers)
+		m_pool->Release(it.second);
+	for(auto it : m_packedBuffers)
+		m_pool->Release(it.second);
+	for(auto it : m_compressedBuffers)
+		m_pool->Release(it.second);
+	for(auto it : m_previewBuffers)
+		m_pool->Release(it.second);
+	for(auto it : m_pyramidBuffers)
+		m_pool->Release(it.second);
+
+	m_waveformBuffers.clear();
+	m_floatBuffers.clear();
+	m_rawBuffers.clear();
+	m_packedBuffers.clear();
+	m_compressedBuffers.clear();
+	m_previewBuffers.clear();
+	m_pyramidBuffers.clear();
+
+	m_allocDepth = 0;
+}
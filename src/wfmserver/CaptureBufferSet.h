@@ -0,0 +1,173 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef CaptureBufferSet_h
+#define CaptureBufferSet_h
+
+#include <memory>
+#include "DataPlaneFrame.h"
+#include "SampleBufferPool.h"
+
+struct AcquisitionConfig;
+
+/**
+	@brief Sample buffers and metadata for one capture, from download until it's been sent to the client
+ */
+class CaptureBufferSet
+{
+public:
+	CaptureBufferSet(SampleBufferPool* pool);
+	~CaptureBufferSet();
+
+	bool EnsureAllocated(
+		size_t depth,
+		SampleFormat format,
+		WaveformCodec codec,
+		size_t previewBuckets,
+		bool pyramid,
+		const std::map<size_t, bool>& channelOn,
+		size_t generation);
+	void Free();
+
+	///@brief Total number of samples per channel, across all segments
+	size_t GetSampleCount() const
+	{ return m_depth * m_segments; }
+
+	//Configuration of the capture
+	std::shared_ptr<const AcquisitionConfig> m_config;
+	int64_t m_interval;
+	uint64_t m_depth;
+	SampleFormat m_format;
+	WaveformCodec m_codec;
+	std::map<size_t, bool> m_channelOn;
+	uint16_t m_numchans;
+	float m_trigphase;
+
+	//Region of interest: if set, m_depth samples starting at m_sliceOffset of each m_fullDepth sample record
+	bool m_roi;
+	uint64_t m_sliceOffset;
+	uint64_t m_fullDepth;
+
+	//Burst captures: m_segments back-to-back captures of m_depth samples each, stored contiguously in each buffer.
+	//Trigger phase and time (fs since the first trigger) of each.
+	size_t m_segments;
+	std::vector<float> m_segmentTrigphase;
+	std::vector<int64_t> m_segmentTime;
+
+	//Device timestamp of the first segment's trigger
+	uint64_t m_triggerTicks;
+	uint64_t m_ticksPerSecond;
+
+	//Header extension version, then capture (or streaming chunk) sequence number, and host times (ns since the Unix
+	//epoch) of arming, of the capture completing, and of building the frame being sent
+	size_t m_headerVersion;
+	uint64_t m_sequence;
+	int64_t m_armTime;
+	int64_t m_readyTime;
+	int64_t m_sendTime;
+
+	//Min/max envelope preview (zero buckets if disabled)
+	size_t m_previewBuckets;
+	PreviewMode m_previewMode;
+
+	//Build a min/max pyramid for tile requests
+	bool m_pyramid;
+
+	//Number of captures to average before sending (1 = no averaging), and how many went into this one
+	size_t m_averages;
+	size_t m_averaged;
+
+	//Persistence histogram grid (zero columns if disabled), and how often to send it, in Hz
+	size_t m_persistColumns;
+	size_t m_persistRows;
+	double m_persistRate;
+
+	//Spectrum mode (off if sending captures), window, number of spectra to average, peak hold, and spectrogram width
+	SpectrumMode m_spectrum;
+	FFTWindow m_window;
+	size_t m_spectrumAverages;
+	bool m_peakHold;
+	size_t m_spectrogramBins;
+
+	//Position of a streaming chunk in the record (only used in ACQUISITION_STREAM mode)
+	bool m_stream;
+	uint64_t m_firstSample;
+	uint64_t m_lost;
+	uint64_t m_corrupt;
+
+	//Volts (float64 and float32 formats), float32 copy for the wire, raw ADC codes (int16 and packed formats),
+	//and packed or compressed copies for the wire. Only enabled channels have buffers.
+	std::map<size_t, double*> m_waveformBuffers;
+	std::map<size_t, float*> m_floatBuffers;
+	std::map<size_t, int16_t*> m_rawBuffers;
+	std::map<size_t, uint8_t*> m_packedBuffers;
+	std::map<size_t, uint8_t*> m_compressedBuffers;
+
+	//Min/max envelope for the preview, interleaved
+	std::map<size_t, float*> m_previewBuffers;
+
+	//Min/max pyramid, all stored levels back to back (see GetPyramidLayout()), and its layout
+	std::map<size_t, float*> m_pyramidBuffers;
+	std::vector<size_t> m_pyramidBuckets;
+	std::vector<size_t> m_pyramidOffsets;
+
+	//Per-channel scaling from ADC codes to volts
+	std::map<size_t, float> m_scales;
+	std::map<size_t, float> m_offsets;
+
+	//Full scale range of each channel, and the voltage at its center
+	std::map<size_t, float> m_ranges;
+	std::map<size_t, float> m_centers;
+
+	//Compressed size of each channel (zero if sent uncompressed)
+	std::vector<size_t> m_compressedLen;
+
+	//The serialized frames
+	DataPlaneFrame m_frame;
+	DataPlaneFrame m_previewFrame;
+
+protected:
+	SampleBufferPool* m_pool;
+
+	//Configuration the buffers are currently allocated for
+	size_t m_allocDepth;
+	SampleFormat m_allocFormat;
+	WaveformCodec m_allocCodec;
+	size_t m_allocPreviewBuckets;
+	bool m_allocPyramid;
+	std::map<size_t, bool> m_allocChannelOn;
+	size_t m_allocGeneration;
+
+private:
+	//Owns buffers, not copyable
+	CaptureBufferSet(const CaptureBufferSet&) = delete;
+	CaptureBufferSet& operator=(const CaptureBufferSet&) = delete;
+};
+
+#endif
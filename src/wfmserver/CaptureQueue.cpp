@@ -0,0 +1,89 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of CaptureQueue
+ */
+#include "CaptureQueue.h"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+CaptureQueue::CaptureQueue(size_t capacity)
+	: m_capacity(capacity)
+	, m_slots(new atomic<CaptureBufferSet*>[capacity])
+	, m_readIndex(0)
+	, m_writeIndex(0)
+{
+	for(size_t i=0; i<capacity; i++)
+		m_slots[i].store(NULL, memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Queue operations
+
+/**
+	@brief Appends a capture to the queue (producer thread only)
+
+	@return False if the queue is full
+ */
+bool CaptureQueue::Push(CaptureBufferSet* set)
+{
+	size_t w = m_writeIndex.load(memory_order_relaxed);
+	if(w - m_readIndex.load(memory_order_acquire) >= m_capacity)
+		return false;
+
+	m_slots[w % m_capacity].store(set, memory_order_relaxed);
+	m_writeIndex.store(w + 1, memory_order_release);
+	return true;
+}
+
+/**
+	@brief Removes the oldest capture from the queue
+
+	@return The capture, or NULL if the queue is empty
+ */
+CaptureBufferSet* CaptureQueue::Pop()
+{
+	size_t r = m_readIndex.load(memory_order_acquire);
+	while(true)
+	{
+		if(r == m_writeIndex.load(memory_order_acquire))
+			return NULL;
+
+		//If someone else pops this slot first the CAS fails, and the value we read is discarded
+		CaptureBufferSet* set = m_slots[r % m_capacity].load(memory_order_relaxed);
+		if(m_readIndex.compare_exchange_weak(r, r + 1, memory_order_acq_rel, memory_order_acquire))
+			return set;
+	}
+}
@@ -0,0 +1,68 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef CaptureQueue_h
+#define CaptureQueue_h
+
+#include <atomic>
+#include <memory>
+
+class CaptureBufferSet;
+
+/**
+	@brief Fixed capacity lock-free ring of captures
+
+	Only one thread may push. Pops are safe from any thread, so the producer can reclaim stale captures from under a
+	slow consumer when it's not allowed to block.
+ */
+class CaptureQueue
+{
+public:
+	CaptureQueue(size_t capacity);
+
+	bool Push(CaptureBufferSet* set);
+	CaptureBufferSet* Pop();
+
+	///@brief Number of captures currently queued (approximate if other threads are active)
+	size_t size() const
+	{ return m_writeIndex.load(std::memory_order_acquire) - m_readIndex.load(std::memory_order_acquire); }
+
+	bool empty() const
+	{ return size() == 0; }
+
+protected:
+	size_t m_capacity;
+	std::unique_ptr<std::atomic<CaptureBufferSet*>[]> m_slots;
+
+	//Indexes only ever increase, so a stale index can never be mistaken for a current one
+	std::atomic<size_t> m_readIndex;
+	std::atomic<size_t> m_writeIndex;
+};
+
+#endif
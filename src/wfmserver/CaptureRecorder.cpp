@@ -0,0 +1,462 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of CaptureRecorder
+ */
+#include "wfmserver.h"
+#include "CaptureRecorder.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+/**
+	@brief Creates the file (replacing anything already there) and starts the writer
+
+	Check IsRecording() afterwards to see if that worked.
+
+	@param metadata	Description of the device, stored in the file header
+	@param direct	Bypass the page cache with O_DIRECT, if the platform and filesystem support it
+ */
+CaptureRecorder::CaptureRecorder(const string& path, const string& metadata, bool direct)
+	: m_path(path)
+	, m_fd(-1)
+	, m_busy(false)
+	, m_quit(false)
+	, m_finished(false)
+	, m_failed(false)
+	, m_staging(NULL)
+	, m_stagingUsed(0)
+	, m_fileSize(0)
+	, m_framesRecorded(0)
+	, m_framesDropped(0)
+	, m_bytesWritten(0)
+	, m_frameBytes(0)
+{
+	m_startTime = chrono::steady_clock::now();
+	m_endTime = m_startTime;
+
+#ifdef _WIN32
+	m_staging = reinterpret_cast<uint8_t*>(_aligned_malloc(RECORD_CHUNK_SIZE, RECORD_ALIGNMENT));
+#else
+	void* ptr = NULL;
+	if(0 == posix_memalign(&ptr, RECORD_ALIGNMENT, RECORD_CHUNK_SIZE))
+		m_staging = reinterpret_cast<uint8_t*>(ptr);
+#endif
+	if(!m_staging)
+	{
+		LogError("Failed to allocate recorder staging buffer\n");
+		m_failed = true;
+		return;
+	}
+
+#ifdef _WIN32
+	if(direct)
+		LogWarning("O_DIRECT not supported on this platform, recording through the page cache\n");
+	m_fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	#ifdef O_DIRECT
+		if(direct)
+		{
+			m_fd = open(path.c_str(), flags | O_DIRECT, 0644);
+			if( (m_fd < 0) && (errno == EINVAL) )
+				LogWarning("%s: filesystem doesn't support O_DIRECT, recording through the page cache\n", path.c_str());
+		}
+	#endif
+	if(m_fd < 0)
+		m_fd = open(path.c_str(), flags, 0644);
+	#if defined(__APPLE__)
+		//No O_DIRECT here, but this does much the same thing
+		if( (m_fd >= 0) && direct)
+			fcntl(m_fd, F_NOCACHE, 1);
+	#elif !defined(O_DIRECT)
+		if(direct)
+			LogWarning("O_DIRECT not supported on this platform, recording through the page cache\n");
+	#endif
+#endif
+	if(m_fd < 0)
+	{
+		LogError("Couldn't create recording %s: %s\n", path.c_str(), strerror(errno));
+		m_failed = true;
+		return;
+	}
+
+	size_t metadataPadding = (8 - metadata.size() % 8) % 8;
+	uint64_t header[RECORD_HEADER_SIZE / sizeof(uint64_t)] = {0};
+	header[0] = RECORD_MAGIC;
+	header[1] = 1;
+	header[2] = RECORD_HEADER_SIZE + metadata.size() + metadataPadding;
+	header[3] = RECORD_ALIGNMENT;
+	header[4] = GetHostTimestamp();
+	header[5] = metadata.size();
+	Append(header, sizeof(header));
+	Append(metadata.c_str(), metadata.size());
+	Append(NULL, metadataPadding);
+
+	m_writer = thread(&CaptureRecorder::WriterThread, this);
+}
+
+CaptureRecorder::~CaptureRecorder()
+{
+	Close();
+
+#ifdef _WIN32
+	_aligned_free(m_staging);
+#else
+	free(m_staging);
+#endif
+}
+
+/**
+	@brief Stops taking new frames, writes out everything already queued along with the index, and closes the file
+ */
+void CaptureRecorder::Close()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_cond.notify_all();
+
+	if(m_writer.joinable())
+		m_writer.join();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Queueing
+
+/**
+	@brief Queues a frame to be recorded, timestamped with the current time
+
+	Never blocks. If the queue is full, the oldest queued frame is dropped.
+
+	@return False if the recording has been closed or failed
+ */
+bool CaptureRecorder::Post(shared_ptr<const DataPlaneFrame> frame)
+{
+	int64_t now = GetHostTimestamp();
+	{
+		lock_guard<mutex> lock(m_mutex);
+		if(m_failed || m_quit)
+			return false;
+
+		if(m_queue.size() >= RECORDER_QUEUE_DEPTH)
+		{
+			m_queue.pop_front();
+			m_framesDropped ++;
+		}
+		m_queue.push_back(make_pair(now, frame));
+	}
+	m_cond.notify_all();
+	return true;
+}
+
+/**
+	@brief Waits until the recorder isn't holding on to any frames
+ */
+void CaptureRecorder::WaitForIdle()
+{
+	unique_lock<mutex> lock(m_mutex);
+	m_cond.wait(lock, [this]{ return m_queue.empty() && !m_busy; });
+}
+
+/**
+	@brief True if the file is open and frames are still being recorded
+ */
+bool CaptureRecorder::IsRecording()
+{
+	lock_guard<mutex> lock(m_mutex);
+	return !m_failed && !m_quit;
+}
+
+/**
+	@brief Average rate data has gone to disk since the recording started (until it was closed), in MB/s
+ */
+double CaptureRecorder::GetAverageRate()
+{
+	auto end = chrono::steady_clock::now();
+	{
+		lock_guard<mutex> lock(m_mutex);
+		if(m_finished)
+			end = m_endTime;
+	}
+
+	double dt = chrono::duration<double>(end - m_startTime).count();
+	if(dt <= 0)
+		return 0;
+	return m_bytesWritten / (dt * 1e6);
+}
+
+/**
+	@brief Copies queued frames into the file until closed or a write fails
+ */
+void CaptureRecorder::WriterThread()
+{
+	#ifdef __linux__
+	pthread_setname_np(pthread_self(), "CaptureRecorder");
+	#endif
+
+	//Throughput statistics
+	auto statsStart = chrono::steady_clock::now();
+	size_t statsFrames = 0;
+	uint64_t statsBytes = 0;
+	size_t statsDropped = 0;
+
+	while(true)
+	{
+		//Everything queued before we were closed still gets recorded
+		pair<int64_t, shared_ptr<const DataPlaneFrame> > item;
+		{
+			unique_lock<mutex> lock(m_mutex);
+			while(m_queue.empty() && !m_quit)
+				m_cond.wait(lock);
+			if(m_queue.empty())
+				break;
+
+			item = m_queue.front();
+			m_queue.pop_front();
+			m_busy = true;
+		}
+		m_cond.notify_all();
+
+		//Record header, then the frame, then pad so the next record is aligned
+		const DataPlaneFrame& frame = *item.second;
+		uint64_t len = frame.GetSize();
+		RecordIndexEntry entry;
+		entry.m_offset = m_fileSize;
+		entry.m_timestamp = item.first;
+		m_index.push_back(entry);
+
+		uint64_t header[2] = { len, static_cast<uint64_t>(item.first) };
+		Append(header, sizeof(header));
+		for(size_t i=0; i<frame.GetSegmentCount(); i++)
+			Append(frame.GetSegmentData(i), frame.GetSegmentLength(i));
+		Append(NULL, (8 - len % 8) % 8);
+		m_frameBytes += len;
+		item.second.reset();
+
+		bool ok = !m_failed;
+		if(ok)
+			m_framesRecorded ++;
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_busy = false;
+			if(!ok)
+				m_queue.clear();
+		}
+		m_cond.notify_all();
+
+		if(!ok)
+			break;
+
+		//Report throughput every few seconds
+		auto now = chrono::steady_clock::now();
+		double dt = chrono::duration<double>(now - statsStart).count();
+		if(dt >= STATS_INTERVAL)
+		{
+			size_t frames = m_framesRecorded;
+			uint64_t bytes = m_bytesWritten;
+			size_t dropped = m_framesDropped;
+			LogVerbose("Recorder: %.2f frames/s, %.2f MB/s to disk, %zu dropped\n",
+				(frames - statsFrames) / dt,
+				(bytes - statsBytes) / (dt * 1e6),
+				dropped - statsDropped);
+
+			statsStart = now;
+			statsFrames = frames;
+			statsBytes = bytes;
+			statsDropped = dropped;
+		}
+	}
+
+	bool ok = Finish();
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_endTime = chrono::steady_clock::now();
+		m_finished = true;
+	}
+
+	if(ok)
+	{
+		LogNotice("Recorded %zu frames (%.2f MB) to %s, %.2f MB/s sustained, %zu dropped\n",
+			m_framesRecorded.load(), m_bytesWritten / 1e6, m_path.c_str(), GetAverageRate(), m_framesDropped.load());
+	}
+	else
+		LogError("Recording to %s failed after %zu frames\n", m_path.c_str(), m_framesRecorded.load());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// File output
+
+/**
+	@brief Adds data to the end of the file, writing out the staging buffer each time it fills up
+
+	@param data	Data to add, or NULL for zeroes
+ */
+void CaptureRecorder::Append(const void* data, size_t len)
+{
+	auto p = reinterpret_cast<const uint8_t*>(data);
+	m_fileSize += len;
+
+	while(len)
+	{
+		size_t n = min(len, RECORD_CHUNK_SIZE - m_stagingUsed);
+		if(p)
+		{
+			memcpy(m_staging + m_stagingUsed, p, n);
+			p += n;
+		}
+		else
+			memset(m_staging + m_stagingUsed, 0, n);
+		m_stagingUsed += n;
+		len -= n;
+
+		if(m_stagingUsed == RECORD_CHUNK_SIZE)
+		{
+			FlushChunk(RECORD_CHUNK_SIZE);
+			m_stagingUsed = 0;
+		}
+	}
+}
+
+/**
+	@brief Writes the start of the staging buffer to the file
+
+	@param len	Bytes to write, a multiple of RECORD_ALIGNMENT
+
+	@return False if this or any earlier write failed
+ */
+bool CaptureRecorder::FlushChunk(size_t len)
+{
+	if(m_failed)
+		return false;
+
+	size_t done = 0;
+	int directFlags = 0;
+	while(done < len)
+	{
+		#ifdef _WIN32
+		int n = _write(m_fd, m_staging + done, static_cast<unsigned int>(len - done));
+		#else
+		ssize_t n = write(m_fd, m_staging + done, len - done);
+		#endif
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			LogError("Write to recording %s failed: %s\n", m_path.c_str(), strerror(errno));
+			m_failed = true;
+			return false;
+		}
+		done += n;
+
+		#ifdef O_DIRECT
+		//After a short write the rest is no longer aligned, which O_DIRECT won't take, so write it through the
+		//page cache. The chunk ends on a block boundary, so O_DIRECT can go back on after it.
+		if( (done < len) && (done % RECORD_ALIGNMENT) && !directFlags)
+		{
+			int flags = fcntl(m_fd, F_GETFL);
+			if( (flags >= 0) && (flags & O_DIRECT) && (0 == fcntl(m_fd, F_SETFL, flags & ~O_DIRECT)) )
+				directFlags = flags;
+		}
+		#endif
+	}
+
+	#ifdef O_DIRECT
+	if(directFlags)
+		fcntl(m_fd, F_SETFL, directFlags);
+	#endif
+
+	m_bytesWritten += len;
+	return true;
+}
+
+/**
+	@brief Writes the index and trailer, flushes everything to disk, and closes the file
+
+	@return False if anything failed to write
+ */
+bool CaptureRecorder::Finish()
+{
+	if(m_fd < 0)
+		return false;
+
+	//Index, then pad so the trailer ends the file on a block boundary
+	uint64_t indexOffset = m_fileSize;
+	if(!m_index.empty())
+		Append(&m_index[0], m_index.size() * sizeof(RecordIndexEntry));
+	size_t end = (m_fileSize + RECORD_TRAILER_SIZE) % RECORD_ALIGNMENT;
+	if(end)
+		Append(NULL, RECORD_ALIGNMENT - end);
+
+	uint64_t trailer[RECORD_TRAILER_SIZE / sizeof(uint64_t)] =
+		{ indexOffset, m_index.size(), m_frameBytes, RECORD_INDEX_MAGIC };
+	Append(trailer, sizeof(trailer));
+
+	//The file is a whole number of blocks now, so whatever is left in the staging buffer is too
+	if(m_stagingUsed)
+		FlushChunk(m_stagingUsed);
+	m_stagingUsed = 0;
+
+	bool ok = !m_failed;
+#ifdef _WIN32
+	if(ok && (0 != _commit(m_fd)) )
+		ok = false;
+	_close(m_fd);
+#else
+	#ifdef __linux__
+	if(ok && (0 != fdatasync(m_fd)) )
+		ok = false;
+	#else
+	if(ok && (0 != fsync(m_fd)) )
+		ok = false;
+	#endif
+	close(m_fd);
+#endif
+	m_fd = -1;
+
+	return ok;
+}
@@ -0,0 +1,176 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef CaptureRecorder_h
+#define CaptureRecorder_h
+
+#include "DataPlaneFrame.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+	@brief Identifies a recording ("WFMREC01"), at the start of the file
+ */
+#define RECORD_MAGIC 0x31304345524d4657ULL
+
+/**
+	@brief Identifies the trailer of a complete recording ("WFMIDX01")
+ */
+#define RECORD_INDEX_MAGIC 0x31305844494d4657ULL
+
+/**
+	@brief Size of the fixed part of the file header, in bytes
+ */
+#define RECORD_HEADER_SIZE 64
+
+/**
+	@brief Size of the trailer at the very end of a complete recording, in bytes
+ */
+#define RECORD_TRAILER_SIZE 32
+
+/**
+	@brief Alignment of every write to the file (offset, length and buffer), as needed for O_DIRECT
+ */
+#define RECORD_ALIGNMENT 4096
+
+/**
+	@brief Bytes written to the file at a time
+ */
+#define RECORD_CHUNK_SIZE (8 * 1024 * 1024)
+
+/**
+	@brief Frames the recorder may have queued behind the one it's copying
+ */
+#define RECORDER_QUEUE_DEPTH 2
+
+/**
+	@brief One entry in the index of a recording
+ */
+struct RecordIndexEntry
+{
+	///@brief Offset of the record from the start of the file
+	uint64_t m_offset;
+
+	///@brief When the frame was recorded, in ns since the Unix epoch
+	int64_t m_timestamp;
+};
+
+/**
+	@brief Writes every data plane frame it's given to an indexed file on disk, with its own writer thread
+
+	File layout (all little endian, and a whole number of RECORD_ALIGNMENT blocks once closed):
+	* Header, RECORD_HEADER_SIZE bytes: uint64 {RECORD_MAGIC, version (1), offset of the first record,
+	  RECORD_ALIGNMENT}, int64 creation time in ns since the Unix epoch, uint64 metadata length, zero padding
+	* Metadata describing the device, as "key=value" lines of text, zero padded to a multiple of 8 bytes
+	* One record per frame, each starting on an 8 byte boundary: uint64 frame length, int64 timestamp, then the frame
+	  exactly as it goes out on the data plane socket (so with all of its headers, trigger phase and samples), zero
+	  padded to a multiple of 8 bytes
+	* The index, one RecordIndexEntry per record, then zero padding
+	* Trailer, in the last RECORD_TRAILER_SIZE bytes of the file: uint64 {index offset, record count, total frame
+	  bytes, RECORD_INDEX_MAGIC}
+
+	Records and index entries are naturally aligned, so the whole file can be mapped and read in place. If the
+	recording was never closed (say the server crashed) there's no trailer, but the records can still be walked
+	from the header: the zero padding after the last one reads as a zero length record.
+
+	Frames are copied into a large aligned staging buffer, which is written out a chunk at a time. Frames are only
+	held on to until they've been copied, but posting never waits: if the disk can't keep up, frames the recorder
+	hasn't started on are dropped (and counted).
+ */
+class CaptureRecorder
+{
+public:
+	CaptureRecorder(const std::string& path, const std::string& metadata, bool direct);
+	~CaptureRecorder();
+
+	bool Post(std::shared_ptr<const DataPlaneFrame> frame);
+	void WaitForIdle();
+	void Close();
+
+	bool IsRecording();
+
+	///@brief Number of frames written so far
+	size_t GetFramesRecorded()
+	{ return m_framesRecorded; }
+
+	///@brief Number of frames dropped because the disk couldn't keep up
+	size_t GetFramesDropped()
+	{ return m_framesDropped; }
+
+	double GetAverageRate();
+
+protected:
+	void WriterThread();
+
+	void Append(const void* data, size_t len);
+	bool FlushChunk(size_t len);
+	bool Finish();
+
+	std::string m_path;
+	int m_fd;
+
+	//Frames waiting to be copied, and whether the writer is busy with one it already took off the queue
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque< std::pair<int64_t, std::shared_ptr<const DataPlaneFrame> > > m_queue;
+	bool m_busy;
+	bool m_quit;
+	bool m_finished;
+	std::atomic<bool> m_failed;
+
+	std::thread m_writer;
+
+	///@brief Staging buffer, RECORD_CHUNK_SIZE bytes aligned to RECORD_ALIGNMENT
+	uint8_t* m_staging;
+
+	///@brief Bytes waiting in the staging buffer
+	size_t m_stagingUsed;
+
+	///@brief Logical end of the file, including whatever is still in the staging buffer
+	uint64_t m_fileSize;
+
+	///@brief Offset and timestamp of every record, written out as the index when the recording is closed
+	std::vector<RecordIndexEntry> m_index;
+
+	std::chrono::steady_clock::time_point m_startTime;
+	std::chrono::steady_clock::time_point m_endTime;
+	std::atomic<size_t> m_framesRecorded;
+	std::atomic<size_t> m_framesDropped;
+	std::atomic<uint64_t> m_bytesWritten;
+	uint64_t m_frameBytes;
+};
+
+#endif
@@ -0,0 +1,290 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of CaptureReplay
+ */
+#include "wfmserver.h"
+#include "CaptureReplay.h"
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+CaptureReplay::CaptureReplay()
+	: m_base(NULL)
+	, m_size(0)
+	, m_index(NULL)
+	, m_frameCount(0)
+{
+}
+
+CaptureReplay::~CaptureReplay()
+{
+#ifndef _WIN32
+	if(m_base)
+		munmap(m_base, m_size);
+#endif
+}
+
+/**
+	@brief Maps a recording, finds its frames, and describes the recorded device in the globals (model, channel
+	count, sample rate and memory depth limits, etc)
+
+	@return False if the file can't be read or isn't a recording
+ */
+bool CaptureReplay::Open(const string& path)
+{
+#ifdef _WIN32
+	LogError("Replay is not supported on Windows\n");
+	(void)path;
+	return false;
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if( (fd < 0) || (0 != fstat(fd, &st)) )
+	{
+		LogError("Couldn't open recording %s: %s\n", path.c_str(), strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return false;
+	}
+	m_size = st.st_size;
+	if(m_size < RECORD_HEADER_SIZE)
+	{
+		LogError("%s is not a recording\n", path.c_str());
+		close(fd);
+		return false;
+	}
+
+	void* base = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED)
+	{
+		LogError("Couldn't map recording %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	m_base = static_cast<uint8_t*>(base);
+	madvise(m_base, m_size, MADV_SEQUENTIAL);
+
+	const uint64_t* header = reinterpret_cast<const uint64_t*>(m_base);
+	if( (header[0] != RECORD_MAGIC) || (header[1] != 1) || (header[2] < RECORD_HEADER_SIZE) ||
+		(header[2] > m_size) || (header[5] > header[2] - RECORD_HEADER_SIZE) )
+	{
+		LogError("%s is not a recording, or was made by a newer version\n", path.c_str());
+		return false;
+	}
+
+	//Metadata is "key=value" lines
+	string metadata(reinterpret_cast<const char*>(m_base + RECORD_HEADER_SIZE), header[5]);
+	size_t start = 0;
+	while(start < metadata.size())
+	{
+		size_t end = metadata.find('\n', start);
+		if(end == string::npos)
+			end = metadata.size();
+		string line = metadata.substr(start, end - start);
+		size_t eq = line.find('=');
+		if(eq != string::npos)
+			m_metadata[line.substr(0, eq)] = line.substr(eq + 1);
+		start = end + 1;
+	}
+
+	//Use the index if the recording was closed properly, otherwise rebuild it
+	if(!LoadIndex() && !ScanRecords())
+	{
+		LogError("%s is damaged\n", path.c_str());
+		return false;
+	}
+	LogVerbose("%zu frames in recording\n", m_frameCount);
+
+	g_model = GetMetadata("model");
+	g_serial = GetMetadata("serial");
+	g_fwver = GetMetadata("firmware");
+	g_numAnalogInChannels = strtoul(GetMetadata("channels").c_str(), NULL, 10);
+	g_adcBits = atoi(GetMetadata("adcbits").c_str());
+	g_minSampleRate = atof(GetMetadata("minrate").c_str());
+	g_maxSampleRate = atof(GetMetadata("maxrate").c_str());
+	g_maxMemDepth = atoi(GetMetadata("maxdepth").c_str());
+	if( (g_numAnalogInChannels == 0) || (g_adcBits == 0) )
+	{
+		LogError("%s doesn't say what device it was recorded from\n", path.c_str());
+		return false;
+	}
+
+	return true;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Index
+
+/**
+	@brief Uses the index at the end of the file, if there is one and it makes sense
+
+	@return False if there's no usable index
+ */
+bool CaptureReplay::LoadIndex()
+{
+	if(m_size < RECORD_HEADER_SIZE + RECORD_TRAILER_SIZE)
+		return false;
+
+	const uint64_t* trailer = reinterpret_cast<const uint64_t*>(m_base + m_size - RECORD_TRAILER_SIZE);
+	uint64_t indexOffset = trailer[0];
+	uint64_t count = trailer[1];
+	if( (trailer[3] != RECORD_INDEX_MAGIC) || (indexOffset % 8) || (indexOffset < 16) ||
+		(indexOffset > m_size - RECORD_TRAILER_SIZE) ||
+		(count > (m_size - RECORD_TRAILER_SIZE - indexOffset) / sizeof(RecordIndexEntry)) )
+	{
+		return false;
+	}
+
+	//Make sure every record is actually in the file, so GetFrame() never has to check.
+	//Offsets are untrusted, so compare without adding to them (a huge one would wrap).
+	const RecordIndexEntry* index = reinterpret_cast<const RecordIndexEntry*>(m_base + indexOffset);
+	for(size_t i=0; i<count; i++)
+	{
+		uint64_t offset = index[i].m_offset;
+		if( (offset % 8) || (offset > indexOffset - 16) )
+			return false;
+		uint64_t len = *reinterpret_cast<const uint64_t*>(m_base + offset);
+		if(len > indexOffset - offset - 16)
+			return false;
+	}
+
+	m_index = index;
+	m_frameCount = count;
+	return true;
+}
+
+/**
+	@brief Rebuilds the index by walking the records from the start of the file
+
+	A recording that was never closed has no index, and may end partway through a record, which is ignored.
+
+	@return False if there are no records at all
+ */
+bool CaptureReplay::ScanRecords()
+{
+	const uint64_t* header = reinterpret_cast<const uint64_t*>(m_base);
+	uint64_t offset = header[2];
+	while(offset + 16 <= m_size)
+	{
+		const uint64_t* record = reinterpret_cast<const uint64_t*>(m_base + offset);
+		uint64_t len = record[0];
+		if( (len == 0) || (len > m_size - offset - 16) )
+			break;
+
+		RecordIndexEntry entry;
+		entry.m_offset = offset;
+		entry.m_timestamp = static_cast<int64_t>(record[1]);
+		m_scannedIndex.push_back(entry);
+
+		offset += 16 + ( (len + 7) & ~static_cast<uint64_t>(7) );
+	}
+
+	if(m_scannedIndex.empty())
+		return false;
+
+	LogWarning("Recording has no index (it wasn't closed properly), recovered %zu frames\n", m_scannedIndex.size());
+	m_index = &m_scannedIndex[0];
+	m_frameCount = m_scannedIndex.size();
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Accessors
+
+/**
+	@brief Gets one frame, pointing straight into the mapped file
+
+	@param timestamp	When the frame was recorded, in ns since the Unix epoch
+ */
+void CaptureReplay::GetFrame(size_t i, const uint8_t*& data, size_t& len, int64_t& timestamp)
+{
+	const uint64_t* record = reinterpret_cast<const uint64_t*>(m_base + m_index[i].m_offset);
+	len = record[0];
+	timestamp = m_index[i].m_timestamp;
+	data = m_base + m_index[i].m_offset + 16;
+}
+
+/**
+	@brief Applies the settings that say how to parse the recorded frames
+
+	Frames go out as recorded, so clients have to parse them with the settings they were recorded with. Called for
+	each new client, after it's been given the defaults (recordings that don't say were made with the defaults).
+ */
+void CaptureReplay::ApplyWireFormat()
+{
+	g_sampleFormat = static_cast<SampleFormat>(GetMetadataInt("format", g_sampleFormat));
+	g_codec = static_cast<WaveformCodec>(GetMetadataInt("codec", g_codec));
+	g_headerVersion = GetMetadataInt("headerversion", g_headerVersion);
+	g_acquisitionMode = static_cast<AcquisitionMode>(GetMetadataInt("acqmode", g_acquisitionMode));
+	g_previewBuckets = GetMetadataInt("preview", g_previewBuckets);
+	g_previewMode = static_cast<PreviewMode>(GetMetadataInt("previewmode", g_previewMode));
+	g_pyramidEnabled = GetMetadataInt("pyramid", g_pyramidEnabled);
+	g_averageCount = GetMetadataInt("average", g_averageCount);
+	g_persistColumns = GetMetadataInt("persistcols", g_persistColumns);
+	g_spectrumMode = static_cast<SpectrumMode>(GetMetadataInt("spectrum", g_spectrumMode));
+}
+
+/**
+	@brief Gets one item of metadata about the recorded device, or an empty string if it's not there
+ */
+string CaptureReplay::GetMetadata(const string& key)
+{
+	auto it = m_metadata.find(key);
+	if(it == m_metadata.end())
+		return "";
+	return it->second;
+}
+
+/**
+	@brief Gets one item of numeric metadata, or a default if it's not there
+ */
+long long CaptureReplay::GetMetadataInt(const string& key, long long defaultValue)
+{
+	string value = GetMetadata(key);
+	if(value.empty())
+		return defaultValue;
+	return strtoll(value.c_str(), NULL, 10);
+}
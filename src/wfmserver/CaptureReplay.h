@@ -0,0 +1,80 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef CaptureReplay_h
+#define CaptureReplay_h
+
+#include "CaptureRecorder.h"
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+	@brief A recording made by CaptureRecorder, mapped into memory so its frames can be sent straight out of the file
+
+	Used in place of a device: the recording's metadata says what device it came from and how its frames are encoded,
+	and the frames go out on the data plane exactly as they were recorded.
+ */
+class CaptureReplay
+{
+public:
+	CaptureReplay();
+	~CaptureReplay();
+
+	bool Open(const std::string& path);
+
+	///@brief Number of frames in the recording
+	size_t GetFrameCount()
+	{ return m_frameCount; }
+
+	void GetFrame(size_t i, const uint8_t*& data, size_t& len, int64_t& timestamp);
+
+	void ApplyWireFormat();
+
+	std::string GetMetadata(const std::string& key);
+	long long GetMetadataInt(const std::string& key, long long defaultValue);
+
+protected:
+	bool LoadIndex();
+	bool ScanRecords();
+
+	uint8_t* m_base;
+	size_t m_size;
+
+	///@brief The index, either in the file or rebuilt by ScanRecords()
+	const RecordIndexEntry* m_index;
+	size_t m_frameCount;
+
+	///@brief Index rebuilt from the records, if the recording was never closed
+	std::vector<RecordIndexEntry> m_scannedIndex;
+
+	std::map<std::string, std::string> m_metadata;
+};
+
+#endif
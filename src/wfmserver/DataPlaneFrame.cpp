@@ -0,0 +1,108 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of DataPlaneFrame
+ */
+#include "wfmserver.h"
+#include "DataPlaneFrame.h"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+DataPlaneFrame::DataPlaneFrame()
+	: m_size(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Frame construction
+
+/**
+	@brief Removes all content from the frame, but keeps allocated memory for reuse
+ */
+void DataPlaneFrame::Clear()
+{
+	m_headerData.clear();
+	m_segments.clear();
+	m_size = 0;
+}
+
+void DataPlaneFrame::AddHeaderBytes(const uint8_t* data, size_t len)
+{
+	//Merge with the previous segment if it's also header data
+	if(!m_segments.empty() && !m_segments.back().m_payload)
+		m_segments.back().m_len += len;
+	else
+	{
+		Segment seg = { NULL, m_headerData.size(), len };
+		m_segments.push_back(seg);
+	}
+
+	m_headerData.insert(m_headerData.end(), data, data + len);
+	m_size += len;
+}
+
+void DataPlaneFrame::AddPayload(const uint8_t* data, size_t len)
+{
+	if(len == 0)
+		return;
+
+	Segment seg = { data, 0, len };
+	m_segments.push_back(seg);
+	m_size += len;
+}
+
+/**
+	@brief Copies every payload into the frame's own storage, so it no longer refers to buffers that may change
+
+	Used for frames built from state that keeps being updated while subscribers are still sending them.
+ */
+void DataPlaneFrame::MakeSelfContained()
+{
+	vector<uint8_t> data;
+	data.reserve(m_size);
+	for(size_t i=0; i<m_segments.size(); i++)
+	{
+		const uint8_t* p = GetSegmentData(i);
+		data.insert(data.end(), p, p + m_segments[i].m_len);
+	}
+
+	m_headerData.swap(data);
+	m_segments.clear();
+	if(m_size)
+	{
+		Segment seg = { NULL, 0, m_size };
+		m_segments.push_back(seg);
+	}
+}
@@ -0,0 +1,105 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef DataPlaneFrame_h
+#define DataPlaneFrame_h
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/**
+	@brief One complete data plane frame (global header, then header and samples for each channel)
+
+	Header fields are copied into the frame as they're added. Sample data is referenced in place and must stay valid
+	until the frame has been sent. The whole frame goes out in a single gathered write.
+
+	Once built, a frame is never modified while it's being sent, so it can go out to several subscribers at once
+	(see DataPlaneSubscriber, which holds all per-socket transmit state).
+ */
+class DataPlaneFrame
+{
+public:
+	DataPlaneFrame();
+
+	void Clear();
+
+	/**
+		@brief Appends a header field (copied)
+	 */
+	template<class T>
+	void AddHeader(const T& value)
+	{
+		AddHeaderBytes(reinterpret_cast<const uint8_t*>(&value), sizeof(value));
+	}
+
+	void AddHeaderBytes(const uint8_t* data, size_t len);
+	void AddPayload(const uint8_t* data, size_t len);
+
+	void MakeSelfContained();
+
+	///@brief Total size of the frame, in bytes
+	size_t GetSize() const
+	{ return m_size; }
+
+	///@brief Number of contiguous ranges in the frame
+	size_t GetSegmentCount() const
+	{ return m_segments.size(); }
+
+	///@brief Start of one contiguous range of the frame
+	const uint8_t* GetSegmentData(size_t i) const
+	{
+		const Segment& seg = m_segments[i];
+		return seg.m_payload ? seg.m_payload : &m_headerData[seg.m_headerOffset];
+	}
+
+	///@brief Length of one contiguous range of the frame
+	size_t GetSegmentLength(size_t i) const
+	{ return m_segments[i].m_len; }
+
+protected:
+
+	/**
+		@brief A contiguous range of the frame
+
+		Header ranges are stored as offsets into m_headerData since it may be reallocated as the frame grows.
+	 */
+	struct Segment
+	{
+		const uint8_t* m_payload;
+		size_t m_headerOffset;
+		size_t m_len;
+	};
+
+	std::vector<uint8_t> m_headerData;
+	std::vector<Segment> m_segments;
+	size_t m_size;
+};
+
+#endif
@@ -0,0 +1,503 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of DataPlaneSubscriber
+ */
+#include "wfmserver.h"
+#include "DataPlaneSubscriber.h"
+#include <limits.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+#ifdef __linux__
+#include <poll.h>
+#include <linux/errqueue.h>
+#endif
+
+//MSG_ZEROCOPY needs kernel 4.14 and a libc that knows about it
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY
+#endif
+
+//Zero-copy sends in a row that can fail for lack of socket option memory before we stop trying them
+#define ZEROCOPY_MAX_FAILURES 8
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+/**
+	@param ringSize	Size of the shared memory ring for a client on the local socket, or zero for a TCP client
+ */
+DataPlaneSubscriber::DataPlaneSubscriber(ZSOCKET sock, const string& name, size_t ringSize)
+	: m_socket(sock, ringSize ? AF_UNIX : AF_INET6)
+	, m_name(name)
+	, m_busy(false)
+	, m_quit(false)
+	, m_failed(false)
+	, m_framesDropped(0)
+	, m_syscalls(0)
+	, m_zeroCopy(false)
+	, m_zeroCopySent(0)
+	, m_zeroCopyCompleted(0)
+	, m_zeroCopyWarned(false)
+	, m_zeroCopyFailures(0)
+{
+	if(ringSize)
+	{
+		m_ring.reset(new SharedMemoryRing);
+		if(m_ring->Create(ringSize) && m_ring->SendDescriptor(m_socket))
+			LogVerbose("%s: sending frames through shared memory\n", m_name.c_str());
+		else
+		{
+			LogError("%s: couldn't set up shared memory ring\n", m_name.c_str());
+			m_failed = true;
+		}
+	}
+	else if(!m_socket.DisableNagle())
+		LogWarning("%s: failed to disable Nagle on socket, performance may be poor\n", m_name.c_str());
+
+	if(g_zeroCopy && !m_ring)
+	{
+		if(EnableZeroCopy())
+			LogVerbose("%s: using zero-copy transmit for waveform data\n", m_name.c_str());
+		else
+			LogWarning("%s: zero-copy transmit not supported, falling back to copying sends\n", m_name.c_str());
+	}
+
+	m_writer = thread(&DataPlaneSubscriber::WriterThread, this);
+}
+
+DataPlaneSubscriber::~DataPlaneSubscriber()
+{
+	Stop();
+}
+
+/**
+	@brief Shuts down the writer once it's done with the frame it's sending, and discards anything still queued
+
+	The connection stays open until the subscriber is destroyed.
+ */
+void DataPlaneSubscriber::Stop()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_quit = true;
+		m_queue.clear();
+	}
+	m_cond.notify_all();
+
+	if(m_writer.joinable())
+		m_writer.join();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Queueing
+
+/**
+	@brief Queues a frame to be sent
+
+	If the queue is full, OVERFLOW_BLOCK waits for room, OVERFLOW_DROP_OLDEST drops the oldest queued frame, and
+	OVERFLOW_KEEP_LATEST drops every queued frame.
+
+	@return False if the connection has failed
+ */
+bool DataPlaneSubscriber::Post(shared_ptr<const DataPlaneFrame> frame, OverflowPolicy policy)
+{
+	{
+		unique_lock<mutex> lock(m_mutex);
+		if(policy == OVERFLOW_BLOCK)
+		{
+			while( (m_queue.size() >= SUBSCRIBER_QUEUE_DEPTH) && !m_failed && !m_quit)
+				m_cond.wait(lock);
+		}
+		else if(policy == OVERFLOW_KEEP_LATEST)
+		{
+			m_framesDropped += m_queue.size();
+			m_queue.clear();
+		}
+		else if(m_queue.size() >= SUBSCRIBER_QUEUE_DEPTH)
+		{
+			m_queue.pop_front();
+			m_framesDropped ++;
+		}
+
+		if(m_failed || m_quit)
+			return false;
+		m_queue.push_back(frame);
+	}
+	m_cond.notify_all();
+	return true;
+}
+
+/**
+	@brief Queues a reply to a client request, even if the queue is full
+
+	Replies are self-contained (so don't hold on to any capture buffers), and the client is waiting on them.
+
+	@return False if the connection has failed
+ */
+bool DataPlaneSubscriber::PostReply(shared_ptr<const DataPlaneFrame> frame)
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		if(m_failed || m_quit)
+			return false;
+		m_queue.push_back(frame);
+	}
+	m_cond.notify_all();
+	return true;
+}
+
+/**
+	@brief Waits until everything posted so far has been sent
+
+	@return True if idle, false on timeout or if the connection has failed
+ */
+bool DataPlaneSubscriber::WaitForIdle(chrono::milliseconds timeout)
+{
+	unique_lock<mutex> lock(m_mutex);
+	m_cond.wait_for(lock, timeout, [this]{ return (m_queue.empty() && !m_busy) || m_failed || m_quit; });
+	return m_queue.empty() && !m_busy && !m_failed;
+}
+
+/**
+	@brief Sends queued frames until stopped or the connection fails
+ */
+void DataPlaneSubscriber::WriterThread()
+{
+	#ifdef __linux__
+	pthread_setname_np(pthread_self(), "DataPlaneWriter");
+	#endif
+
+	//Throughput statistics
+	auto statsStart = chrono::steady_clock::now();
+	size_t statsFrames = 0;
+	size_t statsBytes = 0;
+	size_t statsDropped = 0;
+	double statsSendTime = 0;
+
+	while(true)
+	{
+		shared_ptr<const DataPlaneFrame> frame;
+		{
+			unique_lock<mutex> lock(m_mutex);
+			while(m_queue.empty() && !m_quit)
+				m_cond.wait(lock);
+			if(m_quit)
+				break;
+
+			frame = m_queue.front();
+			m_queue.pop_front();
+			m_busy = true;
+		}
+
+		//Wake up anyone blocked on a full queue
+		m_cond.notify_all();
+
+		//The kernel may still be sending straight out of the frame's buffers after a zero-copy send, so hang on to
+		//it until that's done
+		auto sendStart = chrono::steady_clock::now();
+		bool ok = Send(*frame);
+		if(ok)
+			ok = WaitForZeroCopyCompletion();
+		auto now = chrono::steady_clock::now();
+		statsSendTime += chrono::duration<double>(now - sendStart).count();
+		statsFrames ++;
+		statsBytes += frame->GetSize();
+		frame.reset();
+
+		{
+			lock_guard<mutex> lock(m_mutex);
+			m_busy = false;
+			if(!ok)
+			{
+				m_failed = true;
+				m_queue.clear();
+			}
+		}
+		m_cond.notify_all();
+
+		if(!ok)
+		{
+			LogVerbose("%s: disconnected\n", m_name.c_str());
+			break;
+		}
+
+		//Report throughput every few seconds
+		double dt = chrono::duration<double>(now - statsStart).count();
+		if(dt >= STATS_INTERVAL)
+		{
+			size_t dropped = m_framesDropped;
+			LogVerbose("%s: %.2f frames/s, %.2f MB/s, %.2f syscalls/frame, %.2f ms/frame sending, %zu dropped\n",
+				m_name.c_str(),
+				statsFrames / dt,
+				statsBytes / (dt * 1e6),
+				m_syscalls * 1.0 / statsFrames,
+				statsSendTime * 1e3 / statsFrames,
+				dropped - statsDropped);
+
+			statsStart = now;
+			statsFrames = 0;
+			statsBytes = 0;
+			statsDropped = dropped;
+			statsSendTime = 0;
+			m_syscalls = 0;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Transmission
+
+/**
+	@brief Sends the entire frame, blocking until it's done
+
+	@return False on socket error
+ */
+bool DataPlaneSubscriber::Send(const DataPlaneFrame& frame)
+{
+	if(m_ring)
+		return SendToRing(frame);
+
+#ifdef _WIN32
+	//No sendmsg() here, fall back to one send per segment
+	for(size_t i=0; i<frame.GetSegmentCount(); i++)
+	{
+		if(!m_socket.SendLooped(frame.GetSegmentData(i), frame.GetSegmentLength(i)))
+			return false;
+		m_syscalls ++;
+	}
+	return true;
+#else
+	m_iov.resize(frame.GetSegmentCount());
+	for(size_t i=0; i<m_iov.size(); i++)
+	{
+		m_iov[i].iov_base = const_cast<uint8_t*>(frame.GetSegmentData(i));
+		m_iov[i].iov_len = frame.GetSegmentLength(i);
+	}
+
+	//Keep going until everything is sent, picking up where a short write left off
+	size_t first = 0;
+	bool copy = false;
+	ZSOCKET fd = m_socket;
+	while(first < m_iov.size())
+	{
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &m_iov[first];
+		msg.msg_iovlen = min(m_iov.size() - first, static_cast<size_t>(IOV_MAX));
+
+		int flags = MSG_NOSIGNAL;
+#ifdef HAVE_MSG_ZEROCOPY
+		if(m_zeroCopy && !copy)
+			flags |= MSG_ZEROCOPY;
+#endif
+		copy = false;
+
+		ssize_t sent = sendmsg(fd, &msg, flags);
+		m_syscalls ++;
+		if(sent < 0)
+		{
+			if(errno == EINTR)
+				continue;
+
+#ifdef HAVE_MSG_ZEROCOPY
+			//Out of socket option memory to track zero-copy sends. That clears up as completions come in, so it's
+			//no reason to drop the client: copy this one, and stop using zero-copy if it keeps happening.
+			if( (errno == ENOBUFS) && (flags & MSG_ZEROCOPY) )
+			{
+				copy = true;
+				m_zeroCopyFailures ++;
+				if(m_zeroCopyFailures >= ZEROCOPY_MAX_FAILURES)
+				{
+					LogWarning("%s: zero-copy sends keep failing with ENOBUFS, copying from now on\n",
+						m_name.c_str());
+					m_zeroCopy = false;
+				}
+				continue;
+			}
+#endif
+			return false;
+		}
+
+		//Every successful zero-copy send gets a completion notification
+#ifdef HAVE_MSG_ZEROCOPY
+		if(flags & MSG_ZEROCOPY)
+		{
+			m_zeroCopySent ++;
+			m_zeroCopyFailures = 0;
+		}
+#endif
+
+		//Skip over whatever was fully sent and trim the partially sent segment
+		size_t remaining = sent;
+		while( (first < m_iov.size()) && (remaining >= m_iov[first].iov_len) )
+		{
+			remaining -= m_iov[first].iov_len;
+			first ++;
+		}
+		if(remaining)
+		{
+			m_iov[first].iov_base = static_cast<uint8_t*>(m_iov[first].iov_base) + remaining;
+			m_iov[first].iov_len -= remaining;
+		}
+	}
+
+	return true;
+#endif
+}
+
+/**
+	@brief Writes the frame into the shared memory ring, then tells the client where it is
+
+	@return False on socket error
+ */
+bool DataPlaneSubscriber::SendToRing(const DataPlaneFrame& frame)
+{
+	uint64_t note[3] = {0, 0, frame.GetSize()};
+	if(!m_ring->Write(frame, note[0], note[1]))
+	{
+		LogWarning("%s: %zu byte frame doesn't fit in the shared memory ring, dropped\n",
+			m_name.c_str(), frame.GetSize());
+		m_framesDropped ++;
+		return true;
+	}
+
+	m_syscalls ++;
+	return m_socket.SendLooped(reinterpret_cast<const unsigned char*>(note), sizeof(note));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Zero-copy support
+
+/**
+	@brief Switches the socket to MSG_ZEROCOPY transmission
+
+	@return False if not supported by the platform or kernel, in which case sends keep copying
+ */
+bool DataPlaneSubscriber::EnableZeroCopy()
+{
+#ifdef HAVE_MSG_ZEROCOPY
+	int one = 1;
+	if(0 != setsockopt(m_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+		return false;
+
+	m_zeroCopy = true;
+	m_zeroCopySent = 0;
+	m_zeroCopyCompleted = 0;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/**
+	@brief Blocks until the kernel has released the memory of every zero-copy send made so far
+
+	Completions arrive on the socket error queue as ranges of sendmsg() sequence numbers.
+
+	@return False on socket error, in which case the buffers may still be in use by the kernel
+ */
+bool DataPlaneSubscriber::WaitForZeroCopyCompletion()
+{
+#ifdef HAVE_MSG_ZEROCOPY
+	ZSOCKET fd = m_socket;
+	while(m_zeroCopyCompleted != m_zeroCopySent)
+	{
+		//POLLERR is always reported, no need to ask for it
+		pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = 0;
+		pfd.revents = 0;
+		if(poll(&pfd, 1, 1000) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		if(pfd.revents & (POLLHUP | POLLNVAL))
+			return false;
+		if(!(pfd.revents & POLLERR))
+			continue;
+
+		//Drain the error queue
+		while(true)
+		{
+			uint8_t control[128];
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			if(recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+			{
+				if( (errno == EAGAIN) || (errno == EWOULDBLOCK) )
+					break;
+				if(errno == EINTR)
+					continue;
+				return false;
+			}
+
+			for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+			{
+				bool isRecvErr =
+					( (cm->cmsg_level == SOL_IP) && (cm->cmsg_type == IP_RECVERR) ) ||
+					( (cm->cmsg_level == SOL_IPV6) && (cm->cmsg_type == IPV6_RECVERR) );
+				if(!isRecvErr)
+					continue;
+
+				sock_extended_err err;
+				memcpy(&err, CMSG_DATA(cm), sizeof(err));
+				if( (err.ee_errno != 0) || (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) )
+					continue;
+
+				//Sends [ee_info, ee_data] are done
+				m_zeroCopyCompleted += (err.ee_data - err.ee_info + 1);
+
+				//Kernel couldn't do it zero-copy (e.g. loopback) and copied the data anyway
+				if( (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !m_zeroCopyWarned)
+				{
+					LogWarning("Kernel fell back to copying for zero-copy sends on this socket\n");
+					m_zeroCopyWarned = true;
+				}
+			}
+		}
+	}
+#endif
+
+	return true;
+}
@@ -0,0 +1,144 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef DataPlaneSubscriber_h
+#define DataPlaneSubscriber_h
+
+#include "../../lib/xptools/Socket.h"
+#include "DataPlaneFrame.h"
+#include "SharedMemoryRing.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+/**
+	@brief Frames each subscriber may have queued behind the one it's sending
+ */
+#define SUBSCRIBER_QUEUE_DEPTH 1
+
+/**
+	@brief One client connection on the data plane socket, with its own writer thread
+
+	Frames are shared by every subscriber and never modified once posted. Each subscriber holds a reference to every
+	frame it hasn't finished sending, so whatever the frame points into stays valid until the last one is done with it.
+
+	When its queue is full, a subscriber either blocks the poster (lossless) or makes room by dropping frames it hasn't
+	started on, depending on the overflow policy it's posted with. Either way a slow subscriber never holds up the
+	writers of the others.
+
+	Clients on the same host can connect to the local socket instead. Their frames are written into a shared memory
+	ring (see SharedMemoryRing), and the socket only carries uint64 {sequence, position, length} for each one, so the
+	sample data never goes through the kernel. The ring never waits for the client: if it falls too far behind, the
+	frames it hasn't read yet are overwritten, which it can tell from the ring header.
+ */
+class DataPlaneSubscriber
+{
+public:
+	DataPlaneSubscriber(ZSOCKET sock, const std::string& name, size_t ringSize = 0);
+	~DataPlaneSubscriber();
+
+	bool Post(std::shared_ptr<const DataPlaneFrame> frame, OverflowPolicy policy);
+	bool PostReply(std::shared_ptr<const DataPlaneFrame> frame);
+	bool WaitForIdle(std::chrono::milliseconds timeout);
+	void Stop();
+
+	///@brief The connection, for reading client requests
+	Socket& GetSocket()
+	{ return m_socket; }
+
+	///@brief Name used in log messages
+	const std::string& GetName()
+	{ return m_name; }
+
+	///@brief True if the connection has failed and nothing more will be sent
+	bool IsFailed()
+	{ return m_failed; }
+
+	///@brief Number of frames this subscriber has dropped because it couldn't keep up
+	size_t GetFramesDropped()
+	{ return m_framesDropped; }
+
+protected:
+	void WriterThread();
+
+	bool Send(const DataPlaneFrame& frame);
+	bool SendToRing(const DataPlaneFrame& frame);
+	bool EnableZeroCopy();
+	bool WaitForZeroCopyCompletion();
+
+	Socket m_socket;
+	std::string m_name;
+
+	//Frames waiting to be sent, and whether the writer is busy with one it already took off the queue
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque< std::shared_ptr<const DataPlaneFrame> > m_queue;
+	bool m_busy;
+	bool m_quit;
+	std::atomic<bool> m_failed;
+	std::atomic<size_t> m_framesDropped;
+
+	std::thread m_writer;
+
+	///@brief Shared memory ring for a local client, or NULL if frames go over the socket
+	std::unique_ptr<SharedMemoryRing> m_ring;
+
+	///@brief Number of send system calls made since the last stats report
+	size_t m_syscalls;
+
+	///@brief True if sending with MSG_ZEROCOPY
+	bool m_zeroCopy;
+
+	///@brief Number of zero-copy sendmsg() calls made on the socket
+	uint32_t m_zeroCopySent;
+
+	///@brief Number of zero-copy sendmsg() calls the kernel has reported as complete
+	uint32_t m_zeroCopyCompleted;
+
+	///@brief True if we've already warned about the kernel falling back to copying
+	bool m_zeroCopyWarned;
+
+	///@brief Number of zero-copy sends in a row that failed with ENOBUFS
+	size_t m_zeroCopyFailures;
+
+#ifndef _WIN32
+	std::vector<iovec> m_iov;
+#endif
+};
+
+#endif
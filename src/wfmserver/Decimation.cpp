@@ -0,0 +1,299 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Min/max envelope decimation for preview frames
+
+	The input is split into equal buckets (bucket i is samples [i*count/buckets, (i+1)*count/buckets) ) and each is
+	reduced to its minimum and maximum, written interleaved as float volts. A glitch only one sample wide still
+	shows up in the envelope, unlike with plain subsampling.
+
+	Pyramid level L has buckets of exactly 2^L samples (the last one may be partial), and each level is built by
+	merging pairs of buckets from the one below.
+ */
+#include <algorithm>
+#include "Decimation.h"
+
+#ifdef __x86_64__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+static void MinMaxScalar(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax);
+static void MinMaxScalar(const double* in, size_t count, double& vmin, double& vmax);
+
+/**
+	@brief Reduces raw ADC codes to a min/max envelope, in volts
+
+	@param in		Raw codes
+	@param count	Number of samples
+	@param out		Output, 2*buckets values (min and max of each bucket)
+	@param buckets	Number of buckets, must be between 1 and count
+	@param scale	Volts per LSB
+	@param offset	Volts at code zero
+ */
+void MinMaxDecimate(const int16_t* in, size_t count, float* out, size_t buckets, float scale, float offset)
+{
+	#pragma omp parallel for
+	for(size_t i=0; i<buckets; i++)
+	{
+		size_t start = i * count / buckets;
+		size_t end = (i+1) * count / buckets;
+		const int16_t* p = in + start;
+		size_t len = end - start;
+
+		int16_t vmin = INT16_MAX;
+		int16_t vmax = INT16_MIN;
+
+#ifdef __x86_64__
+		//Eight lanes at a time, then fold the lanes together
+		size_t nvec = len / 8;
+		if(nvec)
+		{
+			__m128i mins = _mm_set1_epi16(INT16_MAX);
+			__m128i maxs = _mm_set1_epi16(INT16_MIN);
+			for(size_t j=0; j<nvec; j++)
+			{
+				__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + j*8));
+				mins = _mm_min_epi16(mins, v);
+				maxs = _mm_max_epi16(maxs, v);
+			}
+
+			mins = _mm_min_epi16(mins, _mm_shuffle_epi32(mins, _MM_SHUFFLE(1, 0, 3, 2)));
+			mins = _mm_min_epi16(mins, _mm_shuffle_epi32(mins, _MM_SHUFFLE(2, 3, 0, 1)));
+			mins = _mm_min_epi16(mins, _mm_srli_epi32(mins, 16));
+			maxs = _mm_max_epi16(maxs, _mm_shuffle_epi32(maxs, _MM_SHUFFLE(1, 0, 3, 2)));
+			maxs = _mm_max_epi16(maxs, _mm_shuffle_epi32(maxs, _MM_SHUFFLE(2, 3, 0, 1)));
+			maxs = _mm_max_epi16(maxs, _mm_srli_epi32(maxs, 16));
+			vmin = static_cast<int16_t>(_mm_cvtsi128_si32(mins));
+			vmax = static_cast<int16_t>(_mm_cvtsi128_si32(maxs));
+
+			p += nvec*8;
+			len -= nvec*8;
+		}
+#endif
+
+		MinMaxScalar(p, len, vmin, vmax);
+
+		out[i*2] = vmin * scale + offset;
+		out[i*2 + 1] = vmax * scale + offset;
+	}
+}
+
+/**
+	@brief Reduces waveforms already in volts to a min/max envelope
+
+	@param in		Samples
+	@param count	Number of samples
+	@param out		Output, 2*buckets values (min and max of each bucket)
+	@param buckets	Number of buckets, must be between 1 and count
+ */
+void MinMaxDecimate(const double* in, size_t count, float* out, size_t buckets)
+{
+	#pragma omp parallel for
+	for(size_t i=0; i<buckets; i++)
+	{
+		size_t start = i * count / buckets;
+		size_t end = (i+1) * count / buckets;
+		const double* p = in + start;
+		size_t len = end - start;
+
+		double vmin = p[0];
+		double vmax = p[0];
+
+#ifdef __x86_64__
+		//Two lanes per register, and two registers in flight to hide the min/max latency
+		size_t nvec = len / 4;
+		if(nvec)
+		{
+			__m128d mins0 = _mm_set1_pd(p[0]);
+			__m128d mins1 = mins0;
+			__m128d maxs0 = mins0;
+			__m128d maxs1 = mins0;
+			for(size_t j=0; j<nvec; j++)
+			{
+				__m128d a = _mm_loadu_pd(p + j*4);
+				__m128d b = _mm_loadu_pd(p + j*4 + 2);
+				mins0 = _mm_min_pd(mins0, a);
+				mins1 = _mm_min_pd(mins1, b);
+				maxs0 = _mm_max_pd(maxs0, a);
+				maxs1 = _mm_max_pd(maxs1, b);
+			}
+
+			__m128d mins = _mm_min_pd(mins0, mins1);
+			__m128d maxs = _mm_max_pd(maxs0, maxs1);
+			vmin = min(_mm_cvtsd_f64(mins), _mm_cvtsd_f64(_mm_unpackhi_pd(mins, mins)));
+			vmax = max(_mm_cvtsd_f64(maxs), _mm_cvtsd_f64(_mm_unpackhi_pd(maxs, maxs)));
+
+			p += nvec*4;
+			len -= nvec*4;
+		}
+#endif
+
+		MinMaxScalar(p, len, vmin, vmax);
+
+		out[i*2] = vmin;
+		out[i*2 + 1] = vmax;
+	}
+}
+
+/**
+	@brief Reduces raw ADC codes to a min/max envelope with buckets of exactly 2^level samples
+
+	@param out		Output, 2*ceil(count / 2^level) values
+ */
+void MinMaxDecimatePow2(const int16_t* in, size_t count, float* out, int level, float scale, float offset)
+{
+	size_t full = count >> level;
+	if(full)
+		MinMaxDecimate(in, full << level, out, full, scale, offset);
+
+	size_t done = full << level;
+	if(done < count)
+		MinMaxDecimate(in + done, count - done, out + full*2, 1, scale, offset);
+}
+
+/**
+	@brief Reduces waveforms already in volts to a min/max envelope with buckets of exactly 2^level samples
+
+	@param out		Output, 2*ceil(count / 2^level) values
+ */
+void MinMaxDecimatePow2(const double* in, size_t count, float* out, int level)
+{
+	size_t full = count >> level;
+	if(full)
+		MinMaxDecimate(in, full << level, out, full);
+
+	size_t done = full << level;
+	if(done < count)
+		MinMaxDecimate(in + done, count - done, out + full*2, 1);
+}
+
+/**
+	@brief Builds the next pyramid level up by merging adjacent pairs of min/max buckets
+
+	@param in		Input envelope, 2*buckets values
+	@param buckets	Number of input buckets
+	@param out		Output envelope, 2*ceil(buckets/2) values
+ */
+void MinMaxMerge(const float* in, size_t buckets, float* out)
+{
+	size_t i = 0;
+
+#ifdef __x86_64__
+	//Four input buckets in, two out.
+	//Pairing up {min0, max0, min2, max2} with {min1, max1, min3, max3} leaves the merged mins in the even lanes of
+	//one result and the merged maxes in the odd lanes of the other, so two shuffles put them back in order.
+	for(; i + 4 <= buckets; i += 4)
+	{
+		__m128 a = _mm_loadu_ps(in + i*2);
+		__m128 b = _mm_loadu_ps(in + i*2 + 4);
+		__m128 even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 1, 0));
+		__m128 odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 2, 3, 2));
+		__m128 mins = _mm_min_ps(even, odd);
+		__m128 maxs = _mm_max_ps(even, odd);
+		__m128 r = _mm_shuffle_ps(mins, maxs, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_ps(out + i, _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+#endif
+
+	for(; i + 2 <= buckets; i += 2)
+	{
+		out[i] = min(in[i*2], in[i*2 + 2]);
+		out[i + 1] = max(in[i*2 + 1], in[i*2 + 3]);
+	}
+
+	//Odd bucket out just carries over
+	if(i < buckets)
+	{
+		out[i] = in[i*2];
+		out[i + 1] = in[i*2 + 1];
+	}
+}
+
+/**
+	@brief Figures out the size and position of each pyramid level for a waveform
+
+	Levels go from 0 (one bucket per sample) up to the first level with a single bucket. Only levels from
+	PYRAMID_BASE_LEVEL up are stored, one after another.
+
+	@param count	Number of samples in the waveform
+	@param buckets	Number of buckets in each level
+	@param offsets	Position of each stored level in the pyramid, in floats (zero for unstored levels)
+
+	@return Total size of the pyramid, in floats
+ */
+size_t GetPyramidLayout(size_t count, vector<size_t>& buckets, vector<size_t>& offsets)
+{
+	buckets.clear();
+	offsets.clear();
+
+	size_t total = 0;
+	for(int level=0; ; level++)
+	{
+		size_t n = (count + (1ULL << level) - 1) >> level;
+		buckets.push_back(n);
+		offsets.push_back(0);
+
+		if(level >= PYRAMID_BASE_LEVEL)
+		{
+			offsets[level] = total;
+			total += n*2;
+		}
+
+		if(n <= 1)
+			break;
+	}
+
+	return total;
+}
+
+/**
+	@brief Folds samples into a running min/max (used for the tail of each bucket, or everything without SIMD)
+ */
+static void MinMaxScalar(const int16_t* in, size_t count, int16_t& vmin, int16_t& vmax)
+{
+	for(size_t i=0; i<count; i++)
+	{
+		vmin = min(vmin, in[i]);
+		vmax = max(vmax, in[i]);
+	}
+}
+
+static void MinMaxScalar(const double* in, size_t count, double& vmin, double& vmax)
+{
+	for(size_t i=0; i<count; i++)
+	{
+		vmin = min(vmin, in[i]);
+		vmax = max(vmax, in[i]);
+	}
+}
@@ -29,6 +29,10 @@
 
 #include "wfmserver.h"
 #include "DigilentSCPIServer.h"
+#include "CaptureRecorder.h"
+#include "CaptureReplay.h"
+#include "ScopeDevice.h"
+#include "AcquisitionConfig.h"
 
 using namespace std;
 
@@ -49,10 +53,65 @@ map<size_t, bool> g_channelOn;
 size_t g_memDepth = 1000000;
 int64_t g_sampleInterval = 0;	//in fs
 
-//Copy of state at timestamp of last arm event
-map<size_t, bool> g_channelOnDuringArm;
-int64_t g_sampleIntervalDuringArm = 0;
-size_t g_captureMemDepth = 0;
+//Data plane sample encoding (per session)
+SampleFormat g_sampleFormat = FORMAT_FLOAT64;
+WaveformCodec g_codec = CODEC_NONE;
+
+//Re-arm before sending the previous capture to the client
+bool g_pipelineEnabled = false;
+
+//What to do when the client falls behind
+OverflowPolicy g_overflowPolicy = OVERFLOW_BLOCK;
+
+//Triggered captures or continuous streaming
+AcquisitionMode g_acquisitionMode = ACQUISITION_TRIGGERED;
+
+//Number of back-to-back triggers delivered as one frame (1 = normal capture)
+size_t g_segmentCount = 1;
+
+//Region of interest: first sample relative to the trigger, and length (0 = whole record)
+int64_t g_roiStart = 0;
+size_t g_roiLength = 0;
+
+//Min/max envelope preview (0 buckets = off)
+size_t g_previewBuckets = 0;
+PreviewMode g_previewMode = PREVIEW_AHEAD;
+
+//Build min/max pyramids so the client can fetch tiles of the last capture
+bool g_pyramidEnabled = false;
+
+//Number of captures averaged into each frame (1 = off)
+size_t g_averageCount = 1;
+
+//Persistence histogram grid (0 columns = off) and how often it's sent to the client
+size_t g_persistColumns = 0;
+size_t g_persistRows = 256;
+double g_persistRate = 30;
+
+//Spectrum mode and its settings
+SpectrumMode g_spectrumMode = SPECTRUM_OFF;
+FFTWindow g_fftWindow = WINDOW_HANN;
+size_t g_spectrumAverages = 1;
+bool g_peakHold = false;
+size_t g_spectrogramBins = 1024;
+
+//Data plane header extension version (0 = legacy header only)
+size_t g_headerVersion = 0;
+
+//Configuration captures are being made with, as of the last time it changed (see AcquisitionConfig)
+shared_ptr<const AcquisitionConfig> g_armedConfig;
+
+//Incremented every time the trigger is armed, so the waveform thread can tell if it was reconfigured mid-burst
+size_t g_armCount = 0;
+
+//Host time of the last arm event (ns since the Unix epoch), for timestamping frames only
+int64_t g_armTime = 0;
+
+//Time of the last arm event on the steady clock, for scheduling (unaffected by changes to the system clock)
+chrono::steady_clock::time_point g_armSteadyTime;
+
+//Set when a new record starts, so the stream sample counter starts over
+bool g_streamRestarted = false;
 
 bool g_triggerArmed = false;
 bool g_triggerOneShot = false;
@@ -61,7 +120,6 @@ bool g_memDepthChanged = false;
 //Trigger state (for now, only simple edge trigger supported)
 double g_triggerVoltage = 0;
 size_t g_triggerChannel = 0;
-size_t g_triggerSampleIndex;
 int64_t g_triggerDelay;
 double g_triggerDeltaSec;
 
@@ -78,6 +136,7 @@ bool EnableMsoPod(size_t npod);
 bool g_lastTriggerWasForced = false;
 */
 std::mutex g_mutex;
+std::condition_variable g_armCond;
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Construction / destruction
@@ -86,17 +145,52 @@ DigilentSCPIServer::DigilentSCPIServer(ZSOCKET sock)
 	: BridgeSCPIServer(sock)
 {
 	//Reset the device to default configuration
-	if(!FDwfAnalogInReset(g_hScope))
+	if(!g_replay && !g_device->Reset())
 	{
-		LogError("FDwfAnalogInReset failed\n");
+		LogError("Device reset failed\n");
 		exit(1);
 	}
+
+	//New client gets the legacy data plane format until it asks for something else
+	g_sampleFormat = FORMAT_FLOAT64;
+	g_codec = CODEC_NONE;
+	g_pipelineEnabled = false;
+	g_overflowPolicy = OVERFLOW_BLOCK;
+	g_acquisitionMode = ACQUISITION_TRIGGERED;
+	g_segmentCount = 1;
+	g_roiStart = 0;
+	g_roiLength = 0;
+	g_previewBuckets = 0;
+	g_previewMode = PREVIEW_AHEAD;
+	g_pyramidEnabled = false;
+	g_averageCount = 1;
+	g_averageProgress = 0;
+	g_persistColumns = 0;
+	g_persistRows = 256;
+	g_persistRate = 30;
+	g_spectrumMode = SPECTRUM_OFF;
+	g_fftWindow = WINDOW_HANN;
+	g_spectrumAverages = 1;
+	g_peakHold = false;
+	g_spectrogramBins = 1024;
+	g_headerVersion = 0;
+	g_framesDropped = 0;
+	g_samplesLost = 0;
+	g_samplesCorrupt = 0;
+
+	//Unless we're replaying, in which case it's whatever the recording was made with
+	if(g_replay)
+		g_replay->ApplyWireFormat();
 }
 
 DigilentSCPIServer::~DigilentSCPIServer()
 {
+	//Don't leave a recording open for the next client
+	StopRecording();
+
 	//Reset the device to default configuration
-	FDwfAnalogInReset(g_hScope);
+	if(!g_replay)
+		g_device->Reset();
 	LogVerbose("Client disconnected\n");
 }
 
@@ -141,6 +235,263 @@ bool DigilentSCPIServer::OnQuery(
 	if(BridgeSCPIServer::OnQuery(line, subject, cmd))
 		return true;
 
+	else if(cmd == "FORMAT")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		switch(g_sampleFormat)
+		{
+			case FORMAT_INT16:
+				SendReply("INT16");
+				break;
+
+			case FORMAT_FLOAT32:
+				SendReply("FLOAT32");
+				break;
+
+			case FORMAT_PACKED:
+				SendReply("PACKED");
+				break;
+
+			case FORMAT_FLOAT64:
+			default:
+				SendReply("FLOAT64");
+				break;
+		}
+		return true;
+	}
+
+	else if(cmd == "CODEC")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		if(g_codec == CODEC_DELTA_RICE)
+			SendReply("DELTARICE");
+		else
+			SendReply("NONE");
+		return true;
+	}
+
+	else if(cmd == "DEADTIME")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_deadTimeRatio));
+		return true;
+	}
+
+	else if(cmd == "POLLS")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_pollsPerCapture));
+		return true;
+	}
+
+	else if(cmd == "DROPPED")
+	{
+		SendReply(to_string(g_framesDropped.load()));
+		return true;
+	}
+
+	else if(cmd == "BITS")
+	{
+		SendReply(to_string(g_adcBits));
+		return true;
+	}
+
+	else if(cmd == "ACQMODE")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		if(g_acquisitionMode == ACQUISITION_STREAM)
+			SendReply("STREAM");
+		else
+			SendReply("TRIGGERED");
+		return true;
+	}
+
+	else if(cmd == "SEGMENTS")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_segmentCount));
+		return true;
+	}
+
+	else if(cmd == "HEADERVERSION")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_headerVersion));
+		return true;
+	}
+
+	else if(cmd == "ROISTART")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_roiStart));
+		return true;
+	}
+
+	else if(cmd == "ROILENGTH")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_roiLength));
+		return true;
+	}
+
+	else if(cmd == "PREVIEW")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_previewBuckets));
+		return true;
+	}
+
+	else if(cmd == "PREVIEWMODE")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		if(g_previewMode == PREVIEW_ONLY)
+			SendReply("ONLY");
+		else
+			SendReply("AHEAD");
+		return true;
+	}
+
+	else if(cmd == "PYRAMID")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(g_pyramidEnabled ? "ON" : "OFF");
+		return true;
+	}
+
+	else if(cmd == "AVERAGE")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_averageCount));
+		return true;
+	}
+
+	else if(cmd == "AVGCOUNT")
+	{
+		SendReply(to_string(g_averageProgress.load()));
+		return true;
+	}
+
+	else if(cmd == "PERSISTCOLS")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_persistColumns));
+		return true;
+	}
+
+	else if(cmd == "PERSISTROWS")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_persistRows));
+		return true;
+	}
+
+	else if(cmd == "PERSISTRATE")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_persistRate));
+		return true;
+	}
+
+	else if(cmd == "SPECTRUM")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		switch(g_spectrumMode)
+		{
+			case SPECTRUM_BINS:
+				SendReply("BINS");
+				break;
+
+			case SPECTRUM_ROWS:
+				SendReply("ROWS");
+				break;
+
+			case SPECTRUM_OFF:
+			default:
+				SendReply("OFF");
+				break;
+		}
+		return true;
+	}
+
+	else if(cmd == "WINDOW")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		switch(g_fftWindow)
+		{
+			case WINDOW_HANN:
+				SendReply("HANN");
+				break;
+
+			case WINDOW_HAMMING:
+				SendReply("HAMMING");
+				break;
+
+			case WINDOW_BLACKMAN_HARRIS:
+				SendReply("BLACKMANHARRIS");
+				break;
+
+			case WINDOW_RECTANGULAR:
+			default:
+				SendReply("RECT");
+				break;
+		}
+		return true;
+	}
+
+	else if(cmd == "SPECAVG")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_spectrumAverages));
+		return true;
+	}
+
+	else if(cmd == "PEAKHOLD")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(g_peakHold ? "ON" : "OFF");
+		return true;
+	}
+
+	else if(cmd == "SPECROWBINS")
+	{
+		lock_guard<mutex> lock(g_mutex);
+		SendReply(to_string(g_spectrogramBins));
+		return true;
+	}
+
+	else if(cmd == "LOST")
+	{
+		SendReply(to_string(g_samplesLost.load()));
+		return true;
+	}
+
+	else if(cmd == "RECFRAMES")
+	{
+		auto recorder = GetRecorder();
+		SendReply(to_string(recorder ? recorder->GetFramesRecorded() : 0));
+		return true;
+	}
+
+	else if(cmd == "RECDROPPED")
+	{
+		auto recorder = GetRecorder();
+		SendReply(to_string(recorder ? recorder->GetFramesDropped() : 0));
+		return true;
+	}
+
+	else if(cmd == "RECRATE")
+	{
+		auto recorder = GetRecorder();
+		SendReply(to_string(recorder ? recorder->GetAverageRate() : 0));
+		return true;
+	}
+
+	else if(cmd == "CORRUPT")
+	{
+		SendReply(to_string(g_samplesCorrupt.load()));
+		return true;
+	}
+
 	//TODO: handle commands not implemented by the base class
 	LogWarning("Unrecognized query received: %s\n", line.c_str());
 
@@ -176,16 +527,11 @@ vector<size_t> DigilentSCPIServer::GetSampleRates()
 {
 	vector<size_t> rates;
 
-	double minFreq;
-	double maxFreq;
-	if(!FDwfAnalogInFrequencyInfo(g_hScope, &minFreq, &maxFreq))
-		LogError("FDwfAnalogInFrequencyInfo failed\n");
-
 	//Cap min freq to 1 kHz
-	minFreq = max(minFreq, 1000.0);
+	double minFreq = max(g_minSampleRate, 1000.0);
 
 	//Report sample rates in 1-2-5 steps
-	double freq = maxFreq;
+	double freq = g_maxSampleRate;
 	while(freq >= minFreq)
 	{
 		rates.push_back(freq);
@@ -200,10 +546,15 @@ vector<size_t> DigilentSCPIServer::GetSampleRates()
 
 vector<size_t> DigilentSCPIServer::GetSampleDepths()
 {
-	int bufsizeMin;
-	int bufsizeMax;
-	if(!FDwfAnalogInBufferSizeInfo(g_hScope, &bufsizeMin, &bufsizeMax))
-		LogError("FDwfAnalogInBufferSizeInfo failed\n");
+	return GetSupportedSampleDepths();
+}
+
+/**
+	@brief Lists the memory depths offered to clients
+ */
+vector<size_t> DigilentSCPIServer::GetSupportedSampleDepths()
+{
+	int bufsizeMax = g_maxMemDepth;
 
 	//report sizes in 1-2-5 steps from 10k to whatever the maximum is
 	vector<size_t> depths;
@@ -243,14 +594,415 @@ bool DigilentSCPIServer::OnCommand(
 			return false;
 
 		double requestedAtten = stod(args[0]);
-		if(!FDwfAnalogInChannelAttenuationSet(g_hScope, channelId, requestedAtten))
-			LogError("FDwfAnalogInChannelAttenuationSet failed\n");
+		if(!g_replay && !g_device->ChannelAttenuationSet(channelId, requestedAtten))
+			LogError("ChannelAttenuationSet failed\n");
 
 		//need to re-arm trigger to apply changes
 		if(g_triggerArmed)
 			Start();
 	}
 
+	else if( (cmd == "FORMAT") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		SampleFormat format;
+		if(args[0] == "INT16")
+			format = FORMAT_INT16;
+		else if(args[0] == "FLOAT32")
+			format = FORMAT_FLOAT32;
+		else if(args[0] == "FLOAT64")
+			format = FORMAT_FLOAT64;
+		else if(args[0] == "PACKED")
+			format = FORMAT_PACKED;
+		else
+		{
+			LogWarning("Unrecognized sample format %s\n", args[0].c_str());
+			return false;
+		}
+		if( (format != g_sampleFormat) && IsWireFormatLocked(cmd) )
+			return false;
+		g_sampleFormat = format;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "PIPELINE") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		if(args[0] == "ON")
+			g_pipelineEnabled = true;
+		else if(args[0] == "OFF")
+			g_pipelineEnabled = false;
+		else
+			return false;
+	}
+
+	else if( (cmd == "OVERFLOW") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		if(args[0] == "BLOCK")
+			g_overflowPolicy = OVERFLOW_BLOCK;
+		else if(args[0] == "DROPOLDEST")
+			g_overflowPolicy = OVERFLOW_DROP_OLDEST;
+		else if(args[0] == "LATEST")
+			g_overflowPolicy = OVERFLOW_KEEP_LATEST;
+		else
+		{
+			LogWarning("Unrecognized overflow policy %s\n", args[0].c_str());
+			return false;
+		}
+	}
+
+	else if( (cmd == "ACQMODE") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		AcquisitionMode mode;
+		if(args[0] == "TRIGGERED")
+			mode = ACQUISITION_TRIGGERED;
+		else if(args[0] == "STREAM")
+			mode = ACQUISITION_STREAM;
+		else
+		{
+			LogWarning("Unrecognized acquisition mode %s\n", args[0].c_str());
+			return false;
+		}
+		if( (mode != g_acquisitionMode) && IsWireFormatLocked(cmd) )
+			return false;
+		g_acquisitionMode = mode;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "SEGMENTS") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		int segments = stoi(args[0]);
+		if(segments < 1)
+		{
+			LogWarning("Invalid segment count %s\n", args[0].c_str());
+			return false;
+		}
+		if( (segments > 1) && (segments * g_memDepth > MAX_BURST_SAMPLES) )
+		{
+			LogWarning("Segment count %s too large, bursts are limited to %d samples per channel\n",
+				args[0].c_str(), MAX_BURST_SAMPLES);
+			return false;
+		}
+		g_segmentCount = segments;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "HEADERVERSION") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		//Clients ask for the newest version they understand, then read back what they got
+		int version = stoi(args[0]);
+		if( (version < 0) || (version > MAX_HEADER_VERSION) )
+		{
+			LogWarning("Unsupported header version %s\n", args[0].c_str());
+			return false;
+		}
+		if( (static_cast<size_t>(version) != g_headerVersion) && IsWireFormatLocked(cmd) )
+			return false;
+		g_headerVersion = version;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "ROISTART") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+		g_roiStart = stoll(args[0]);
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "ROILENGTH") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		long long length = stoll(args[0]);
+		if(length < 0)
+		{
+			LogWarning("Invalid region of interest length %s\n", args[0].c_str());
+			return false;
+		}
+		g_roiLength = length;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "PREVIEW") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		int buckets = stoi(args[0]);
+		if( (buckets < 0) || (buckets > MAX_PREVIEW_BUCKETS) )
+		{
+			LogWarning("Invalid preview bucket count %s\n", args[0].c_str());
+			return false;
+		}
+		if( (static_cast<size_t>(buckets) != g_previewBuckets) && IsWireFormatLocked(cmd) )
+			return false;
+		g_previewBuckets = buckets;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "PREVIEWMODE") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		PreviewMode mode;
+		if(args[0] == "AHEAD")
+			mode = PREVIEW_AHEAD;
+		else if(args[0] == "ONLY")
+			mode = PREVIEW_ONLY;
+		else
+		{
+			LogWarning("Unrecognized preview mode %s\n", args[0].c_str());
+			return false;
+		}
+		if( (mode != g_previewMode) && IsWireFormatLocked(cmd) )
+			return false;
+		g_previewMode = mode;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "PYRAMID") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		bool enabled;
+		if(args[0] == "ON")
+			enabled = true;
+		else if(args[0] == "OFF")
+			enabled = false;
+		else
+			return false;
+		if( (enabled != g_pyramidEnabled) && IsWireFormatLocked(cmd) )
+			return false;
+		g_pyramidEnabled = enabled;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "AVERAGE") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		int count = stoi(args[0]);
+		if(count < 1)
+		{
+			LogWarning("Invalid average count %s\n", args[0].c_str());
+			return false;
+		}
+		if( (static_cast<size_t>(count) != g_averageCount) && IsWireFormatLocked(cmd) )
+			return false;
+		g_averageCount = count;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "PERSISTCOLS") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		int cols = stoi(args[0]);
+		if( (cols < 0) || (cols > MAX_PERSIST_COLUMNS) )
+		{
+			LogWarning("Invalid persistence column count %s\n", args[0].c_str());
+			return false;
+		}
+		if( (static_cast<size_t>(cols) != g_persistColumns) && IsWireFormatLocked(cmd) )
+			return false;
+		g_persistColumns = cols;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "PERSISTROWS") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		int rows = stoi(args[0]);
+		if( (rows < 1) || (rows > MAX_PERSIST_ROWS) )
+		{
+			LogWarning("Invalid persistence row count %s\n", args[0].c_str());
+			return false;
+		}
+		g_persistRows = rows;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "PERSISTRATE") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		double rate = stod(args[0]);
+		if(!(rate > 0))
+		{
+			LogWarning("Invalid persistence update rate %s\n", args[0].c_str());
+			return false;
+		}
+		g_persistRate = rate;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if(cmd == "PERSISTCLEAR")
+		g_persistClear = true;
+
+	else if( (cmd == "SPECTRUM") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		SpectrumMode mode;
+		if(args[0] == "OFF")
+			mode = SPECTRUM_OFF;
+		else if(args[0] == "BINS")
+			mode = SPECTRUM_BINS;
+		else if(args[0] == "ROWS")
+			mode = SPECTRUM_ROWS;
+		else
+		{
+			LogWarning("Unrecognized spectrum mode %s\n", args[0].c_str());
+			return false;
+		}
+		if( (mode != g_spectrumMode) && IsWireFormatLocked(cmd) )
+			return false;
+		g_spectrumMode = mode;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "WINDOW") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		if(args[0] == "RECT")
+			g_fftWindow = WINDOW_RECTANGULAR;
+		else if(args[0] == "HANN")
+			g_fftWindow = WINDOW_HANN;
+		else if(args[0] == "HAMMING")
+			g_fftWindow = WINDOW_HAMMING;
+		else if(args[0] == "BLACKMANHARRIS")
+			g_fftWindow = WINDOW_BLACKMAN_HARRIS;
+		else
+		{
+			LogWarning("Unrecognized window %s\n", args[0].c_str());
+			return false;
+		}
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "SPECAVG") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		int count = stoi(args[0]);
+		if(count < 1)
+		{
+			LogWarning("Invalid spectrum average count %s\n", args[0].c_str());
+			return false;
+		}
+		g_spectrumAverages = count;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "PEAKHOLD") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		if(args[0] == "ON")
+			g_peakHold = true;
+		else if(args[0] == "OFF")
+			g_peakHold = false;
+		else
+			return false;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if( (cmd == "SPECROWBINS") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		int bins = stoi(args[0]);
+		if(bins < 1)
+		{
+			LogWarning("Invalid spectrogram width %s\n", args[0].c_str());
+			return false;
+		}
+		g_spectrogramBins = bins;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
+	else if(cmd == "SPECCLEAR")
+		g_spectrumClear = true;
+
+	else if( (cmd == "RECORD") && (args.size() == 1) )
+	{
+		//Not tied to the arm state, recording picks up with the next frame sent
+		if(!StartRecording(args[0]))
+			return false;
+	}
+
+	else if(cmd == "RECORDSTOP")
+		StopRecording();
+
+	else if( (cmd == "CODEC") && (args.size() == 1) )
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		WaveformCodec codec;
+		if(args[0] == "DELTARICE")
+			codec = CODEC_DELTA_RICE;
+		else if(args[0] == "NONE")
+			codec = CODEC_NONE;
+		else
+		{
+			LogWarning("Unrecognized codec %s\n", args[0].c_str());
+			return false;
+		}
+		if( (codec != g_codec) && IsWireFormatLocked(cmd) )
+			return false;
+		g_codec = codec;
+
+		//Takes effect at the next arm
+		RestartTriggerIfArmed();
+	}
+
 	//Unknown
 	else
 	{
@@ -267,6 +1019,30 @@ bool DigilentSCPIServer::OnCommand(
 	return true;
 }
 
+/**
+	@brief Checks if a setting that changes how clients parse frames is fixed right now, and warns if so
+
+	Replayed frames go out as they were recorded, and a recording's metadata says what settings its frames were made
+	with, so these can't change while replaying or recording.
+ */
+bool DigilentSCPIServer::IsWireFormatLocked(const string& cmd)
+{
+	if(g_replay)
+	{
+		LogWarning("Can't change %s while replaying a recording\n", cmd.c_str());
+		return true;
+	}
+
+	auto recorder = GetRecorder();
+	if(recorder && recorder->IsRecording())
+	{
+		LogWarning("Can't change %s while recording\n", cmd.c_str());
+		return true;
+	}
+
+	return false;
+}
+
 void DigilentSCPIServer::AcquisitionStart(bool oneShot)
 {
 	lock_guard<mutex> lock(g_mutex);
@@ -325,8 +1101,8 @@ void DigilentSCPIServer::SetChannelEnabled(size_t chIndex, bool enabled)
 	lock_guard<mutex> lock(g_mutex);
 	g_channelOn[chIndex] = enabled;
 
-	if(!FDwfAnalogInChannelEnableSet(g_hScope, chIndex, enabled))
-		LogError("FDwfAnalogInChannelEnableSet failed\n");
+	if(!g_replay && !g_device->ChannelEnableSet(chIndex, enabled))
+		LogError("ChannelEnableSet failed\n");
 
 	//We need to allocate new buffers for this channel
 	g_memDepthChanged = true;
@@ -343,15 +1119,15 @@ void DigilentSCPIServer::SetAnalogCoupling(size_t chIndex, const std::string& co
 	else// if(coupling == "AC1M")
 		coup = DwfAnalogCouplingAC;
 
-	if(!FDwfAnalogInChannelCouplingSet(g_hScope, chIndex, coup))
-		LogError("FDwfAnalogInChannelCouplingSet failed\n");
+	if(!g_replay && !g_device->ChannelCouplingSet(chIndex, coup))
+		LogError("ChannelCouplingSet failed\n");
 }
 
 void DigilentSCPIServer::SetAnalogRange(size_t chIndex, double range_V)
 {
 	lock_guard<mutex> lock(g_mutex);
-	if(!FDwfAnalogInChannelRangeSet(g_hScope, chIndex, range_V))
-		LogError("FDwfAnalogInChannelRangeSet failed\n");
+	if(!g_replay && !g_device->ChannelRangeSet(chIndex, range_V))
+		LogError("ChannelRangeSet failed\n");
 
 	RestartTriggerIfArmed();
 }
@@ -360,8 +1136,8 @@ void DigilentSCPIServer::SetAnalogOffset(size_t chIndex, double offset_V)
 {
 	lock_guard<mutex> lock(g_mutex);
 
-	if(!FDwfAnalogInChannelOffsetSet(g_hScope, chIndex, offset_V))
-		LogError("FDwfAnalogInChannelOffsetSet failed\n");
+	if(!g_replay && !g_device->ChannelOffsetSet(chIndex, offset_V))
+		LogError("ChannelOffsetSet failed\n");
 
 	RestartTriggerIfArmed();
 }
@@ -380,8 +1156,8 @@ void DigilentSCPIServer::SetSampleRate(uint64_t rate_hz)
 {
 	lock_guard<mutex> lock(g_mutex);
 
-	if(!FDwfAnalogInFrequencySet(g_hScope, rate_hz))
-		LogError("FDwfAnalogInFrequencySet failed\n");
+	if(!g_replay && !g_device->FrequencySet(rate_hz))
+		LogError("FrequencySet failed\n");
 	g_sampleInterval = FS_PER_SECOND / rate_hz;
 
 	RestartTriggerIfArmed();
@@ -391,8 +1167,8 @@ void DigilentSCPIServer::SetSampleDepth(uint64_t depth)
 {
 	lock_guard<mutex> lock(g_mutex);
 	g_memDepth = depth;
-	if(!FDwfAnalogInBufferSizeSet(g_hScope, g_memDepth))
-		LogError("FDwfAnalogInBufferSizeSet failed\n");
+	if(!g_replay && !g_device->BufferSizeSet(g_memDepth))
+		LogError("BufferSizeSet failed\n");
 
 	g_memDepthChanged = true;
 
@@ -413,11 +1189,11 @@ void DigilentSCPIServer::SetTriggerDelay(uint64_t delay_fs)
 	//After setting trigger time, see what we actually got.
 	//Hardware may round it.
 	double position_sec_requested = position_fs * SECONDS_PER_FS;
-	if(!FDwfAnalogInTriggerPositionSet(g_hScope, position_sec_requested))
-		LogError("FDwfAnalogInTriggerPositionSet failed\n");
-	double position_sec_actual;
-	if(!FDwfAnalogInTriggerPositionGet(g_hScope, &position_sec_actual))
-		LogError("FDwfAnalogInTriggerPositionGet failed\n");
+	if(!g_replay && !g_device->TriggerPositionSet(position_sec_requested))
+		LogError("TriggerPositionSet failed\n");
+	double position_sec_actual = position_sec_requested;
+	if(!g_replay && !g_device->TriggerPositionGet(position_sec_actual))
+		LogError("TriggerPositionGet failed\n");
 
 	g_triggerDeltaSec = position_sec_actual - position_sec_requested;
 
@@ -428,15 +1204,15 @@ void DigilentSCPIServer::SetTriggerSource(size_t chIndex)
 {
 	lock_guard<mutex> lock(g_mutex);
 
-	if(!FDwfAnalogInTriggerSourceSet(g_hScope, trigsrcDetectorAnalogIn))
-		LogError("FDwfAnalogInTriggerSourceSet failed\n");
+	if(!g_replay && !g_device->TriggerSourceSet(trigsrcDetectorAnalogIn))
+		LogError("TriggerSourceSet failed\n");
 
-	if(!FDwfAnalogInTriggerAutoTimeoutSet(g_hScope, 0))
-		LogError("FDwfAnalogInTriggerAutoTimeoutSet failed\n");
+	if(!g_replay && !g_device->TriggerAutoTimeoutSet(0))
+		LogError("TriggerAutoTimeoutSet failed\n");
 
 	g_triggerChannel = chIndex;
-	if(!FDwfAnalogInTriggerChannelSet(g_hScope, g_triggerChannel))
-		LogError("FDwfAnalogInTriggerChannelSet failed\n");
+	if(!g_replay && !g_device->TriggerChannelSet(g_triggerChannel))
+		LogError("TriggerChannelSet failed\n");
 
 	RestartTriggerIfArmed();
 }
@@ -446,8 +1222,8 @@ void DigilentSCPIServer::SetTriggerLevel(double level_V)
 	lock_guard<mutex> lock(g_mutex);
 
 	g_triggerVoltage = level_V;
-	if(!FDwfAnalogInTriggerLevelSet(g_hScope, g_triggerVoltage))
-		LogError("FDwfAnalogInTriggerLevelSet failed\n");
+	if(!g_replay && !g_device->TriggerLevelSet(g_triggerVoltage))
+		LogError("TriggerLevelSet failed\n");
 
 	RestartTriggerIfArmed();
 }
@@ -455,8 +1231,8 @@ void DigilentSCPIServer::SetTriggerLevel(double level_V)
 void DigilentSCPIServer::SetTriggerTypeEdge()
 {
 	lock_guard<mutex> lock(g_mutex);
-	if(!FDwfAnalogInTriggerTypeSet(g_hScope, trigtypeEdge))
-		LogError("FDwfAnalogInTriggerTypeSet failed\n");
+	if(!g_replay && !g_device->TriggerTypeSet(trigtypeEdge))
+		LogError("TriggerTypeSet failed\n");
 
 	RestartTriggerIfArmed();
 }
@@ -473,16 +1249,18 @@ void DigilentSCPIServer::SetEdgeTriggerEdge(const std::string& edge)
 	else// if(edge == "ANY")
 		condition = DwfTriggerSlopeEither;
 
-	if(!FDwfAnalogInTriggerConditionSet(g_hScope, condition))
-		LogError("FDwfAnalogInTriggerConditionSet failed\n");
+	if(!g_replay && !g_device->TriggerConditionSet(condition))
+		LogError("TriggerConditionSet failed\n");
 
 	RestartTriggerIfArmed();
 }
 
 void DigilentSCPIServer::Stop()
 {
-	FDwfAnalogInConfigure(g_hScope, true, false);
+	if(!g_replay)
+		g_device->Configure(true, false);
 	g_triggerArmed = false;
+	g_armCond.notify_all();
 
 	//Convert any in-progress trigger to one shot.
 	//This ensures that if a waveform is halfway through being downloaded, we won't re-arm the trigger after it finishes.
@@ -491,25 +1269,130 @@ void DigilentSCPIServer::Stop()
 
 void DigilentSCPIServer::Start(bool force)
 {
-	//Save configuration
-	g_captureMemDepth = g_memDepth;
-	g_channelOnDuringArm = g_channelOn;
-	g_sampleIntervalDuringArm = g_sampleInterval;
-	/*
-	for(size_t i=0; i<g_numDigitalPods; i++)
-		g_msoPodEnabledDuringArm[i] = g_msoPodEnabled[i];
-	*/
-
-	//Precalculate some stuff we need for trigger interpolation
-	g_triggerSampleIndex = g_triggerDelay / g_sampleInterval;
+	//Publish the configuration to capture with, unless it's the same as last time
+	if(!g_armedConfig || ConfigurationChanged(*g_armedConfig))
+		PublishConfiguration();
+	g_armCount ++;
+	g_armTime = GetHostTimestamp();
+	g_armSteadyTime = chrono::steady_clock::now();
+
+	//Replaying? Arming just starts (or resumes) sending recorded frames
+	if(g_replay)
+	{
+		g_triggerArmed = true;
+		g_armCond.notify_all();
+		return;
+	}
 
-	//Set acquisition mode
-	FDwfAnalogInAcquisitionModeSet(g_hScope, acqmodeSingle);
+	//Set acquisition mode. Streaming records forever (length 0) once triggered, in chunks of up to one buffer.
+	if(g_armedConfig->m_acquisitionMode == ACQUISITION_STREAM)
+	{
+		g_device->AcquisitionModeSet(acqmodeRecord);
+		g_device->RecordLengthSet(0);
+		g_streamRestarted = true;
+	}
+	else
+		g_device->AcquisitionModeSet(acqmodeSingle);
 
 	//Start acquisition
-	FDwfAnalogInConfigure(g_hScope, true, true);
+	g_device->Configure(true, true);
 
 	g_triggerArmed = true;
+	g_armCond.notify_all();
+}
+
+/**
+	@brief Checks if any setting that captures are made with differs from a configuration
+
+	Must be called with g_mutex held.
+ */
+bool DigilentSCPIServer::ConfigurationChanged(const AcquisitionConfig& config)
+{
+	return
+		(config.m_acquisitionMode != g_acquisitionMode) ||
+		(config.m_memDepth != g_memDepth) ||
+		(config.m_sampleInterval != g_sampleInterval) ||
+		(config.m_channelOn != g_channelOn) ||
+		(config.m_segmentCount != g_segmentCount) ||
+		(config.m_triggerChannel != g_triggerChannel) ||
+		(config.m_triggerVoltage != g_triggerVoltage) ||
+		(config.m_triggerSampleIndex != static_cast<size_t>(g_triggerDelay / g_sampleInterval)) ||
+		(config.m_triggerDeltaSec != g_triggerDeltaSec) ||
+		(config.m_sampleFormat != g_sampleFormat) ||
+		(config.m_codec != g_codec) ||
+		(config.m_headerVersion != g_headerVersion) ||
+		(config.m_roiStart != g_roiStart) ||
+		(config.m_roiLength != g_roiLength) ||
+		(config.m_previewBuckets != g_previewBuckets) ||
+		(config.m_previewMode != g_previewMode) ||
+		(config.m_pyramidEnabled != g_pyramidEnabled) ||
+		(config.m_averageCount != g_averageCount) ||
+		(config.m_persistColumns != g_persistColumns) ||
+		(config.m_persistRows != g_persistRows) ||
+		(config.m_persistRate != g_persistRate) ||
+		(config.m_spectrumMode != g_spectrumMode) ||
+		(config.m_fftWindow != g_fftWindow) ||
+		(config.m_spectrumAverages != g_spectrumAverages) ||
+		(config.m_peakHold != g_peakHold) ||
+		(config.m_spectrogramBins != g_spectrogramBins);
+}
+
+/**
+	@brief Snapshots the current settings into a new configuration, and makes it the one captures are made with
+
+	Must be called with g_mutex held.
+ */
+void DigilentSCPIServer::PublishConfiguration()
+{
+	auto config = make_shared<AcquisitionConfig>();
+	config->m_version = g_armedConfig ? (g_armedConfig->m_version + 1) : 1;
+
+	config->m_acquisitionMode = g_acquisitionMode;
+	config->m_memDepth = g_memDepth;
+	config->m_sampleInterval = g_sampleInterval;
+	config->m_channelOn = g_channelOn;
+	config->m_numChannelsOn = 0;
+	for(size_t i=0; i<g_numAnalogInChannels; i++)
+	{
+		if(g_channelOn[i])
+			config->m_numChannelsOn ++;
+	}
+	/*
+	for(size_t i=0; i<g_numDigitalPods; i++)
+	{
+		if(g_msoPodEnabled[i])
+			config->m_numChannelsOn ++;
+	}
+	*/
+	config->m_segmentCount = g_segmentCount;
+
+	//Precalculate some stuff we need for trigger interpolation
+	config->m_triggerChannel = g_triggerChannel;
+	config->m_triggerVoltage = g_triggerVoltage;
+	config->m_triggerSampleIndex = g_triggerDelay / g_sampleInterval;
+	config->m_triggerDeltaSec = g_triggerDeltaSec;
+
+	config->m_sampleFormat = g_sampleFormat;
+	config->m_codec = g_codec;
+	config->m_headerVersion = g_headerVersion;
+	config->m_roiStart = g_roiStart;
+	config->m_roiLength = g_roiLength;
+	config->m_previewBuckets = g_previewBuckets;
+	config->m_previewMode = g_previewMode;
+	config->m_pyramidEnabled = g_pyramidEnabled;
+
+	config->m_averageCount = g_averageCount;
+	config->m_persistColumns = g_persistColumns;
+	config->m_persistRows = g_persistRows;
+	config->m_persistRate = g_persistRate;
+	config->m_spectrumMode = g_spectrumMode;
+	config->m_fftWindow = g_fftWindow;
+	config->m_spectrumAverages = g_spectrumAverages;
+	config->m_peakHold = g_peakHold;
+	config->m_spectrogramBins = g_spectrogramBins;
+
+	g_armedConfig = config;
+	PublishConfig(config);
 }
 
 bool DigilentSCPIServer::IsTriggerArmed()
@@ -32,6 +32,8 @@
 
 #include "../../lib/scpi-server-tools/BridgeSCPIServer.h"
 
+struct AcquisitionConfig;
+
 /**
 	@brief SCPI server for managing control plane traffic to a single client
  */
@@ -42,6 +44,8 @@ public:
 	virtual ~DigilentSCPIServer();
 
 	static void Start(bool force = false);
+	static void Stop();
+	static std::vector<size_t> GetSupportedSampleDepths();
 
 protected:
 	virtual std::string GetMake();
@@ -92,7 +96,10 @@ protected:
 			Start(g_triggerOneShot);
 	}
 
-	void Stop();
+	bool IsWireFormatLocked(const std::string& cmd);
+
+	static bool ConfigurationChanged(const AcquisitionConfig& config);
+	static void PublishConfiguration();
 };
 
 #endif
@@ -0,0 +1,363 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of DwfDevice
+ */
+#include "wfmserver.h"
+#include "DwfDevice.h"
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+DwfDevice::DwfDevice()
+	: m_hdwf(hdwfNone)
+	, m_open(false)
+{
+}
+
+DwfDevice::~DwfDevice()
+{
+	Close();
+}
+
+/**
+	@brief Finds and opens the device, and fills in its description (model, serial, channel count)
+
+	@param host	Hostname or IP of an Ethernet device, or empty to use a USB device
+ */
+bool DwfDevice::Open(int device, int config, const string& host)
+{
+	//Dump the Digilent API version
+	char version[32] = "";
+	if(!FDwfGetVersion(version))
+	{
+		LogError("FDwfGetVersion failed\n");
+		return false;
+	}
+	LogDebug("Digilent API %s\n", version);
+
+	if(host.empty())
+	{
+		//Initial setup: enumerate devices
+		LogNotice("Looking for Digilent devices...\n");
+		int numDevices;
+		if(!FDwfEnum(enumfilterAll, &numDevices))
+		{
+			LogError("FDwfEnum failed\n");
+			return false;
+		}
+		LogDebug("%d devices found\n", numDevices);
+		if(numDevices == 0)
+		{
+			LogNotice("No devices found, exiting\n");
+			return false;
+		}
+
+		//Print out list of all devices found
+		char username[32];
+		char devname[32];
+		char serial[32];
+		for(int i=0; i<numDevices; i++)
+		{
+			LogIndenter li;
+
+			FDwfEnumUserName(i, username);
+			FDwfEnumDeviceName(i, devname);
+			FDwfEnumSN(i, serial);
+			LogVerbose("[%d] %s (user name %s), serial %s\n", i, devname, username, serial);
+		}
+
+		//Print out the selected device
+		FDwfEnumUserName(device, username);
+		FDwfEnumDeviceName(device, devname);
+		FDwfEnumSN(device, serial);
+		LogVerbose("Using device %d: %s (user name %s), serial %s\n", device, devname, username, serial);
+		g_model = devname;
+		g_serial = serial;
+		g_fwver = "FIXME";
+
+		//Enum configurations and decide which one to use
+		int configsFound;
+		LogVerbose("Checking possible device configurations...\n");
+		if(!FDwfEnumConfig(device, &configsFound))
+		{
+			LogError("FDwfEnumConfig failed\n");
+			return false;
+		}
+		LogDebug("%d configs found\n", configsFound);
+		{
+			LogIndenter li;
+			for(int i=0; i<configsFound; i++)
+			{
+				LogDebug("Config %d:\n", i);
+				LogIndenter li2;
+
+				int analogInCount;
+				int analogIOCount;
+				int analogOutCount;
+				int digitalInCount;
+				int digitalOutCount;
+				int digitalIOCount;
+
+				int analogInBufferSize;
+				int analogOutBufferSize;
+				int digitalInBufferSize;
+				int digitalOutBufferSize;
+
+				FDwfEnumConfigInfo(i, DECIAnalogInChannelCount, &analogInCount);
+				FDwfEnumConfigInfo(i, DECIAnalogOutChannelCount, &analogOutCount);
+				FDwfEnumConfigInfo(i, DECIAnalogIOChannelCount, &analogIOCount);
+				FDwfEnumConfigInfo(i, DECIDigitalInChannelCount, &digitalInCount);
+				FDwfEnumConfigInfo(i, DECIDigitalOutChannelCount, &digitalOutCount);
+				FDwfEnumConfigInfo(i, DECIDigitalIOChannelCount, &digitalIOCount);
+
+				FDwfEnumConfigInfo(i, DECIAnalogInBufferSize, &analogInBufferSize);
+				FDwfEnumConfigInfo(i, DECIAnalogOutBufferSize, &analogOutBufferSize);
+				FDwfEnumConfigInfo(i, DECIDigitalInBufferSize, &digitalInBufferSize);
+				FDwfEnumConfigInfo(i, DECIDigitalOutBufferSize, &digitalOutBufferSize);
+
+				LogDebug("Analog in:   %d\n", analogInCount);
+				LogDebug("Analog out:  %d\n", analogOutCount);
+				LogDebug("Analog IO:   %d\n", analogIOCount);
+				LogDebug("Digital in:  %d\n", digitalInCount);
+				LogDebug("Digital out: %d\n", digitalOutCount);
+				LogDebug("Digital IO:  %d\n", digitalIOCount);
+
+				g_numAnalogInChannels = analogInCount;
+
+				LogDebug("Analog buffer: %d in, %d out\n", analogInBufferSize, analogOutBufferSize);
+				LogDebug("Digital buffer: %d in, %d out\n", digitalInBufferSize, digitalOutBufferSize);
+			}
+		}
+
+		//Open the device
+		LogDebug("Opening device %d in config %d\n", device, config);
+		if(!FDwfDeviceConfigOpen(device, config, &m_hdwf))
+		{
+			LogError("Failed to open device\n");
+			return false;
+		}
+	}
+	else
+	{
+		LogDebug("Opening Ethernet device\n");
+
+		//TODO: figure out how to get this info
+		g_model = "Analog Discovery Pro 3450";
+		g_serial = "Unknown";
+		g_fwver = "FIXME";
+		g_numAnalogInChannels = 4;
+
+		string connstr = string("ip:") + host + "\nuser:admin\npass:admin\nsecure:1";
+		if(!FDwfDeviceOpenEx(connstr.c_str(), &m_hdwf))
+		{
+			LogError("Failed to open device\n");
+			return false;
+		}
+	}
+
+	m_open = true;
+	return true;
+}
+
+void DwfDevice::Close()
+{
+	if(m_open)
+		FDwfDeviceClose(m_hdwf);
+	m_open = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Capabilities
+
+bool DwfDevice::BitsInfo(int& bits)
+{
+	return FDwfAnalogInBitsInfo(m_hdwf, &bits);
+}
+
+bool DwfDevice::FrequencyInfo(double& minHz, double& maxHz)
+{
+	return FDwfAnalogInFrequencyInfo(m_hdwf, &minHz, &maxHz);
+}
+
+bool DwfDevice::BufferSizeInfo(int& minSize, int& maxSize)
+{
+	return FDwfAnalogInBufferSizeInfo(m_hdwf, &minSize, &maxSize);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Configuration
+
+bool DwfDevice::Reset()
+{
+	return FDwfAnalogInReset(m_hdwf);
+}
+
+bool DwfDevice::Configure(bool reconfigure, bool start)
+{
+	return FDwfAnalogInConfigure(m_hdwf, reconfigure, start);
+}
+
+bool DwfDevice::AcquisitionModeSet(ACQMODE mode)
+{
+	return FDwfAnalogInAcquisitionModeSet(m_hdwf, mode);
+}
+
+bool DwfDevice::RecordLengthSet(double seconds)
+{
+	return FDwfAnalogInRecordLengthSet(m_hdwf, seconds);
+}
+
+bool DwfDevice::FrequencySet(double hz)
+{
+	return FDwfAnalogInFrequencySet(m_hdwf, hz);
+}
+
+bool DwfDevice::BufferSizeSet(int size)
+{
+	return FDwfAnalogInBufferSizeSet(m_hdwf, size);
+}
+
+bool DwfDevice::ChannelEnableSet(int channel, bool enable)
+{
+	return FDwfAnalogInChannelEnableSet(m_hdwf, channel, enable);
+}
+
+bool DwfDevice::ChannelAttenuationSet(int channel, double attenuation)
+{
+	return FDwfAnalogInChannelAttenuationSet(m_hdwf, channel, attenuation);
+}
+
+bool DwfDevice::ChannelCouplingSet(int channel, DwfAnalogCoupling coupling)
+{
+	return FDwfAnalogInChannelCouplingSet(m_hdwf, channel, coupling);
+}
+
+bool DwfDevice::ChannelRangeSet(int channel, double volts)
+{
+	return FDwfAnalogInChannelRangeSet(m_hdwf, channel, volts);
+}
+
+bool DwfDevice::ChannelRangeGet(int channel, double& volts)
+{
+	return FDwfAnalogInChannelRangeGet(m_hdwf, channel, &volts);
+}
+
+bool DwfDevice::ChannelOffsetSet(int channel, double volts)
+{
+	return FDwfAnalogInChannelOffsetSet(m_hdwf, channel, volts);
+}
+
+bool DwfDevice::ChannelOffsetGet(int channel, double& volts)
+{
+	return FDwfAnalogInChannelOffsetGet(m_hdwf, channel, &volts);
+}
+
+bool DwfDevice::TriggerSourceSet(TRIGSRC source)
+{
+	return FDwfAnalogInTriggerSourceSet(m_hdwf, source);
+}
+
+bool DwfDevice::TriggerAutoTimeoutSet(double seconds)
+{
+	return FDwfAnalogInTriggerAutoTimeoutSet(m_hdwf, seconds);
+}
+
+bool DwfDevice::TriggerChannelSet(int channel)
+{
+	return FDwfAnalogInTriggerChannelSet(m_hdwf, channel);
+}
+
+bool DwfDevice::TriggerLevelSet(double volts)
+{
+	return FDwfAnalogInTriggerLevelSet(m_hdwf, volts);
+}
+
+bool DwfDevice::TriggerTypeSet(TRIGTYPE type)
+{
+	return FDwfAnalogInTriggerTypeSet(m_hdwf, type);
+}
+
+bool DwfDevice::TriggerConditionSet(DwfTriggerSlope slope)
+{
+	return FDwfAnalogInTriggerConditionSet(m_hdwf, slope);
+}
+
+bool DwfDevice::TriggerPositionSet(double seconds)
+{
+	return FDwfAnalogInTriggerPositionSet(m_hdwf, seconds);
+}
+
+bool DwfDevice::TriggerPositionGet(double& seconds)
+{
+	return FDwfAnalogInTriggerPositionGet(m_hdwf, &seconds);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Acquisition
+
+bool DwfDevice::Status(bool readData, DwfState& state)
+{
+	return FDwfAnalogInStatus(m_hdwf, readData, &state);
+}
+
+bool DwfDevice::StatusSamplesLeft(int& samples)
+{
+	return FDwfAnalogInStatusSamplesLeft(m_hdwf, &samples);
+}
+
+bool DwfDevice::StatusRecord(int& available, int& lost, int& corrupt)
+{
+	return FDwfAnalogInStatusRecord(m_hdwf, &available, &lost, &corrupt);
+}
+
+bool DwfDevice::StatusTime(unsigned int& sec, unsigned int& tick, unsigned int& ticksPerSecond)
+{
+	return FDwfAnalogInStatusTime(m_hdwf, &sec, &tick, &ticksPerSecond);
+}
+
+bool DwfDevice::StatusData(int channel, double* buf, int count)
+{
+	return FDwfAnalogInStatusData(m_hdwf, channel, buf, count);
+}
+
+bool DwfDevice::StatusData2(int channel, double* buf, int first, int count)
+{
+	return FDwfAnalogInStatusData2(m_hdwf, channel, buf, first, count);
+}
+
+bool DwfDevice::StatusData16(int channel, short* buf, int first, int count)
+{
+	return FDwfAnalogInStatusData16(m_hdwf, channel, buf, first, count);
+}
@@ -0,0 +1,87 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef DwfDevice_h
+#define DwfDevice_h
+
+#include "ScopeDevice.h"
+#include <string>
+
+/**
+	@brief A real instrument, through the Digilent WaveForms SDK
+ */
+class DwfDevice : public ScopeDevice
+{
+public:
+	DwfDevice();
+	virtual ~DwfDevice();
+
+	bool Open(int device, int config, const std::string& host);
+	virtual void Close();
+
+	virtual bool BitsInfo(int& bits);
+	virtual bool FrequencyInfo(double& minHz, double& maxHz);
+	virtual bool BufferSizeInfo(int& minSize, int& maxSize);
+
+	virtual bool Reset();
+	virtual bool Configure(bool reconfigure, bool start);
+	virtual bool AcquisitionModeSet(ACQMODE mode);
+	virtual bool RecordLengthSet(double seconds);
+	virtual bool FrequencySet(double hz);
+	virtual bool BufferSizeSet(int size);
+	virtual bool ChannelEnableSet(int channel, bool enable);
+	virtual bool ChannelAttenuationSet(int channel, double attenuation);
+	virtual bool ChannelCouplingSet(int channel, DwfAnalogCoupling coupling);
+	virtual bool ChannelRangeSet(int channel, double volts);
+	virtual bool ChannelRangeGet(int channel, double& volts);
+	virtual bool ChannelOffsetSet(int channel, double volts);
+	virtual bool ChannelOffsetGet(int channel, double& volts);
+	virtual bool TriggerSourceSet(TRIGSRC source);
+	virtual bool TriggerAutoTimeoutSet(double seconds);
+	virtual bool TriggerChannelSet(int channel);
+	virtual bool TriggerLevelSet(double volts);
+	virtual bool TriggerTypeSet(TRIGTYPE type);
+	virtual bool TriggerConditionSet(DwfTriggerSlope slope);
+	virtual bool TriggerPositionSet(double seconds);
+	virtual bool TriggerPositionGet(double& seconds);
+
+	virtual bool Status(bool readData, DwfState& state);
+	virtual bool StatusSamplesLeft(int& samples);
+	virtual bool StatusRecord(int& available, int& lost, int& corrupt);
+	virtual bool StatusTime(unsigned int& sec, unsigned int& tick, unsigned int& ticksPerSecond);
+	virtual bool StatusData(int channel, double* buf, int count);
+	virtual bool StatusData2(int channel, double* buf, int first, int count);
+	virtual bool StatusData16(int channel, short* buf, int first, int count);
+
+protected:
+	HDWF m_hdwf;
+	bool m_open;
+};
+
+#endif
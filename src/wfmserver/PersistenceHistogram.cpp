@@ -0,0 +1,357 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of PersistenceHistogram
+ */
+#include "PersistenceHistogram.h"
+#include "CaptureBufferSet.h"
+#include <math.h>
+#include <algorithm>
+
+#ifdef __x86_64__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+/**
+	@brief Number of columns accumulated by each thread at a time
+ */
+#define PERSIST_BLOCK_COLUMNS 64
+
+static size_t FirstSampleInColumn(size_t column, uint64_t colStart, uint64_t colStep, size_t depth);
+static void AccumulateColumns(
+	const int16_t* in, size_t first, size_t last, uint32_t* bins, size_t width, size_t height,
+	uint64_t colStart, uint64_t colStep);
+static void AccumulateColumns(
+	const double* in, size_t first, size_t last, uint32_t* bins, size_t width, size_t height,
+	uint64_t colStart, uint64_t colStep, double vmin, double vmax);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+PersistenceHistogram::PersistenceHistogram()
+	: m_width(0)
+	, m_height(0)
+	, m_depth(0)
+	, m_interval(0)
+	, m_raw(false)
+	, m_captures(0)
+	, m_maxHits(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Accumulation
+
+/**
+	@brief Adds every sample of a capture to the histograms
+
+	If the capture configuration (or the grid) changed since the last one, the histograms start over from this capture.
+ */
+void PersistenceHistogram::Accumulate(CaptureBufferSet* set)
+{
+	if(!m_captures || !IsCompatible(set))
+		Start(set);
+
+	size_t width = m_width;
+	size_t height = m_height;
+	size_t depth = m_depth;
+
+	//Fade everything out before the busiest cell could overflow.
+	//With at least one column per sample, a segment can't put more than depth/width + 1 hits in one cell.
+	uint64_t hitsPerCapture = set->m_segments * ((depth + width - 1) / width + 1);
+	while(m_maxHits && (m_maxHits + hitsPerCapture > UINT32_MAX) )
+		Halve();
+	m_maxHits += hitsPerCapture;
+
+	//Sample i of each segment lands in column (i + trigger phase) * width / depth, in 32.32 fixed point
+	uint64_t colStep = (static_cast<uint64_t>(width) << 32) / depth;
+	size_t blocks = (width + PERSIST_BLOCK_COLUMNS - 1) / PERSIST_BLOCK_COLUMNS;
+	for(size_t seg=0; seg<set->m_segments; seg++)
+	{
+		float phase = (set->m_segments > 1) ? set->m_segmentTrigphase[seg] : set->m_trigphase;
+		double frac = m_interval ? phase / m_interval : 0;
+		frac = max(0.0, min(frac, 1.0 - 1e-9));
+		uint64_t colStart = static_cast<uint64_t>(frac * colStep);
+
+		for(auto& it : m_bins)
+		{
+			size_t ch = it.first;
+			uint32_t* bins = &it.second[0];
+			const int16_t* raw = m_raw ? set->m_rawBuffers[ch] + seg*depth : NULL;
+			const double* volts = m_raw ? NULL : set->m_waveformBuffers[ch] + seg*depth;
+			double vmin = m_vmin[ch];
+			double vmax = m_vmax[ch];
+
+			//Each thread takes a block of columns, so no two threads ever touch the same cell
+			#pragma omp parallel for
+			for(size_t block=0; block<blocks; block++)
+			{
+				size_t firstCol = block * PERSIST_BLOCK_COLUMNS;
+				size_t lastCol = min(firstCol + PERSIST_BLOCK_COLUMNS, width);
+				size_t first = FirstSampleInColumn(firstCol, colStart, colStep, depth);
+				size_t last = FirstSampleInColumn(lastCol, colStart, colStep, depth);
+
+				if(raw)
+					AccumulateColumns(raw, first, last, bins, width, height, colStart, colStep);
+				else
+					AccumulateColumns(volts, first, last, bins, width, height, colStart, colStep, vmin, vmax);
+			}
+		}
+	}
+
+	m_captures ++;
+}
+
+/**
+	@brief Zeroes all of the hit counts
+ */
+void PersistenceHistogram::Clear()
+{
+	for(auto& it : m_bins)
+		fill(it.second.begin(), it.second.end(), 0);
+	m_captures = 0;
+	m_maxHits = 0;
+}
+
+/**
+	@brief Checks if a capture can be added to the histograms in progress
+ */
+bool PersistenceHistogram::IsCompatible(CaptureBufferSet* set)
+{
+	bool raw = (set->m_format == FORMAT_INT16) || (set->m_format == FORMAT_PACKED);
+	if( (set->m_persistColumns != m_width) ||
+		(set->m_persistRows != m_height) ||
+		(set->m_depth != m_depth) ||
+		(set->m_interval != m_interval) ||
+		(raw != m_raw) ||
+		(set->m_channelOn != m_channelOn) )
+	{
+		return false;
+	}
+
+	for(auto& it : m_bins)
+	{
+		size_t ch = it.first;
+		if( (set->m_centers[ch] - set->m_ranges[ch]/2 != m_vmin[ch]) ||
+			(set->m_centers[ch] + set->m_ranges[ch]/2 != m_vmax[ch]) )
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+	@brief Starts new, empty histograms with this capture's configuration
+ */
+void PersistenceHistogram::Start(CaptureBufferSet* set)
+{
+	m_width = set->m_persistColumns;
+	m_height = set->m_persistRows;
+	m_depth = set->m_depth;
+	m_interval = set->m_interval;
+	m_raw = (set->m_format == FORMAT_INT16) || (set->m_format == FORMAT_PACKED);
+	m_channelOn = set->m_channelOn;
+
+	//Rows cover the full scale range of the channel (the same range as the full span of the raw codes)
+	m_bins.clear();
+	m_vmin.clear();
+	m_vmax.clear();
+	for(auto it : m_channelOn)
+	{
+		if(!it.second)
+			continue;
+
+		size_t ch = it.first;
+		m_bins[ch].resize(m_width * m_height);
+		m_vmin[ch] = set->m_centers[ch] - set->m_ranges[ch]/2;
+		m_vmax[ch] = set->m_centers[ch] + set->m_ranges[ch]/2;
+	}
+
+	Clear();
+}
+
+/**
+	@brief Halves every hit count, keeping the shape of the histogram but making room for more captures
+ */
+void PersistenceHistogram::Halve()
+{
+	for(auto& it : m_bins)
+	{
+		uint32_t* bins = &it.second[0];
+		size_t count = it.second.size();
+		size_t i = 0;
+
+#ifdef __x86_64__
+		for(; i + 4 <= count; i += 4)
+		{
+			__m128i* p = reinterpret_cast<__m128i*>(bins + i);
+			_mm_storeu_si128(p, _mm_srli_epi32(_mm_loadu_si128(p), 1));
+		}
+#endif
+
+		for(; i<count; i++)
+			bins[i] >>= 1;
+	}
+
+	m_maxHits /= 2;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Serialization
+
+/**
+	@brief Serializes the histograms into a data plane frame
+
+	Same global header as a full frame, then the frame type, uint64 number of captures accumulated, and per channel:
+	uint64 {id, depth, columns, rows}, float {min, max} volts covered by the rows, and the hit counts as uint32, one
+	row at a time starting from the lowest voltage.
+
+	The frame references the histograms, so it must be sent before the next call to Accumulate().
+ */
+DataPlaneFrame& PersistenceHistogram::BuildFrame()
+{
+	uint16_t numchans = m_bins.size();
+
+	m_frame.Clear();
+	m_frame.AddHeader(numchans);
+	m_frame.AddHeader(m_interval);
+	m_frame.AddHeader(static_cast<uint64_t>(FRAME_PERSISTENCE));
+	m_frame.AddHeader(static_cast<uint64_t>(m_captures));
+
+	for(auto& it : m_bins)
+	{
+		size_t ch = it.first;
+		uint64_t header[4] = {ch, m_depth, m_width, m_height};
+		float range[2] = {m_vmin[ch], m_vmax[ch]};
+		m_frame.AddHeader(header);
+		m_frame.AddHeader(range);
+		m_frame.AddPayload(reinterpret_cast<const uint8_t*>(&it.second[0]), it.second.size() * sizeof(uint32_t));
+	}
+
+	return m_frame;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Kernels
+
+/**
+	@brief Finds the first sample that lands in or after a column
+ */
+static size_t FirstSampleInColumn(size_t column, uint64_t colStart, uint64_t colStep, size_t depth)
+{
+	uint64_t target = static_cast<uint64_t>(column) << 32;
+	if(target <= colStart)
+		return 0;
+	return min<uint64_t>( (target - colStart + colStep - 1) / colStep, depth);
+}
+
+/**
+	@brief Adds samples [first, last) of raw ADC codes to a histogram
+
+	The row is the top bits of the code's offset binary form, scaled to the grid height.
+ */
+static void AccumulateColumns(
+	const int16_t* in, size_t first, size_t last, uint32_t* bins, size_t width, size_t height,
+	uint64_t colStart, uint64_t colStep)
+{
+	size_t i = first;
+	uint64_t col = colStart + i*colStep;
+
+#ifdef __x86_64__
+	//Eight rows with one multiply-high, then scatter the increments
+	__m128i sign = _mm_set1_epi16(static_cast<int16_t>(0x8000));
+	__m128i rowScale = _mm_set1_epi16(static_cast<int16_t>(height));
+	alignas(16) uint16_t rows[8];
+	for(; i + 8 <= last; i += 8)
+	{
+		__m128i codes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+		_mm_store_si128(reinterpret_cast<__m128i*>(rows), _mm_mulhi_epu16(_mm_xor_si128(codes, sign), rowScale));
+
+		for(size_t j=0; j<8; j++)
+		{
+			bins[rows[j]*width + (col >> 32)] ++;
+			col += colStep;
+		}
+	}
+#endif
+
+	for(; i<last; i++)
+	{
+		size_t row = ( (static_cast<uint16_t>(in[i]) ^ 0x8000) * height) >> 16;
+		bins[row*width + (col >> 32)] ++;
+		col += colStep;
+	}
+}
+
+/**
+	@brief Adds samples [first, last) in volts to a histogram
+
+	Samples outside [vmin, vmax) are clipped to the bottom or top row.
+ */
+static void AccumulateColumns(
+	const double* in, size_t first, size_t last, uint32_t* bins, size_t width, size_t height,
+	uint64_t colStart, uint64_t colStep, double vmin, double vmax)
+{
+	size_t i = first;
+	uint64_t col = colStart + i*colStep;
+	double scale = (vmax > vmin) ? height / (vmax - vmin) : 0;
+	double top = height - 1;
+
+#ifdef __x86_64__
+	//Two rows at a time, clamped before conversion (NaNs end up in the bottom row)
+	__m128d vscale = _mm_set1_pd(scale);
+	__m128d voffset = _mm_set1_pd(vmin);
+	__m128d vzero = _mm_setzero_pd();
+	__m128d vtop = _mm_set1_pd(top);
+	for(; i + 2 <= last; i += 2)
+	{
+		__m128d r = _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(in + i), voffset), vscale);
+		__m128i rows = _mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(r, vzero), vtop));
+
+		bins[_mm_cvtsi128_si32(rows)*width + (col >> 32)] ++;
+		col += colStep;
+		bins[_mm_cvtsi128_si32(_mm_shuffle_epi32(rows, 1))*width + (col >> 32)] ++;
+		col += colStep;
+	}
+#endif
+
+	for(; i<last; i++)
+	{
+		double r = (in[i] - vmin) * scale;
+		size_t row = (r > 0) ? static_cast<size_t>(min(r, top)) : 0;
+		bins[row*width + (col >> 32)] ++;
+		col += colStep;
+	}
+}
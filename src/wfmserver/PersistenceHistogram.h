@@ -0,0 +1,87 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef PersistenceHistogram_h
+#define PersistenceHistogram_h
+
+#include "wfmserver.h"
+#include "DataPlaneFrame.h"
+
+class CaptureBufferSet;
+
+/**
+	@brief Time x voltage hit counts of each channel, accumulated across captures
+
+	Columns evenly divide the capture (or each segment of a burst, which are folded on top of each other), offset by
+	the trigger phase. Rows evenly divide the channel's full scale range, lowest voltage first. When the busiest cell
+	could overflow, every count is halved, so old captures fade out rather than wrapping around.
+ */
+class PersistenceHistogram
+{
+public:
+	PersistenceHistogram();
+
+	void Accumulate(CaptureBufferSet* set);
+	void Clear();
+
+	DataPlaneFrame& BuildFrame();
+
+	///@brief Number of captures accumulated since the histograms were last cleared
+	size_t GetCaptureCount()
+	{ return m_captures; }
+
+protected:
+	bool IsCompatible(CaptureBufferSet* set);
+	void Start(CaptureBufferSet* set);
+	void Halve();
+
+	//Configuration of the captures being accumulated
+	size_t m_width;
+	size_t m_height;
+	size_t m_depth;
+	int64_t m_interval;
+	bool m_raw;
+	std::map<size_t, bool> m_channelOn;
+	std::map<size_t, float> m_vmin;
+	std::map<size_t, float> m_vmax;
+
+	///@brief Number of captures accumulated
+	size_t m_captures;
+
+	///@brief Upper bound on the count in any one cell
+	uint64_t m_maxHits;
+
+	//Hit counts for enabled channels, m_height rows of m_width columns
+	std::map<size_t, std::vector<uint32_t> > m_bins;
+
+	//The serialized histograms
+	DataPlaneFrame m_frame;
+};
+
+#endif
@@ -0,0 +1,433 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of RealFFT
+ */
+#include "RealFFT.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef __x86_64__
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+/**
+	@brief Width of the bit reversal tiles, in bits (so tiles are 32x32 points)
+ */
+#define FFT_TILE_BITS 5
+
+static vector<uint32_t> MakeBitReverseTable(size_t bits);
+
+/**
+	@brief Smallest transform worth splitting across threads, in complex points
+ */
+#define FFT_PARALLEL_POINTS 32768
+
+/**
+	@brief Number of butterflies in a block (the early stages are done a block of twice this many points at a time)
+ */
+#define FFT_BLOCK_SIZE 4096
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+RealFFT::RealFFT()
+	: m_points(0)
+	, m_half(0)
+	, m_bits(0)
+	, m_tileBits(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Planning
+
+/**
+	@brief Rounds a capture depth up to the number of points to transform (the rest is zero padded)
+ */
+size_t RealFFT::GetPointsForDepth(size_t depth)
+{
+	size_t points = 4;
+	while(points < depth)
+		points *= 2;
+	return points;
+}
+
+/**
+	@brief Precalculates the tables for a transform size
+
+	@param points	Number of real input points, a power of two (at least 4)
+ */
+void RealFFT::Plan(size_t points)
+{
+	if(points == m_points)
+		return;
+
+	m_points = points;
+	m_half = points / 2;
+
+	m_bits = 0;
+	while( (static_cast<size_t>(1) << m_bits) < m_half)
+		m_bits ++;
+
+	//Small transforms fit in cache, so they're reordered in one go
+	m_tileBits = (m_bits >= 2*FFT_TILE_BITS) ? FFT_TILE_BITS : 0;
+	m_tileReverse = MakeBitReverseTable(m_tileBits);
+	m_middleReverse = MakeBitReverseTable(m_bits - 2*m_tileBits);
+
+	//Twiddles are calculated in double precision so rounding doesn't accumulate across stages
+	m_twiddleRe.resize(m_half);
+	m_twiddleIm.resize(m_half);
+	for(size_t span=1; span<m_half; span *= 2)
+	{
+		for(size_t j=0; j<span; j++)
+		{
+			double angle = -M_PI * j / span;
+			m_twiddleRe[span - 1 + j] = cos(angle);
+			m_twiddleIm[span - 1 + j] = sin(angle);
+		}
+	}
+
+	m_unpackRe.resize(m_half/2 + 1);
+	m_unpackIm.resize(m_half/2 + 1);
+	for(size_t k=0; k<=m_half/2; k++)
+	{
+		double angle = -2 * M_PI * k / m_points;
+		m_unpackRe[k] = cos(angle);
+		m_unpackIm[k] = sin(angle);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Transform
+
+/**
+	@brief Transforms GetPoints() real samples into GetBins() complex bins
+
+	The output is unscaled, so a full scale DC input comes out as GetPoints() times its value in bin 0.
+
+	@param in	Input samples
+	@param re	Real part of the output, GetBins() entries
+	@param im	Imaginary part of the output, GetBins() entries
+ */
+void RealFFT::Transform(const float* in, float* re, float* im) const
+{
+	size_t half = m_half;
+	bool parallel = (half >= FFT_PARALLEL_POINTS);
+
+	//Even samples are the real part of the half length complex input, odd samples the imaginary part.
+	//Bit reversing the whole index scatters writes across the entire output, so it's done one tile at a time:
+	//rows of consecutive points are read into a local tile, transposed, and written out as whole rows again.
+	//(The rows are a large power of two apart, so writing columns directly would thrash the cache.)
+	size_t tileBits = m_tileBits;
+	size_t tile = static_cast<size_t>(1) << tileBits;
+	size_t topShift = m_bits - tileBits;
+	size_t middles = m_middleReverse.size();
+	const uint32_t* tileReverse = &m_tileReverse[0];
+	const uint32_t* middleReverse = &m_middleReverse[0];
+
+	#pragma omp parallel for if(parallel)
+	for(size_t middle=0; middle<middles; middle++)
+	{
+		float tileRe[1 << FFT_TILE_BITS][1 << FFT_TILE_BITS];
+		float tileIm[1 << FFT_TILE_BITS][1 << FFT_TILE_BITS];
+
+		for(size_t top=0; top<tile; top++)
+		{
+			const float* row = in + ( (top << topShift) | (middle << tileBits) ) * 2;
+			size_t column = tileReverse[top];
+			for(size_t bottom=0; bottom<tile; bottom++)
+			{
+				tileRe[bottom][column] = row[bottom*2];
+				tileIm[bottom][column] = row[bottom*2 + 1];
+			}
+		}
+
+		size_t reversedMiddle = static_cast<size_t>(middleReverse[middle]) << tileBits;
+		for(size_t bottom=0; bottom<tile; bottom++)
+		{
+			size_t j = (static_cast<size_t>(tileReverse[bottom]) << topShift) | reversedMiddle;
+			memcpy(re + j, tileRe[bottom], tile * sizeof(float));
+			memcpy(im + j, tileIm[bottom], tile * sizeof(float));
+		}
+	}
+
+	//Early stages only mix points within small blocks, so do all of them on one block while it's in cache
+	size_t blockPoints = min<size_t>(half, FFT_BLOCK_SIZE * 2);
+	#pragma omp parallel for if(parallel)
+	for(size_t base=0; base<half; base += blockPoints)
+	{
+		for(size_t span=1; span<blockPoints; span *= 2)
+		{
+			for(size_t g=base; g<base + blockPoints; g += span*2)
+				Butterflies(re, im, g, span, 0, span);
+		}
+	}
+
+	//Later stages are bound by memory bandwidth, so do them two at a time (then the last one alone if the count is
+	//odd), split into blocks of butterflies across all groups
+	size_t span = blockPoints;
+	for(; span*2 < half; span *= 4)
+	{
+		size_t blocksPerGroup = span / FFT_BLOCK_SIZE;
+		size_t blocks = (half / (span*4)) * blocksPerGroup;
+
+		#pragma omp parallel for if(parallel)
+		for(size_t b=0; b<blocks; b++)
+		{
+			size_t first = (b % blocksPerGroup) * FFT_BLOCK_SIZE;
+			DoubleButterflies(re, im, (b / blocksPerGroup) * span * 4, span, first, first + FFT_BLOCK_SIZE);
+		}
+	}
+	if(span < half)
+	{
+		size_t blocks = span / FFT_BLOCK_SIZE;
+
+		#pragma omp parallel for if(parallel)
+		for(size_t b=0; b<blocks; b++)
+			Butterflies(re, im, 0, span, b * FFT_BLOCK_SIZE, (b+1) * FFT_BLOCK_SIZE);
+	}
+
+	//Unpack the real spectrum: bins k and half-k both come from complex bins k and half-k
+	float dc = re[0];
+	float odd = im[0];
+	re[0] = dc + odd;
+	im[0] = 0;
+	re[half] = dc - odd;
+	im[half] = 0;
+
+	#pragma omp parallel for if(parallel)
+	for(size_t k=1; k<=half/2; k++)
+	{
+		float a = re[k];
+		float b = im[k];
+		float c = re[half - k];
+		float d = im[half - k];
+
+		float evenRe = (a + c) * 0.5f;
+		float evenIm = (b - d) * 0.5f;
+		float oddRe = (b + d) * 0.5f;
+		float oddIm = (c - a) * 0.5f;
+
+		float wr = m_unpackRe[k];
+		float wi = m_unpackIm[k];
+		float tr = wr*oddRe - wi*oddIm;
+		float ti = wr*oddIm + wi*oddRe;
+
+		re[k] = evenRe + tr;
+		im[k] = evenIm + ti;
+		re[half - k] = evenRe - tr;
+		im[half - k] = ti - evenIm;
+	}
+}
+
+/**
+	@brief Makes a table of the bit reversed form of every number of a given width
+ */
+static vector<uint32_t> MakeBitReverseTable(size_t bits)
+{
+	size_t count = static_cast<size_t>(1) << bits;
+	vector<uint32_t> table(count);
+	for(size_t i=0; i<count; i++)
+	{
+		size_t r = 0;
+		for(size_t b=0; b<bits; b++)
+		{
+			if(i & (static_cast<size_t>(1) << b))
+				r |= static_cast<size_t>(1) << (bits - 1 - b);
+		}
+		table[i] = r;
+	}
+	return table;
+}
+
+/**
+	@brief Does butterflies [first, last) of the group starting at base, in a stage of the given span
+ */
+void RealFFT::Butterflies(float* re, float* im, size_t base, size_t span, size_t first, size_t last) const
+{
+	const float* twRe = &m_twiddleRe[span - 1];
+	const float* twIm = &m_twiddleIm[span - 1];
+	float* loRe = re + base;
+	float* loIm = im + base;
+	float* hiRe = re + base + span;
+	float* hiIm = im + base + span;
+
+	size_t j = first;
+
+#ifdef __x86_64__
+	//Spans of four or more are always a multiple of four long
+	if(span >= 4)
+	{
+		for(; j<last; j += 4)
+		{
+			__m128 wr = _mm_loadu_ps(twRe + j);
+			__m128 wi = _mm_loadu_ps(twIm + j);
+			__m128 xr = _mm_loadu_ps(hiRe + j);
+			__m128 xi = _mm_loadu_ps(hiIm + j);
+			__m128 tr = _mm_sub_ps(_mm_mul_ps(xr, wr), _mm_mul_ps(xi, wi));
+			__m128 ti = _mm_add_ps(_mm_mul_ps(xr, wi), _mm_mul_ps(xi, wr));
+			__m128 ur = _mm_loadu_ps(loRe + j);
+			__m128 ui = _mm_loadu_ps(loIm + j);
+
+			_mm_storeu_ps(loRe + j, _mm_add_ps(ur, tr));
+			_mm_storeu_ps(loIm + j, _mm_add_ps(ui, ti));
+			_mm_storeu_ps(hiRe + j, _mm_sub_ps(ur, tr));
+			_mm_storeu_ps(hiIm + j, _mm_sub_ps(ui, ti));
+		}
+	}
+#endif
+
+	for(; j<last; j++)
+	{
+		float tr = hiRe[j]*twRe[j] - hiIm[j]*twIm[j];
+		float ti = hiRe[j]*twIm[j] + hiIm[j]*twRe[j];
+		float ur = loRe[j];
+		float ui = loIm[j];
+
+		loRe[j] = ur + tr;
+		loIm[j] = ui + ti;
+		hiRe[j] = ur - tr;
+		hiIm[j] = ui - ti;
+	}
+}
+
+/**
+	@brief Does butterflies [first, last) of two consecutive stages (spans of span and span*2) in one pass
+
+	Each iteration takes four points, span apart, through both stages in registers.
+ */
+void RealFFT::DoubleButterflies(float* re, float* im, size_t base, size_t span, size_t first, size_t last) const
+{
+	const float* tw1Re = &m_twiddleRe[span - 1];
+	const float* tw1Im = &m_twiddleIm[span - 1];
+	const float* tw2Re = &m_twiddleRe[span*2 - 1];
+	const float* tw2Im = &m_twiddleIm[span*2 - 1];
+	float* re0 = re + base;
+	float* im0 = im + base;
+	float* re1 = re0 + span;
+	float* im1 = im0 + span;
+	float* re2 = re1 + span;
+	float* im2 = im1 + span;
+	float* re3 = re2 + span;
+	float* im3 = im2 + span;
+
+	size_t j = first;
+
+#ifdef __x86_64__
+	//Spans of four or more are always a multiple of four long
+	if(span >= 4)
+	{
+		for(; j<last; j += 4)
+		{
+			__m128 w1r = _mm_loadu_ps(tw1Re + j);
+			__m128 w1i = _mm_loadu_ps(tw1Im + j);
+
+			//First stage: (0, 1) and (2, 3)
+			__m128 xr = _mm_loadu_ps(re1 + j);
+			__m128 xi = _mm_loadu_ps(im1 + j);
+			__m128 tr = _mm_sub_ps(_mm_mul_ps(xr, w1r), _mm_mul_ps(xi, w1i));
+			__m128 ti = _mm_add_ps(_mm_mul_ps(xr, w1i), _mm_mul_ps(xi, w1r));
+			__m128 ur = _mm_loadu_ps(re0 + j);
+			__m128 ui = _mm_loadu_ps(im0 + j);
+			__m128 a0r = _mm_add_ps(ur, tr);
+			__m128 a0i = _mm_add_ps(ui, ti);
+			__m128 a1r = _mm_sub_ps(ur, tr);
+			__m128 a1i = _mm_sub_ps(ui, ti);
+
+			xr = _mm_loadu_ps(re3 + j);
+			xi = _mm_loadu_ps(im3 + j);
+			tr = _mm_sub_ps(_mm_mul_ps(xr, w1r), _mm_mul_ps(xi, w1i));
+			ti = _mm_add_ps(_mm_mul_ps(xr, w1i), _mm_mul_ps(xi, w1r));
+			ur = _mm_loadu_ps(re2 + j);
+			ui = _mm_loadu_ps(im2 + j);
+			__m128 a2r = _mm_add_ps(ur, tr);
+			__m128 a2i = _mm_add_ps(ui, ti);
+			__m128 a3r = _mm_sub_ps(ur, tr);
+			__m128 a3i = _mm_sub_ps(ui, ti);
+
+			//Second stage: (0, 2) and (1, 3)
+			__m128 w2r = _mm_loadu_ps(tw2Re + j);
+			__m128 w2i = _mm_loadu_ps(tw2Im + j);
+			tr = _mm_sub_ps(_mm_mul_ps(a2r, w2r), _mm_mul_ps(a2i, w2i));
+			ti = _mm_add_ps(_mm_mul_ps(a2r, w2i), _mm_mul_ps(a2i, w2r));
+			_mm_storeu_ps(re0 + j, _mm_add_ps(a0r, tr));
+			_mm_storeu_ps(im0 + j, _mm_add_ps(a0i, ti));
+			_mm_storeu_ps(re2 + j, _mm_sub_ps(a0r, tr));
+			_mm_storeu_ps(im2 + j, _mm_sub_ps(a0i, ti));
+
+			w2r = _mm_loadu_ps(tw2Re + span + j);
+			w2i = _mm_loadu_ps(tw2Im + span + j);
+			tr = _mm_sub_ps(_mm_mul_ps(a3r, w2r), _mm_mul_ps(a3i, w2i));
+			ti = _mm_add_ps(_mm_mul_ps(a3r, w2i), _mm_mul_ps(a3i, w2r));
+			_mm_storeu_ps(re1 + j, _mm_add_ps(a1r, tr));
+			_mm_storeu_ps(im1 + j, _mm_add_ps(a1i, ti));
+			_mm_storeu_ps(re3 + j, _mm_sub_ps(a1r, tr));
+			_mm_storeu_ps(im3 + j, _mm_sub_ps(a1i, ti));
+		}
+	}
+#endif
+
+	for(; j<last; j++)
+	{
+		float tr = re1[j]*tw1Re[j] - im1[j]*tw1Im[j];
+		float ti = re1[j]*tw1Im[j] + im1[j]*tw1Re[j];
+		float a0r = re0[j] + tr;
+		float a0i = im0[j] + ti;
+		float a1r = re0[j] - tr;
+		float a1i = im0[j] - ti;
+
+		tr = re3[j]*tw1Re[j] - im3[j]*tw1Im[j];
+		ti = re3[j]*tw1Im[j] + im3[j]*tw1Re[j];
+		float a2r = re2[j] + tr;
+		float a2i = im2[j] + ti;
+		float a3r = re2[j] - tr;
+		float a3i = im2[j] - ti;
+
+		tr = a2r*tw2Re[j] - a2i*tw2Im[j];
+		ti = a2r*tw2Im[j] + a2i*tw2Re[j];
+		re0[j] = a0r + tr;
+		im0[j] = a0i + ti;
+		re2[j] = a0r - tr;
+		im2[j] = a0i - ti;
+
+		tr = a3r*tw2Re[span + j] - a3i*tw2Im[span + j];
+		ti = a3r*tw2Im[span + j] + a3i*tw2Re[span + j];
+		re1[j] = a1r + tr;
+		im1[j] = a1i + ti;
+		re3[j] = a1r - tr;
+		im3[j] = a1i - ti;
+	}
+}
@@ -0,0 +1,83 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef RealFFT_h
+#define RealFFT_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+	@brief Radix-2 FFT of real input, computed as a half length complex FFT
+
+	Works on split real/imaginary arrays so each SSE register holds four butterflies. A plan only holds read-only
+	tables once it's set up, so any number of threads can transform with it at once, each with its own output buffers.
+ */
+class RealFFT
+{
+public:
+	RealFFT();
+
+	void Plan(size_t points);
+	void Transform(const float* in, float* re, float* im) const;
+
+	///@brief Number of real input points
+	size_t GetPoints() const
+	{ return m_points; }
+
+	///@brief Number of output bins (DC through Nyquist)
+	size_t GetBins() const
+	{ return m_points/2 + 1; }
+
+	static size_t GetPointsForDepth(size_t depth);
+
+protected:
+	void Butterflies(float* re, float* im, size_t base, size_t span, size_t first, size_t last) const;
+	void DoubleButterflies(float* re, float* im, size_t base, size_t span, size_t first, size_t last) const;
+
+	size_t m_points;
+	size_t m_half;
+
+	//The half length complex FFT's input is reordered in tiles: an index is split into top, middle and bottom bit
+	//fields (top and bottom m_tileBits wide, which may be zero), and each field reversed separately.
+	size_t m_bits;
+	size_t m_tileBits;
+	std::vector<uint32_t> m_tileReverse;
+	std::vector<uint32_t> m_middleReverse;
+
+	//Twiddle factors of every stage back to back (stage of span m starts at m-1), then those for unpacking the
+	//real spectrum from the complex one
+	std::vector<float> m_twiddleRe;
+	std::vector<float> m_twiddleIm;
+	std::vector<float> m_unpackRe;
+	std::vector<float> m_unpackIm;
+};
+
+#endif
@@ -0,0 +1,280 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of SampleBufferPool
+ */
+#include "wfmserver.h"
+#include "SampleBufferPool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+/**
+	@brief Granularity of buffer capacity, and of prefaulting
+ */
+#define SAMPLE_BUFFER_PAGE_SIZE 4096
+
+SampleBufferPool::HugePageMode SampleBufferPool::m_hugePageMode = SampleBufferPool::HUGEPAGE_NONE;
+bool SampleBufferPool::m_lockMemory = false;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SampleBufferPool::SampleBufferPool()
+{
+}
+
+SampleBufferPool::~SampleBufferPool()
+{
+	for(auto it : m_buffers)
+		FreeAligned(it.first, it.second);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Global configuration
+
+/**
+	@brief Decides how sample buffers are backed, probing for huge page support. Call once at startup.
+
+	@param hugePages	Try to use huge pages for large buffers
+	@param lockMemory	mlock() buffers so they can't be paged out
+ */
+void SampleBufferPool::ConfigureMemory(bool hugePages, bool lockMemory)
+{
+	m_lockMemory = lockMemory;
+	m_hugePageMode = HUGEPAGE_NONE;
+
+	if(!hugePages)
+		return;
+
+#ifdef __linux__
+	//Best case: explicit huge pages. See if we can actually get one.
+	void* probe = mmap(NULL, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(probe != MAP_FAILED)
+	{
+		munmap(probe, HUGE_PAGE_SIZE);
+		m_hugePageMode = HUGEPAGE_HUGETLB;
+		LogVerbose("Sample buffers: using MAP_HUGETLB huge pages\n");
+		return;
+	}
+
+	//Next best: transparent huge pages, as long as they're not turned off entirely
+	string thp;
+	ifstream in("/sys/kernel/mm/transparent_hugepage/enabled");
+	getline(in, thp);
+	if(thp.find("[never]") == string::npos && !thp.empty())
+	{
+		m_hugePageMode = HUGEPAGE_TRANSPARENT;
+		LogNotice("Sample buffers: no hugetlbfs pages reserved (vm.nr_hugepages), "
+			"falling back to transparent huge pages\n");
+		return;
+	}
+
+	LogWarning("Sample buffers: huge pages unavailable (no hugetlbfs pages reserved and THP disabled), "
+		"falling back to normal pages\n");
+#else
+	LogWarning("Sample buffers: huge pages not supported on this platform, falling back to normal pages\n");
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Allocation
+
+/**
+	@brief Gets a buffer of at least the requested size, reusing a pooled one if possible
+
+	Sizes come from client settings, so running out of memory isn't fatal: the caller gets NULL and should give up
+	on whatever it needed the buffer for.
+
+	@return The buffer, or NULL if it couldn't be allocated
+ */
+uint8_t* SampleBufferPool::Allocate(size_t size)
+{
+	lock_guard<mutex> lock(m_mutex);
+
+	//Smallest free buffer that's big enough
+	auto it = m_free.lower_bound(size);
+	if(it != m_free.end())
+	{
+		uint8_t* buf = it->second;
+		m_free.erase(it);
+		return buf;
+	}
+
+	//Nothing fits. Anything smaller than this is probably left over from a shallower memory depth, so free it
+	//rather than letting it accumulate.
+	for(auto jt = m_free.begin(); jt != m_free.end(); )
+	{
+		FreeAligned(jt->second, m_buffers[jt->second]);
+		m_buffers.erase(jt->second);
+		jt = m_free.erase(jt);
+	}
+
+	BufferInfo info;
+	uint8_t* buf = AllocateAligned(size, info);
+	if(!buf)
+	{
+		LogError("Failed to allocate %zu byte sample buffer\n", size);
+		return NULL;
+	}
+	Prefault(buf, info.m_capacity);
+	if(m_lockMemory)
+		Lock(buf, info.m_capacity);
+
+	m_buffers[buf] = info;
+	return buf;
+}
+
+/**
+	@brief Returns a buffer to the pool
+ */
+void SampleBufferPool::Release(uint8_t* buf)
+{
+	if(!buf)
+		return;
+
+	lock_guard<mutex> lock(m_mutex);
+	m_free.insert(pair<size_t, uint8_t*>(m_buffers[buf].m_capacity, buf));
+}
+
+/**
+	@brief Allocates a new buffer, using huge pages if configured and the buffer is big enough to benefit
+ */
+uint8_t* SampleBufferPool::AllocateAligned(size_t size, BufferInfo& info)
+{
+	info.m_mapped = false;
+	info.m_capacity = (size + SAMPLE_BUFFER_PAGE_SIZE - 1) & ~static_cast<size_t>(SAMPLE_BUFFER_PAGE_SIZE - 1);
+
+#ifdef _WIN32
+	return reinterpret_cast<uint8_t*>(_aligned_malloc(info.m_capacity, SAMPLE_BUFFER_ALIGNMENT));
+#else
+
+	size_t align = SAMPLE_BUFFER_ALIGNMENT;
+	if( (m_hugePageMode != HUGEPAGE_NONE) && (size >= HUGE_PAGE_SIZE) )
+	{
+		size_t hugeCapacity = (size + HUGE_PAGE_SIZE - 1) & ~static_cast<size_t>(HUGE_PAGE_SIZE - 1);
+
+	#ifdef __linux__
+		if(m_hugePageMode == HUGEPAGE_HUGETLB)
+		{
+			void* ptr = mmap(NULL, hugeCapacity, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if(ptr != MAP_FAILED)
+			{
+				info.m_mapped = true;
+				info.m_capacity = hugeCapacity;
+				return reinterpret_cast<uint8_t*>(ptr);
+			}
+
+			//Reserved pages ran out, THP is the best we can do from here on
+			LogWarning("Sample buffers: out of hugetlbfs pages, falling back to transparent huge pages\n");
+			m_hugePageMode = HUGEPAGE_TRANSPARENT;
+		}
+	#endif
+
+		//Transparent huge pages only kick in for huge-page-aligned ranges
+		info.m_capacity = hugeCapacity;
+		align = HUGE_PAGE_SIZE;
+	}
+
+	void* ptr = NULL;
+	if(0 != posix_memalign(&ptr, align, info.m_capacity))
+		return NULL;
+
+	#ifdef __linux__
+	if(align == HUGE_PAGE_SIZE)
+		madvise(ptr, info.m_capacity, MADV_HUGEPAGE);
+	#endif
+
+	return reinterpret_cast<uint8_t*>(ptr);
+#endif
+}
+
+void SampleBufferPool::FreeAligned(uint8_t* buf, const BufferInfo& info)
+{
+#ifdef _WIN32
+	(void)info;
+	_aligned_free(buf);
+#else
+	if(m_lockMemory)
+		munlock(buf, info.m_capacity);
+
+	if(info.m_mapped)
+		munmap(buf, info.m_capacity);
+	else
+		free(buf);
+#endif
+}
+
+/**
+	@brief Locks a buffer into RAM
+ */
+void SampleBufferPool::Lock(uint8_t* buf, size_t size)
+{
+#ifdef _WIN32
+	(void)buf;
+	(void)size;
+#else
+	if(0 != mlock(buf, size))
+	{
+		static bool warned = false;
+		if(!warned)
+		{
+			LogWarning("Sample buffers: mlock failed (check RLIMIT_MEMLOCK), buffers may be paged out\n");
+			warned = true;
+		}
+	}
+#endif
+}
+
+/**
+	@brief Touches every page of a new buffer, from all cores, so we don't take page faults during the first download
+ */
+void SampleBufferPool::Prefault(uint8_t* buf, size_t size)
+{
+	size_t npages = (size + SAMPLE_BUFFER_PAGE_SIZE - 1) / SAMPLE_BUFFER_PAGE_SIZE;
+
+	#pragma omp parallel for
+	for(size_t i=0; i<npages; i++)
+	{
+		size_t off = i * SAMPLE_BUFFER_PAGE_SIZE;
+		memset(buf + off, 0, min(static_cast<size_t>(SAMPLE_BUFFER_PAGE_SIZE), size - off));
+	}
+}
@@ -0,0 +1,123 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SampleBufferPool_h
+#define SampleBufferPool_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <mutex>
+
+/**
+	@brief Alignment of every buffer handed out by SampleBufferPool (enough for any SIMD load we do)
+ */
+#define SAMPLE_BUFFER_ALIGNMENT 64
+
+/**
+	@brief Size of a huge page, and the smallest buffer we back with huge pages
+ */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+	@brief Pool of aligned, prefaulted sample buffers
+
+	Buffers are recycled by capacity, so changing memory depth or toggling channels reuses memory rather than
+	going back to the allocator (and taking page faults) every time.
+
+	Large buffers can optionally be backed by huge pages to cut TLB misses, and locked in RAM so memory pressure
+	can't page them out mid-capture. See ConfigureMemory().
+ */
+class SampleBufferPool
+{
+public:
+	SampleBufferPool();
+	~SampleBufferPool();
+
+	/**
+		@brief How large buffers are backed
+	 */
+	enum HugePageMode
+	{
+		HUGEPAGE_NONE,			//Normal pages
+		HUGEPAGE_HUGETLB,		//Explicit huge pages (MAP_HUGETLB), needs pages reserved in vm.nr_hugepages
+		HUGEPAGE_TRANSPARENT	//Normal allocation with madvise(MADV_HUGEPAGE)
+	};
+
+	static void ConfigureMemory(bool hugePages, bool lockMemory);
+
+	uint8_t* Allocate(size_t size);
+	void Release(uint8_t* buf);
+
+	///@brief Allocates a buffer of count elements of type T, or returns NULL if it can't
+	template<class T>
+	T* Allocate(size_t count)
+	{
+		if(count > SIZE_MAX / sizeof(T))
+			return NULL;
+		return reinterpret_cast<T*>(Allocate(count * sizeof(T)));
+	}
+
+	///@brief Returns a typed buffer to the pool
+	template<class T>
+	void Release(T* buf)
+	{ Release(reinterpret_cast<uint8_t*>(buf)); }
+
+protected:
+
+	/**
+		@brief Bookkeeping for one buffer
+	 */
+	struct BufferInfo
+	{
+		///@brief Usable size of the buffer
+		size_t m_capacity;
+
+		///@brief True if the buffer came straight from mmap() rather than the heap
+		bool m_mapped;
+	};
+
+	static uint8_t* AllocateAligned(size_t size, BufferInfo& info);
+	static void FreeAligned(uint8_t* buf, const BufferInfo& info);
+	static void Prefault(uint8_t* buf, size_t size);
+	static void Lock(uint8_t* buf, size_t size);
+
+	static HugePageMode m_hugePageMode;
+	static bool m_lockMemory;
+
+	std::mutex m_mutex;
+
+	///@brief Every buffer we own, in use or not
+	std::map<uint8_t*, BufferInfo> m_buffers;
+
+	///@brief Buffers not currently in use, keyed by capacity
+	std::multimap<size_t, uint8_t*> m_free;
+};
+
+#endif
@@ -0,0 +1,198 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Bit-packed sample encoding for the data plane
+
+	Samples are N-bit two's complement ADC codes (the top N bits of the 16-bit raw code), stored LSB first in a
+	contiguous little-endian bitstream with no padding between samples. Every group of 8 samples is exactly N bytes.
+ */
+#include <string.h>
+#include <algorithm>
+#include "SamplePacking.h"
+
+#ifdef __x86_64__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+static void PackBlock(const int16_t* in, uint8_t* out, size_t count, int nbits);
+static void PackScalar(const int16_t* in, uint8_t* out, size_t count, int nbits);
+
+#ifdef __x86_64__
+static void PackBlockSSE2(const int16_t* in, uint8_t* out, size_t ngroups, int nbits);
+#endif
+
+/**
+	@brief Number of samples per parallel work unit (must be a multiple of 8 to keep blocks byte aligned)
+ */
+static const size_t g_packBlockSize = 65536;
+
+/**
+	@brief Number of bytes needed to store a packed waveform
+ */
+size_t GetPackedSize(size_t count, int nbits)
+{
+	return (count * nbits + 7) / 8;
+}
+
+/**
+	@brief Packs the top nbits of each raw 16-bit ADC code into a contiguous bitstream
+ */
+void PackSamples(const int16_t* in, uint8_t* out, size_t count, int nbits)
+{
+	size_t nblocks = (count + g_packBlockSize - 1) / g_packBlockSize;
+
+	#pragma omp parallel for
+	for(size_t i=0; i<nblocks; i++)
+	{
+		size_t start = i * g_packBlockSize;
+		size_t len = min(g_packBlockSize, count - start);
+		PackBlock(in + start, out + (start * nbits) / 8, len, nbits);
+	}
+}
+
+static void PackBlock(const int16_t* in, uint8_t* out, size_t count, int nbits)
+{
+#ifdef __x86_64__
+	//Vector path handles even widths whose pair multiplier fits in a signed 16-bit lane.
+	//The vector stores spill up to 8 - N/2 bytes past the end of each group, so enough trailing groups are done
+	//scalar that the spill never leaves this block and stomps on a neighbor.
+	if( (nbits % 2 == 0) && (nbits >= 2) && (nbits <= 14) )
+	{
+		size_t ngroups = count / 8;
+		size_t reserve = (8 - nbits/2 + nbits - 1) / nbits;
+		if(ngroups > reserve)
+		{
+			PackBlockSSE2(in, out, ngroups - reserve, nbits);
+
+			size_t done = (ngroups - reserve) * 8;
+			PackScalar(in + done, out + done * nbits / 8, count - done, nbits);
+			return;
+		}
+	}
+#endif
+
+	PackScalar(in, out, count, nbits);
+}
+
+/**
+	@brief Reference packer, also used for odd widths and block tails
+ */
+static void PackScalar(const int16_t* in, uint8_t* out, size_t count, int nbits)
+{
+	int shift = 16 - nbits;
+	uint32_t acc = 0;
+	int accbits = 0;
+	for(size_t i=0; i<count; i++)
+	{
+		acc |= static_cast<uint32_t>(static_cast<uint16_t>(in[i]) >> shift) << accbits;
+		accbits += nbits;
+
+		while(accbits >= 8)
+		{
+			*out++ = acc & 0xff;
+			acc >>= 8;
+			accbits -= 8;
+		}
+	}
+
+	//Flush partial byte at the end
+	if(accbits)
+		*out = acc & 0xff;
+}
+
+#ifdef __x86_64__
+/**
+	@brief SSE2 packer for even nbits <= 14
+
+	Each group of 8 samples is merged into pairs with a multiply-add, then pairs into 4N-bit quads in each 64-bit
+	lane. Since N is even each quad is N/2 whole bytes, so both lanes are written with overlapping 8-byte stores
+	(the bits above 4N are zero and get overwritten by the next store).
+ */
+static void PackBlockSSE2(const int16_t* in, uint8_t* out, size_t ngroups, int nbits)
+{
+	size_t halfbytes = nbits / 2;
+	__m128i shift = _mm_cvtsi32_si128(16 - nbits);
+	__m128i pairmul = _mm_set1_epi32( (1 << (nbits + 16)) | 1);
+	__m128i lomask = _mm_set_epi32(0, -1, 0, -1);
+	__m128i quadshift = _mm_cvtsi32_si128(2 * nbits);
+
+	for(size_t i=0; i<ngroups; i++)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i*8));
+		v = _mm_srl_epi16(v, shift);
+
+		//s0 | s1 << N in each 32-bit lane
+		__m128i pairs = _mm_madd_epi16(v, pairmul);
+
+		//p0 | p1 << 2N in each 64-bit lane
+		__m128i quads = _mm_or_si128(
+			_mm_and_si128(pairs, lomask),
+			_mm_sll_epi64(_mm_srli_epi64(pairs, 32), quadshift));
+
+		uint64_t lo = _mm_cvtsi128_si64(quads);
+		uint64_t hi = _mm_cvtsi128_si64(_mm_unpackhi_epi64(quads, quads));
+
+		uint8_t* p = out + i*nbits;
+		memcpy(p, &lo, sizeof(lo));
+		memcpy(p + halfbytes, &hi, sizeof(hi));
+	}
+}
+#endif
+
+/**
+	@brief Reference unpacker, returns sign-extended N-bit codes
+
+	Not used by the server itself; this is the decoding clients must implement for the PACKED format.
+ */
+void UnpackSamples(const uint8_t* in, int16_t* out, size_t count, int nbits)
+{
+	int shift = 16 - nbits;
+	uint32_t mask = (1 << nbits) - 1;
+	uint32_t acc = 0;
+	int accbits = 0;
+	for(size_t i=0; i<count; i++)
+	{
+		while(accbits < nbits)
+		{
+			acc |= static_cast<uint32_t>(*in++) << accbits;
+			accbits += 8;
+		}
+
+		uint16_t code = (acc & mask) << shift;
+		acc >>= nbits;
+		accbits -= nbits;
+
+		out[i] = static_cast<int16_t>(code) >> shift;
+	}
+}
@@ -0,0 +1,90 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef ScopeDevice_h
+#define ScopeDevice_h
+
+#include <digilent/waveforms/dwf.h>
+
+/**
+	@brief The analog input side of an instrument, as seen by the server
+
+	Mirrors the FDwfAnalogIn* calls we use (same names without the prefix, same units and enumerations), so
+	DwfDevice is a thin wrapper around the Digilent SDK and anything else can stand in for it (see SyntheticDevice).
+
+	All methods return false on failure.
+ */
+class ScopeDevice
+{
+public:
+	virtual ~ScopeDevice()
+	{}
+
+	///@brief Disconnects from the device (also done on destruction)
+	virtual void Close() =0;
+
+	//Capabilities
+	virtual bool BitsInfo(int& bits) =0;
+	virtual bool FrequencyInfo(double& minHz, double& maxHz) =0;
+	virtual bool BufferSizeInfo(int& minSize, int& maxSize) =0;
+
+	//Configuration
+	virtual bool Reset() =0;
+	virtual bool Configure(bool reconfigure, bool start) =0;
+	virtual bool AcquisitionModeSet(ACQMODE mode) =0;
+	virtual bool RecordLengthSet(double seconds) =0;
+	virtual bool FrequencySet(double hz) =0;
+	virtual bool BufferSizeSet(int size) =0;
+	virtual bool ChannelEnableSet(int channel, bool enable) =0;
+	virtual bool ChannelAttenuationSet(int channel, double attenuation) =0;
+	virtual bool ChannelCouplingSet(int channel, DwfAnalogCoupling coupling) =0;
+	virtual bool ChannelRangeSet(int channel, double volts) =0;
+	virtual bool ChannelRangeGet(int channel, double& volts) =0;
+	virtual bool ChannelOffsetSet(int channel, double volts) =0;
+	virtual bool ChannelOffsetGet(int channel, double& volts) =0;
+	virtual bool TriggerSourceSet(TRIGSRC source) =0;
+	virtual bool TriggerAutoTimeoutSet(double seconds) =0;
+	virtual bool TriggerChannelSet(int channel) =0;
+	virtual bool TriggerLevelSet(double volts) =0;
+	virtual bool TriggerTypeSet(TRIGTYPE type) =0;
+	virtual bool TriggerConditionSet(DwfTriggerSlope slope) =0;
+	virtual bool TriggerPositionSet(double seconds) =0;
+	virtual bool TriggerPositionGet(double& seconds) =0;
+
+	//Acquisition
+	virtual bool Status(bool readData, DwfState& state) =0;
+	virtual bool StatusSamplesLeft(int& samples) =0;
+	virtual bool StatusRecord(int& available, int& lost, int& corrupt) =0;
+	virtual bool StatusTime(unsigned int& sec, unsigned int& tick, unsigned int& ticksPerSecond) =0;
+	virtual bool StatusData(int channel, double* buf, int count) =0;
+	virtual bool StatusData2(int channel, double* buf, int first, int count) =0;
+	virtual bool StatusData16(int channel, short* buf, int first, int count) =0;
+};
+
+#endif
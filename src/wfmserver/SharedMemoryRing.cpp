@@ -0,0 +1,231 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of SharedMemoryRing
+ */
+#include "wfmserver.h"
+#include "SharedMemoryRing.h"
+#include <string.h>
+#include <errno.h>
+#include <new>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#endif
+
+using namespace std;
+
+//Makes shared memory names unique within the process
+atomic<uint32_t> g_shmRingCount(0);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SharedMemoryRing::SharedMemoryRing()
+	: m_readOnlyFD(-1)
+	, m_mappingSize(0)
+	, m_base(NULL)
+	, m_header(NULL)
+	, m_data(NULL)
+	, m_dataSize(0)
+	, m_sequence(0)
+	, m_writePos(0)
+{
+}
+
+SharedMemoryRing::~SharedMemoryRing()
+{
+#ifndef _WIN32
+	if(m_base)
+		munmap(m_base, m_mappingSize);
+	if(m_readOnlyFD >= 0)
+		close(m_readOnlyFD);
+#endif
+}
+
+/**
+	@brief Creates and maps the shared memory
+
+	@param dataSize	Bytes of frame data the ring can hold (rounded up to a whole number of pages)
+
+	@return False if shared memory isn't available
+ */
+bool SharedMemoryRing::Create(size_t dataSize)
+{
+#ifdef _WIN32
+	(void)dataSize;
+	return false;
+#else
+	m_dataSize = (dataSize + SHM_RING_DATA_OFFSET - 1) & ~static_cast<size_t>(SHM_RING_DATA_OFFSET - 1);
+	m_mappingSize = SHM_RING_DATA_OFFSET + m_dataSize;
+
+	//Open it twice (once read-only, for the client), then unlink it right away
+	string name = string("/wfmserver-") + to_string(getpid()) + "-" + to_string(g_shmRingCount++);
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd < 0)
+	{
+		LogError("shm_open failed: %s\n", strerror(errno));
+		return false;
+	}
+	m_readOnlyFD = shm_open(name.c_str(), O_RDONLY, 0);
+	shm_unlink(name.c_str());
+
+	if( (m_readOnlyFD < 0) || (0 != ftruncate(fd, m_mappingSize)) )
+	{
+		LogError("Failed to set up shared memory: %s\n", strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	void* base = mmap(NULL, m_mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED)
+	{
+		LogError("Failed to map shared memory: %s\n", strerror(errno));
+		return false;
+	}
+
+	m_base = static_cast<uint8_t*>(base);
+	m_data = m_base + SHM_RING_DATA_OFFSET;
+	m_header = new(m_base) SharedMemoryRingHeader;
+	m_header->m_magic = SHM_RING_MAGIC;
+	m_header->m_version = 1;
+	m_header->m_dataOffset = SHM_RING_DATA_OFFSET;
+	m_header->m_dataSize = m_dataSize;
+	m_header->m_sequence.store(0, memory_order_relaxed);
+	m_header->m_writePos.store(0, memory_order_relaxed);
+	m_header->m_validFrom.store(0, memory_order_relaxed);
+	return true;
+#endif
+}
+
+/**
+	@brief Hands the client a read-only descriptor for the ring
+
+	Sent as uint64 {SHM_RING_MAGIC, size of the whole mapping}, with the descriptor attached as SCM_RIGHTS.
+
+	@return False on socket error
+ */
+bool SharedMemoryRing::SendDescriptor(int sock)
+{
+#ifdef _WIN32
+	(void)sock;
+	return false;
+#else
+	uint64_t hello[2] = {SHM_RING_MAGIC, m_mappingSize};
+	iovec iov;
+	iov.iov_base = hello;
+	iov.iov_len = sizeof(hello);
+
+	union
+	{
+		cmsghdr align;
+		uint8_t buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &m_readOnlyFD, sizeof(int));
+
+	while(true)
+	{
+		ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if( (sent < 0) && (errno == EINTR) )
+			continue;
+		return sent == static_cast<ssize_t>(sizeof(hello));
+	}
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Publishing
+
+/**
+	@brief Copies a frame into the ring, overwriting the oldest frames if needed
+
+	@param sequence	Set to the frame's sequence number (frames are numbered from 1)
+	@param position	Set to the frame's absolute position in the ring
+
+	@return False if the frame is too big for the ring
+ */
+bool SharedMemoryRing::Write(const DataPlaneFrame& frame, uint64_t& sequence, uint64_t& position)
+{
+	size_t len = frame.GetSize();
+	if(len > m_dataSize)
+		return false;
+
+	//Frames start on a cache line, and don't wrap around the end
+	uint64_t pos = (m_writePos + 63) & ~static_cast<uint64_t>(63);
+	size_t offset = pos % m_dataSize;
+	if(offset + len > m_dataSize)
+	{
+		pos += m_dataSize - offset;
+		offset = 0;
+	}
+	uint64_t end = pos + len;
+
+	//Invalidate whatever we're about to overwrite before touching it
+	if(end > m_dataSize)
+		m_header->m_validFrom.store(end - m_dataSize, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	uint8_t* p = m_data + offset;
+	for(size_t i=0; i<frame.GetSegmentCount(); i++)
+	{
+		size_t seglen = frame.GetSegmentLength(i);
+		memcpy(p, frame.GetSegmentData(i), seglen);
+		p += seglen;
+	}
+
+	//Publish it
+	m_writePos = end;
+	m_sequence ++;
+	m_header->m_writePos.store(end, memory_order_release);
+	m_header->m_sequence.store(m_sequence, memory_order_release);
+
+	sequence = m_sequence;
+	position = pos;
+	return true;
+}
@@ -0,0 +1,99 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SharedMemoryRing_h
+#define SharedMemoryRing_h
+
+#include "DataPlaneFrame.h"
+#include <atomic>
+
+/**
+	@brief Identifies a shared memory ring ("WFMRING1"), and the handshake on the local socket
+ */
+#define SHM_RING_MAGIC 0x31474e49524d4657ULL
+
+/**
+	@brief Offset of the frame data from the start of the shared memory (the header gets the first page)
+ */
+#define SHM_RING_DATA_OFFSET 4096
+
+/**
+	@brief Header at the start of a shared memory ring, as seen by the client
+
+	Frames are written one after another at increasing absolute byte positions. The frame at position p is at
+	m_dataOffset + (p % m_dataSize), and never wraps around the end of the ring.
+
+	The writer raises m_validFrom before overwriting anything. A client that reads the frame at p, then (after an
+	acquire fence) still sees m_validFrom <= p, knows it wasn't overwritten while it was reading.
+ */
+struct SharedMemoryRingHeader
+{
+	uint64_t m_magic;
+	uint64_t m_version;
+	uint64_t m_dataOffset;
+	uint64_t m_dataSize;
+
+	//Number of frames published, and the end of the newest one
+	std::atomic<uint64_t> m_sequence;
+	std::atomic<uint64_t> m_writePos;
+
+	//Frames starting below this position may have been overwritten
+	std::atomic<uint64_t> m_validFrom;
+};
+
+/**
+	@brief Shared memory ring that data plane frames are written into for a client on the same host
+
+	The memory is unlinked as soon as it's created, and the client gets a read-only descriptor for it over the local
+	socket, so only that client can map it and nothing is left behind.
+ */
+class SharedMemoryRing
+{
+public:
+	SharedMemoryRing();
+	~SharedMemoryRing();
+
+	bool Create(size_t dataSize);
+	bool SendDescriptor(int sock);
+	bool Write(const DataPlaneFrame& frame, uint64_t& sequence, uint64_t& position);
+
+protected:
+	int m_readOnlyFD;
+	size_t m_mappingSize;
+	uint8_t* m_base;
+	SharedMemoryRingHeader* m_header;
+	uint8_t* m_data;
+	size_t m_dataSize;
+
+	//Our own copies of what's in the header, so we never have to read back from shared memory
+	uint64_t m_sequence;
+	uint64_t m_writePos;
+};
+
+#endif
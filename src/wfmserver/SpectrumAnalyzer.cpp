@@ -0,0 +1,403 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of SpectrumAnalyzer
+ */
+#include "SpectrumAnalyzer.h"
+#include "CaptureBufferSet.h"
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+
+#ifdef __x86_64__
+#include <xmmintrin.h>
+#endif
+
+using namespace std;
+
+/**
+	@brief Lowest level reported, in dBm (keeps empty bins finite)
+ */
+#define SPECTRUM_FLOOR_DBM -300
+
+static void AddPower(const float* re, const float* im, float* power, float* peak, size_t count);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SpectrumAnalyzer::SpectrumAnalyzer()
+	: m_mode(SPECTRUM_OFF)
+	, m_window(WINDOW_RECTANGULAR)
+	, m_averages(1)
+	, m_peakHold(false)
+	, m_rowBins(0)
+	, m_depth(0)
+	, m_interval(0)
+	, m_powerScale(0)
+	, m_count(0)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Accumulation
+
+/**
+	@brief Transforms a capture and adds it to the average (and peak hold)
+
+	If the capture configuration changed since the last one, the average and peak hold start over from this capture.
+
+	@return True if the average is complete and ready to send
+ */
+bool SpectrumAnalyzer::Accumulate(CaptureBufferSet* set)
+{
+	if(!IsCompatible(set))
+		Start(set);
+	else if(m_count >= m_averages)
+		ResetAverage();
+
+	size_t depth = m_depth;
+	size_t bins = m_fft.GetBins();
+	float* input = &m_input[0];
+	const float* window = &m_windowCoeffs[0];
+	bool raw = (set->m_format == FORMAT_INT16) || (set->m_format == FORMAT_PACKED);
+
+	for(size_t seg=0; seg<set->m_segments; seg++)
+	{
+		for(auto& it : m_power)
+		{
+			size_t ch = it.first;
+
+			//Window the samples in volts (the zero padding after them never changes)
+			if(raw)
+			{
+				const int16_t* samples = set->m_rawBuffers[ch] + seg*depth;
+				float scale = set->m_ranges[ch] / 65536;
+				float offset = set->m_centers[ch];
+
+				#pragma omp parallel for
+				for(size_t i=0; i<depth; i++)
+					input[i] = (samples[i]*scale + offset) * window[i];
+			}
+			else
+			{
+				const double* samples = set->m_waveformBuffers[ch] + seg*depth;
+
+				#pragma omp parallel for
+				for(size_t i=0; i<depth; i++)
+					input[i] = samples[i] * window[i];
+			}
+
+			m_fft.Transform(input, &m_re[0], &m_im[0]);
+			AddPower(&m_re[0], &m_im[0], &it.second[0], m_peakHold ? &m_peak[ch][0] : NULL, bins);
+		}
+
+		m_count ++;
+	}
+
+	return (m_count >= m_averages);
+}
+
+/**
+	@brief Throws away the average in progress and the peak hold
+ */
+void SpectrumAnalyzer::Clear()
+{
+	ResetAverage();
+	for(auto& it : m_peak)
+		fill(it.second.begin(), it.second.end(), 0);
+}
+
+/**
+	@brief Starts a new average
+ */
+void SpectrumAnalyzer::ResetAverage()
+{
+	for(auto& it : m_power)
+		fill(it.second.begin(), it.second.end(), 0);
+	m_count = 0;
+}
+
+/**
+	@brief Checks if a capture can be added to the spectra in progress
+ */
+bool SpectrumAnalyzer::IsCompatible(CaptureBufferSet* set)
+{
+	return (set->m_spectrum == m_mode) &&
+		(set->m_window == m_window) &&
+		(set->m_spectrumAverages == m_averages) &&
+		(set->m_peakHold == m_peakHold) &&
+		(set->m_spectrogramBins == m_rowBins) &&
+		(set->m_depth == m_depth) &&
+		(set->m_interval == m_interval) &&
+		(set->m_channelOn == m_channelOn);
+}
+
+/**
+	@brief Sets up for a new configuration, with an empty average and peak hold
+ */
+void SpectrumAnalyzer::Start(CaptureBufferSet* set)
+{
+	m_mode = set->m_spectrum;
+	m_window = set->m_window;
+	m_averages = set->m_spectrumAverages;
+	m_peakHold = set->m_peakHold;
+	m_rowBins = set->m_spectrogramBins;
+	m_depth = set->m_depth;
+	m_interval = set->m_interval;
+	m_channelOn = set->m_channelOn;
+
+	m_fft.Plan(RealFFT::GetPointsForDepth(m_depth));
+	size_t bins = m_fft.GetBins();
+
+	m_input.assign(m_fft.GetPoints(), 0);
+	m_re.resize(bins);
+	m_im.resize(bins);
+
+	//Window coefficients, and their sum to correct for the window's loss
+	m_windowCoeffs.resize(m_depth);
+	double sum = 0;
+	double step = 2 * M_PI / max<size_t>(m_depth - 1, 1);
+	for(size_t i=0; i<m_depth; i++)
+	{
+		double x = step * i;
+		double w;
+		switch(m_window)
+		{
+			case WINDOW_HANN:
+				w = 0.5 - 0.5*cos(x);
+				break;
+
+			case WINDOW_HAMMING:
+				w = 0.54 - 0.46*cos(x);
+				break;
+
+			case WINDOW_BLACKMAN_HARRIS:
+				w = 0.35875 - 0.48829*cos(x) + 0.14128*cos(2*x) - 0.01168*cos(3*x);
+				break;
+
+			case WINDOW_RECTANGULAR:
+			default:
+				w = 1;
+				break;
+		}
+		m_windowCoeffs[i] = w;
+		sum += w;
+	}
+
+	//A sine of peak amplitude A in bin k has |X| = A*sum/2, and A^2/2 across 50 ohms is A^2 * 10 mW
+	m_powerScale = 40 / (sum * sum);
+
+	m_power.clear();
+	m_peak.clear();
+	m_levels.clear();
+	m_peakLevels.clear();
+	for(auto it : m_channelOn)
+	{
+		if(!it.second)
+			continue;
+
+		m_power[it.first].resize(bins);
+		if(m_peakHold)
+			m_peak[it.first].resize(bins);
+	}
+
+	Clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Serialization
+
+/**
+	@brief Serializes the averaged spectra into a data plane frame
+
+	Same global header as a full frame, then the frame type (FRAME_SPECTRUM, or FRAME_SPECTROGRAM for rows),
+	uint64 {spectra averaged, peak hold}, and per channel: uint64 {id, FFT points, bins}, double bin width in Hz,
+	then the level of each bin as float dBm into 50 ohms, followed by the peak hold levels if enabled.
+
+	Spectrogram rows are reduced to at most the requested number of bins, each the highest of the bins it covers.
+ */
+DataPlaneFrame& SpectrumAnalyzer::BuildFrame()
+{
+	size_t bins = m_fft.GetBins();
+	size_t group = 1;
+	if( (m_mode == SPECTRUM_ROWS) && (m_rowBins < bins) )
+		group = (bins + m_rowBins - 1) / m_rowBins;
+	size_t outBins = (bins + group - 1) / group;
+	double binWidth = FS_PER_SECOND * group / (static_cast<double>(m_fft.GetPoints()) * max<int64_t>(m_interval, 1));
+
+	//The DC and Nyquist bins don't have a mirror image sharing their energy
+	double scale = m_powerScale / max<size_t>(m_count, 1);
+	float minPower = pow(10, SPECTRUM_FLOOR_DBM / 10.0);
+	auto level = [&](float power, size_t bin)
+	{
+		double p = power * scale;
+		if( (bin == 0) || (bin == bins-1) )
+			p /= 4;
+		return static_cast<float>(10 * log10(max<double>(p, minPower)));
+	};
+
+	uint16_t numchans = m_power.size();
+
+	m_frame.Clear();
+	m_frame.AddHeader(numchans);
+	m_frame.AddHeader(m_interval);
+	m_frame.AddHeader(static_cast<uint64_t>( (m_mode == SPECTRUM_ROWS) ? FRAME_SPECTROGRAM : FRAME_SPECTRUM));
+	uint64_t info[2] = {m_count, m_peakHold};
+	m_frame.AddHeader(info);
+
+	for(auto& it : m_power)
+	{
+		size_t ch = it.first;
+		const float* power = &it.second[0];
+		const float* peak = m_peakHold ? &m_peak[ch][0] : NULL;
+		vector<float>& levels = m_levels[ch];
+		vector<float>& peakLevels = m_peakLevels[ch];
+		levels.resize(outBins);
+		if(m_peakHold)
+			peakLevels.resize(outBins);
+
+		//Peak hold is per spectrum, not averaged, so it's scaled back up by the count
+		#pragma omp parallel for
+		for(size_t i=0; i<outBins; i++)
+		{
+			size_t first = i * group;
+			size_t last = min(first + group, bins);
+
+			size_t best = first;
+			for(size_t k=first+1; k<last; k++)
+			{
+				if(power[k] > power[best])
+					best = k;
+			}
+			levels[i] = level(power[best], best);
+
+			if(peak)
+			{
+				best = first;
+				for(size_t k=first+1; k<last; k++)
+				{
+					if(peak[k] > peak[best])
+						best = k;
+				}
+				peakLevels[i] = level(peak[best] * max<size_t>(m_count, 1), best);
+			}
+		}
+
+		uint64_t header[3] = {ch, m_fft.GetPoints(), outBins};
+		m_frame.AddHeader(header);
+		m_frame.AddHeader(binWidth);
+		m_frame.AddPayload(reinterpret_cast<const uint8_t*>(&levels[0]), outBins * sizeof(float));
+		if(m_peakHold)
+			m_frame.AddPayload(reinterpret_cast<const uint8_t*>(&peakLevels[0]), outBins * sizeof(float));
+	}
+
+	return m_frame;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Benchmarking
+
+/**
+	@brief Measures FFT throughput at each capture depth and logs it
+ */
+void SpectrumAnalyzer::Benchmark(const vector<size_t>& depths)
+{
+	LogNotice("FFT throughput:\n");
+	LogIndenter li;
+
+	RealFFT fft;
+	for(auto depth : depths)
+	{
+		size_t points = RealFFT::GetPointsForDepth(depth);
+		fft.Plan(points);
+
+		vector<float> input(points, 0);
+		vector<float> re(fft.GetBins());
+		vector<float> im(fft.GetBins());
+		for(size_t i=0; i<depth; i++)
+			input[i] = sin(i * 0.01);
+
+		//Run for at least a second (and a few transforms) to get a stable number
+		size_t iterations = 0;
+		double dt = 0;
+		auto start = chrono::steady_clock::now();
+		while( (dt < 1) || (iterations < 3) )
+		{
+			fft.Transform(&input[0], &re[0], &im[0]);
+			iterations ++;
+			dt = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		}
+
+		LogNotice("%10zu samples (%10zu point FFT): %10.3f ms/FFT, %10.2f MS/s, %8.2f FFT/s\n",
+			depth,
+			points,
+			dt * 1e3 / iterations,
+			depth * iterations / (dt * 1e6),
+			iterations / dt);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Kernels
+
+/**
+	@brief Adds the squared magnitude of each bin to a running sum, and updates the peak hold if there is one
+ */
+static void AddPower(const float* re, const float* im, float* power, float* peak, size_t count)
+{
+	#pragma omp parallel for
+	for(size_t block=0; block<count; block += 65536)
+	{
+		size_t i = block;
+		size_t blockEnd = min(block + 65536, count);
+
+#ifdef __x86_64__
+		for(; i + 4 <= blockEnd; i += 4)
+		{
+			__m128 r = _mm_loadu_ps(re + i);
+			__m128 m = _mm_loadu_ps(im + i);
+			__m128 p = _mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(m, m));
+			_mm_storeu_ps(power + i, _mm_add_ps(_mm_loadu_ps(power + i), p));
+			if(peak)
+				_mm_storeu_ps(peak + i, _mm_max_ps(_mm_loadu_ps(peak + i), p));
+		}
+#endif
+
+		for(; i<blockEnd; i++)
+		{
+			float p = re[i]*re[i] + im[i]*im[i];
+			power[i] += p;
+			if(peak)
+				peak[i] = max(peak[i], p);
+		}
+	}
+}
@@ -0,0 +1,101 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SpectrumAnalyzer_h
+#define SpectrumAnalyzer_h
+
+#include "wfmserver.h"
+#include "DataPlaneFrame.h"
+#include "RealFFT.h"
+
+class CaptureBufferSet;
+
+/**
+	@brief Windowed magnitude spectra of each channel, with optional averaging and peak hold
+
+	Captures are zero padded to a power of two. Each capture (or each segment of a burst) is one spectrum. Power is
+	averaged over a block of spectra, then the average is sent and the next block starts. Peak hold keeps the largest
+	power seen in any single spectrum until cleared.
+ */
+class SpectrumAnalyzer
+{
+public:
+	SpectrumAnalyzer();
+
+	bool Accumulate(CaptureBufferSet* set);
+	void Clear();
+
+	DataPlaneFrame& BuildFrame();
+
+	static void Benchmark(const std::vector<size_t>& depths);
+
+protected:
+	bool IsCompatible(CaptureBufferSet* set);
+	void Start(CaptureBufferSet* set);
+	void ResetAverage();
+
+	//Configuration of the spectra being accumulated
+	SpectrumMode m_mode;
+	FFTWindow m_window;
+	size_t m_averages;
+	bool m_peakHold;
+	size_t m_rowBins;
+	size_t m_depth;
+	int64_t m_interval;
+	std::map<size_t, bool> m_channelOn;
+
+	RealFFT m_fft;
+
+	///@brief Window coefficient of each sample
+	std::vector<float> m_windowCoeffs;
+
+	///@brief Converts squared FFT output to mW into 50 ohms, for a sine wave landing in a single bin
+	double m_powerScale;
+
+	//Scratch buffers for the channel being transformed (windowed samples, zero padded, and complex bins)
+	std::vector<float> m_input;
+	std::vector<float> m_re;
+	std::vector<float> m_im;
+
+	///@brief Number of spectra in the current average
+	size_t m_count;
+
+	//Sum of squared magnitudes and peak hold of each bin, for enabled channels
+	std::map<size_t, std::vector<float> > m_power;
+	std::map<size_t, std::vector<float> > m_peak;
+
+	//Levels to send, in dBm
+	std::map<size_t, std::vector<float> > m_levels;
+	std::map<size_t, std::vector<float> > m_peakLevels;
+
+	//The serialized spectra
+	DataPlaneFrame m_frame;
+};
+
+#endif
@@ -0,0 +1,801 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of SyntheticDevice
+ */
+#include "wfmserver.h"
+#include "SyntheticDevice.h"
+#include <climits>
+#include <cmath>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+SyntheticDevice::SyntheticDevice()
+	: m_waveform(WAVE_SINE)
+	, m_frequency(1e6)
+	, m_amplitude(1)
+	, m_noise(0.01)
+	, m_numChannels(2)
+	, m_bits(14)
+	, m_maxRate(125e6)
+	, m_maxDepth(32768)
+	, m_triggerWait(0)
+	, m_latency(0)
+	, m_rng(random_device()())
+{
+	ResetSettings();
+}
+
+SyntheticDevice::~SyntheticDevice()
+{
+	Close();
+}
+
+/**
+	@brief Parses the options (see the class description), and fills in the device description
+
+	@return False if the options don't make sense
+ */
+bool SyntheticDevice::Open(const string& spec)
+{
+	size_t start = 0;
+	while(start <= spec.size())
+	{
+		size_t end = spec.find(',', start);
+		if(end == string::npos)
+			end = spec.size();
+		string opt = spec.substr(start, end - start);
+		start = end + 1;
+		if(opt.empty())
+			continue;
+
+		string key = opt;
+		string value;
+		size_t eq = opt.find('=');
+		if(eq != string::npos)
+		{
+			key = opt.substr(0, eq);
+			value = opt.substr(eq + 1);
+		}
+
+		//A waveform name on its own is short for wave=name
+		if(eq == string::npos)
+		{
+			value = key;
+			key = "wave";
+		}
+
+		if(key == "wave")
+		{
+			if(value == "sine")
+				m_waveform = WAVE_SINE;
+			else if(value == "square")
+				m_waveform = WAVE_SQUARE;
+			else if(value == "noise")
+				m_waveform = WAVE_NOISE;
+			else
+			{
+				LogError("Unknown synthetic waveform \"%s\" (expected sine, square or noise)\n", value.c_str());
+				return false;
+			}
+		}
+		else if(key == "freq")
+			m_frequency = atof(value.c_str());
+		else if(key == "amp")
+			m_amplitude = atof(value.c_str());
+		else if(key == "noise")
+			m_noise = atof(value.c_str());
+		else if(key == "channels")
+			m_numChannels = atoi(value.c_str());
+		else if(key == "bits")
+			m_bits = atoi(value.c_str());
+		else if(key == "maxrate")
+			m_maxRate = atof(value.c_str());
+		else if(key == "maxdepth")
+			m_maxDepth = atoi(value.c_str());
+		else if(key == "trigwait")
+			m_triggerWait = chrono::microseconds(atoll(value.c_str()));
+		else if(key == "latency")
+			m_latency = chrono::microseconds(atoll(value.c_str()));
+		else
+		{
+			LogError("Unknown synthetic device option \"%s\"\n", key.c_str());
+			return false;
+		}
+	}
+
+	if( (m_frequency <= 0) || (m_amplitude < 0) || (m_noise < 0) || (m_numChannels < 1) || (m_numChannels > 16) ||
+		(m_bits < 1) || (m_bits > 16) || (m_maxRate < 1) || (m_maxDepth < 16) ||
+		(m_triggerWait.count() < 0) || (m_latency.count() < 0) )
+	{
+		LogError("Invalid synthetic device options \"%s\"\n", spec.c_str());
+		return false;
+	}
+
+	//Same noise every run, it's only the window that's random
+	normal_distribution<double> gauss;
+	minstd_rand seeded;
+	m_noiseTable.resize(SYNTHETIC_NOISE_SIZE);
+	for(auto& n : m_noiseTable)
+		n = gauss(seeded);
+
+	ResetSettings();
+
+	g_model = "Synthetic";
+	g_serial = "0";
+	g_fwver = "1.0";
+	g_numAnalogInChannels = m_numChannels;
+
+	static const char* names[] = { "sine", "square", "noise" };
+	LogVerbose("Synthetic device: %zu channels, %.0f Hz %s, %.3f V amplitude, %.3f V noise\n",
+		m_numChannels, m_frequency, names[m_waveform], m_amplitude, m_noise);
+	return true;
+}
+
+void SyntheticDevice::Close()
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_running = false;
+}
+
+/**
+	@brief Puts every setting back to what the device starts up with
+
+	Must be called with m_mutex held (or before anyone else can see us).
+ */
+void SyntheticDevice::ResetSettings()
+{
+	m_acquisitionMode = acqmodeSingle;
+	m_rate = m_maxRate;
+	m_depth = m_maxDepth;
+	m_channelOn.assign(m_numChannels, true);
+	m_ranges.assign(m_numChannels, 5.0);
+	m_offsets.assign(m_numChannels, 0.0);
+	m_triggerSource = trigsrcNone;
+	m_autoTimeout = 0;
+	m_triggerChannel = 0;
+	m_triggerLevel = 0;
+	m_triggerSlope = DwfTriggerSlopeRise;
+	m_triggerPosition = 0;
+
+	m_running = false;
+	m_willTrigger = false;
+	m_captured = false;
+	m_state = DwfStateReady;
+	m_samplesLeft = m_depth;
+	m_recordAvailable = 0;
+	m_recordLost = 0;
+	m_recordProduced = 0;
+	m_recordCollected = 0;
+	m_samples.assign(m_numChannels, vector<double>());
+	m_sampleCount = 0;
+	m_cleanValid = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Helpers
+
+/**
+	@brief Takes as long as a call to the real SDK would (if we were asked to pretend to be slow)
+
+	Called before taking m_mutex, so a slow call doesn't hold up others any more than the SDK's own locking would.
+ */
+void SyntheticDevice::SimulateLatency()
+{
+	if(m_latency.count())
+		this_thread::sleep_for(m_latency);
+}
+
+bool SyntheticDevice::IsValidChannel(int channel)
+{
+	return (channel >= 0) && (static_cast<size_t>(channel) < m_numChannels);
+}
+
+/**
+	@brief Index of the trigger point in the buffer, for the current depth and trigger position
+
+	The trigger position is in seconds from the middle of the buffer, positive towards the start.
+ */
+size_t SyntheticDevice::GetTriggerIndex()
+{
+	int64_t index = m_depth/2 - llround(m_triggerPosition * m_rate);
+	return min<int64_t>(max<int64_t>(index, 0), m_depth);
+}
+
+/**
+	@brief Phase of a channel at the trigger point
+
+	Chosen so the trigger channel crosses the trigger level there, on the right edge.
+ */
+double SyntheticDevice::GetPhase(size_t channel)
+{
+	double phase = 0;
+	if( (m_waveform == WAVE_SINE) && (m_amplitude > 0) )
+	{
+		double level = min(max(m_triggerLevel / m_amplitude, -1.0), 1.0);
+		phase = asin(level);
+		if(m_triggerSlope == DwfTriggerSlopeFall)
+			phase = M_PI - phase;
+	}
+	else if( (m_waveform == WAVE_SQUARE) && (m_triggerSlope == DwfTriggerSlopeFall) )
+		phase = M_PI;
+
+	return phase + (static_cast<double>(channel) - m_triggerChannel) * M_PI / 2;
+}
+
+/**
+	@brief Generates the noise-free waveform
+
+	@param phase	Phase of the first sample
+ */
+void SyntheticDevice::Synthesize(double phase, size_t count, double* out)
+{
+	if(m_waveform == WAVE_NOISE)
+	{
+		for(size_t i=0; i<count; i++)
+			out[i] = 0;
+		return;
+	}
+
+	//Rotate a phasor from sample to sample rather than calling sin() for each one. Start from an exact value
+	//every so often so rounding errors don't build up.
+	const size_t block = 1024;
+	double step = 2 * M_PI * m_frequency / m_rate;
+	double rc = cos(step);
+	double rs = sin(step);
+	for(size_t base=0; base<count; base+=block)
+	{
+		double p = fmod(phase + step*base, 2 * M_PI);
+		double c = cos(p);
+		double s = sin(p);
+		size_t end = min(count, base + block);
+		for(size_t i=base; i<end; i++)
+		{
+			if(m_waveform == WAVE_SQUARE)
+				out[i] = (s >= 0) ? m_amplitude : -m_amplitude;
+			else
+				out[i] = s * m_amplitude;
+
+			double nc = c*rc - s*rs;
+			s = s*rc + c*rs;
+			c = nc;
+		}
+	}
+}
+
+/**
+	@brief Adds noise to a waveform, from a random place in the noise table
+ */
+void SyntheticDevice::AddNoise(size_t count, double* out)
+{
+	double rms = m_noise;
+	if(m_waveform == WAVE_NOISE)
+		rms += m_amplitude;
+	if(rms == 0)
+		return;
+
+	const size_t mask = SYNTHETIC_NOISE_SIZE - 1;
+	size_t start = m_rng() & mask;
+	for(size_t i=0; i<count; i++)
+		out[i] += rms * m_noiseTable[(start + i) & mask];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Timing model
+
+/**
+	@brief Starts an acquisition, working out when it will trigger and finish
+
+	Must be called with m_mutex held.
+ */
+void SyntheticDevice::Arm()
+{
+	auto now = chrono::steady_clock::now();
+	auto seconds = [](double s)
+		{ return chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(s)); };
+
+	m_running = true;
+	m_captured = false;
+	m_armTime = now;
+	m_sampleCount = 0;
+	m_recordAvailable = 0;
+	m_recordLost = 0;
+	m_recordProduced = 0;
+	m_recordCollected = 0;
+
+	//Recording starts as soon as we're allowed to
+	if(m_acquisitionMode == acqmodeRecord)
+	{
+		m_willTrigger = true;
+		m_prefillTime = now;
+		m_triggerTime = now + m_triggerWait;
+		m_doneTime = chrono::steady_clock::time_point::max();
+		m_samplesLeft = m_depth;
+		return;
+	}
+
+	//The pre-trigger part of the buffer has to fill before we can trigger
+	size_t triggerIndex = GetTriggerIndex();
+	m_prefillTime = now + seconds(triggerIndex / m_rate);
+	auto earliest = max(m_prefillTime, now + chrono::duration_cast<chrono::steady_clock::duration>(m_triggerWait));
+
+	//Then we wait for the next crossing of the trigger level, if there is one
+	bool crosses;
+	if(m_waveform == WAVE_NOISE)
+		crosses = fabs(m_triggerLevel) < 3 * (m_amplitude + m_noise);
+	else
+		crosses = fabs(m_triggerLevel) < m_amplitude;
+
+	m_willTrigger = true;
+	if(m_triggerSource == trigsrcNone)
+		m_triggerTime = earliest;
+	else if(crosses)
+	{
+		uniform_real_distribution<double> wait(0, 1 / m_frequency);
+		m_triggerTime = earliest + seconds(wait(m_rng));
+	}
+	else if(m_autoTimeout > 0)
+		m_triggerTime = max(m_prefillTime, now + seconds(m_autoTimeout));
+	else
+		m_willTrigger = false;
+
+	m_doneTime = m_triggerTime + seconds((m_depth - triggerIndex) / m_rate);
+	m_samplesLeft = m_depth - triggerIndex;
+}
+
+/**
+	@brief Fills in the samples of a completed single capture
+
+	Must be called with m_mutex held.
+ */
+void SyntheticDevice::CaptureSingle()
+{
+	//Every capture is lined up on the trigger, so the clean waveform is the same each time
+	if(!m_cleanValid)
+	{
+		double step = 2 * M_PI * m_frequency / m_rate;
+		double start = step * GetTriggerIndex();
+		m_clean.assign(m_numChannels, vector<double>());
+		for(size_t i=0; i<m_numChannels; i++)
+		{
+			if(!m_channelOn[i])
+				continue;
+			m_clean[i].resize(m_depth);
+			Synthesize(GetPhase(i) - start, m_depth, &m_clean[i][0]);
+		}
+		m_cleanValid = true;
+	}
+
+	for(size_t i=0; i<m_numChannels; i++)
+	{
+		if(!m_channelOn[i])
+			continue;
+		m_samples[i] = m_clean[i];
+		AddNoise(m_depth, &m_samples[i][0]);
+	}
+	m_sampleCount = m_depth;
+}
+
+/**
+	@brief Collects the samples recorded since the last poll, as much of them as fits in the buffer
+
+	The signal carries on through lost samples, as it would on a real device.
+
+	Must be called with m_mutex held.
+ */
+void SyntheticDevice::CaptureRecord(chrono::steady_clock::time_point now)
+{
+	m_recordProduced = static_cast<uint64_t>(chrono::duration<double>(now - m_triggerTime).count() * m_rate);
+	uint64_t pending = m_recordProduced - m_recordCollected;
+	uint64_t available = min<uint64_t>(pending, m_depth);
+	uint64_t lost = pending - available;
+	uint64_t first = m_recordCollected + lost;
+
+	double step = 2 * M_PI * m_frequency / m_rate;
+	for(size_t i=0; i<m_numChannels; i++)
+	{
+		if(!m_channelOn[i])
+			continue;
+		m_samples[i].resize(available);
+		if(!available)
+			continue;
+		Synthesize(fmod(step * first, 2 * M_PI) + i * M_PI / 2, available, &m_samples[i][0]);
+		AddNoise(available, &m_samples[i][0]);
+	}
+
+	m_sampleCount = available;
+	m_recordAvailable = available;
+	m_recordLost = min<uint64_t>(lost, INT_MAX);
+	m_recordCollected = m_recordProduced;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Capabilities
+
+bool SyntheticDevice::BitsInfo(int& bits)
+{
+	SimulateLatency();
+	bits = m_bits;
+	return true;
+}
+
+bool SyntheticDevice::FrequencyInfo(double& minHz, double& maxHz)
+{
+	SimulateLatency();
+	minHz = 1;
+	maxHz = m_maxRate;
+	return true;
+}
+
+bool SyntheticDevice::BufferSizeInfo(int& minSize, int& maxSize)
+{
+	SimulateLatency();
+	minSize = 16;
+	maxSize = m_maxDepth;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Configuration
+
+bool SyntheticDevice::Reset()
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	ResetSettings();
+	return true;
+}
+
+bool SyntheticDevice::Configure(bool /*reconfigure*/, bool start)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(start)
+		Arm();
+	else
+	{
+		m_running = false;
+		m_state = DwfStateReady;
+	}
+	return true;
+}
+
+bool SyntheticDevice::AcquisitionModeSet(ACQMODE mode)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if( (mode != acqmodeSingle) && (mode != acqmodeRecord) )
+		return false;
+	m_acquisitionMode = mode;
+	return true;
+}
+
+bool SyntheticDevice::RecordLengthSet(double seconds)
+{
+	//We only record forever
+	SimulateLatency();
+	return (seconds == 0);
+}
+
+bool SyntheticDevice::FrequencySet(double hz)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(hz <= 0)
+		return false;
+
+	//Rates are the max rate divided by a whole number, like on the real thing
+	double divider = max(1.0, round(m_maxRate / hz));
+	m_rate = m_maxRate / divider;
+	m_cleanValid = false;
+	return true;
+}
+
+bool SyntheticDevice::BufferSizeSet(int size)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	m_depth = min(max(size, 16), m_maxDepth);
+	m_cleanValid = false;
+	return true;
+}
+
+bool SyntheticDevice::ChannelEnableSet(int channel, bool enable)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(!IsValidChannel(channel))
+		return false;
+	m_channelOn[channel] = enable;
+	m_cleanValid = false;
+	return true;
+}
+
+bool SyntheticDevice::ChannelAttenuationSet(int channel, double /*attenuation*/)
+{
+	//Accepted, but there's no probe to attenuate
+	SimulateLatency();
+	return IsValidChannel(channel);
+}
+
+bool SyntheticDevice::ChannelCouplingSet(int channel, DwfAnalogCoupling /*coupling*/)
+{
+	//Accepted, but all of our waveforms have no DC component anyway
+	SimulateLatency();
+	return IsValidChannel(channel);
+}
+
+bool SyntheticDevice::ChannelRangeSet(int channel, double volts)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(!IsValidChannel(channel) || (volts <= 0) )
+		return false;
+	m_ranges[channel] = volts;
+	return true;
+}
+
+bool SyntheticDevice::ChannelRangeGet(int channel, double& volts)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(!IsValidChannel(channel))
+		return false;
+	volts = m_ranges[channel];
+	return true;
+}
+
+bool SyntheticDevice::ChannelOffsetSet(int channel, double volts)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(!IsValidChannel(channel))
+		return false;
+	m_offsets[channel] = volts;
+	return true;
+}
+
+bool SyntheticDevice::ChannelOffsetGet(int channel, double& volts)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(!IsValidChannel(channel))
+		return false;
+	volts = m_offsets[channel];
+	return true;
+}
+
+bool SyntheticDevice::TriggerSourceSet(TRIGSRC source)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	m_triggerSource = source;
+	return true;
+}
+
+bool SyntheticDevice::TriggerAutoTimeoutSet(double seconds)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	m_autoTimeout = seconds;
+	return true;
+}
+
+bool SyntheticDevice::TriggerChannelSet(int channel)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(!IsValidChannel(channel))
+		return false;
+	m_triggerChannel = channel;
+	m_cleanValid = false;
+	return true;
+}
+
+bool SyntheticDevice::TriggerLevelSet(double volts)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	m_triggerLevel = volts;
+	m_cleanValid = false;
+	return true;
+}
+
+bool SyntheticDevice::TriggerTypeSet(TRIGTYPE type)
+{
+	//Edge triggers only
+	SimulateLatency();
+	return (type == trigtypeEdge);
+}
+
+bool SyntheticDevice::TriggerConditionSet(DwfTriggerSlope slope)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	m_triggerSlope = slope;
+	m_cleanValid = false;
+	return true;
+}
+
+bool SyntheticDevice::TriggerPositionSet(double seconds)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	m_triggerPosition = seconds;
+	m_cleanValid = false;
+	return true;
+}
+
+bool SyntheticDevice::TriggerPositionGet(double& seconds)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	seconds = m_triggerPosition;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Acquisition
+
+bool SyntheticDevice::Status(bool readData, DwfState& state)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	auto now = chrono::steady_clock::now();
+
+	if(!m_running)
+		m_state = DwfStateReady;
+
+	else if(m_acquisitionMode == acqmodeRecord)
+	{
+		if(now < m_triggerTime)
+			m_state = DwfStateArmed;
+		else
+		{
+			m_state = DwfStateRunning;
+			if(readData)
+				CaptureRecord(now);
+		}
+	}
+
+	else if(now < m_prefillTime)
+		m_state = DwfStatePrefill;
+	else if(!m_willTrigger || (now < m_triggerTime) )
+		m_state = DwfStateArmed;
+	else if(now < m_doneTime)
+	{
+		m_state = DwfStateTriggered;
+		m_samplesLeft = max<int64_t>(1, ceil(chrono::duration<double>(m_doneTime - now).count() * m_rate));
+	}
+	else
+	{
+		m_state = DwfStateDone;
+		m_samplesLeft = 0;
+		if(readData && !m_captured)
+		{
+			CaptureSingle();
+			m_captured = true;
+		}
+	}
+
+	state = m_state;
+	return true;
+}
+
+bool SyntheticDevice::StatusSamplesLeft(int& samples)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	samples = m_samplesLeft;
+	return true;
+}
+
+bool SyntheticDevice::StatusRecord(int& available, int& lost, int& corrupt)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	available = m_recordAvailable;
+	lost = m_recordLost;
+	corrupt = 0;
+	return true;
+}
+
+bool SyntheticDevice::StatusTime(unsigned int& sec, unsigned int& tick, unsigned int& ticksPerSecond)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(!m_running || !m_willTrigger)
+		return false;
+
+	//Trigger time on the host's monotonic clock, in 10 ns ticks
+	int64_t ns = chrono::duration_cast<chrono::nanoseconds>(m_triggerTime.time_since_epoch()).count();
+	ticksPerSecond = 100000000;
+	sec = ns / 1000000000LL;
+	tick = (ns % 1000000000LL) / 10;
+	return true;
+}
+
+bool SyntheticDevice::StatusData(int channel, double* buf, int count)
+{
+	return StatusData2(channel, buf, 0, count);
+}
+
+bool SyntheticDevice::StatusData2(int channel, double* buf, int first, int count)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(!IsValidChannel(channel) || (first < 0) || (count < 0) )
+		return false;
+
+	//Clip to the input range, and anything we don't have reads as zero
+	const vector<double>& samples = m_samples[channel];
+	double lo = m_offsets[channel] - m_ranges[channel]/2;
+	double hi = m_offsets[channel] + m_ranges[channel]/2;
+	size_t end = min(samples.size(), m_sampleCount);
+	for(int i=0; i<count; i++)
+	{
+		size_t j = first + i;
+		buf[i] = (j < end) ? min(max(samples[j], lo), hi) : 0;
+	}
+	return true;
+}
+
+bool SyntheticDevice::StatusData16(int channel, short* buf, int first, int count)
+{
+	SimulateLatency();
+	lock_guard<mutex> lock(m_mutex);
+	if(!IsValidChannel(channel) || (first < 0) || (count < 0) )
+		return false;
+
+	//Full scale signed 16 bit codes centered on the offset, with only the top m_bits bits of each meaningful
+	const vector<double>& samples = m_samples[channel];
+	double offset = m_offsets[channel];
+	double scale = 65536 / m_ranges[channel];
+	int mask = 0xffff << (16 - m_bits);
+	size_t end = min(samples.size(), m_sampleCount);
+	for(int i=0; i<count; i++)
+	{
+		size_t j = first + i;
+		if(j >= end)
+		{
+			buf[i] = 0;
+			continue;
+		}
+		long code = lround( (samples[j] - offset) * scale );
+		code = min(max(code, -32768L), 32767L);
+		buf[i] = static_cast<short>(code & mask);
+	}
+	return true;
+}
@@ -0,0 +1,191 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef SyntheticDevice_h
+#define SyntheticDevice_h
+
+#include "ScopeDevice.h"
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+	@brief Samples in the noise table (power of two)
+ */
+#define SYNTHETIC_NOISE_SIZE 65536
+
+/**
+	@brief Generated waveforms instead of an instrument, for testing the server (and clients) without hardware
+
+	Configured by a comma separated list of options, any of which can be left out:
+	* sine, square or noise (or wave=...): waveform on every channel (default sine)
+	* freq=Hz: frequency of the sine or square wave (default 1 MHz)
+	* amp=V: peak amplitude of the sine or square wave, or RMS amplitude of noise (default 1 V)
+	* noise=V: RMS noise added to every waveform (default 10 mV)
+	* channels=n, bits=n, maxrate=Hz, maxdepth=n: what the device claims to be (default 2, 14, 125 MHz, 32768)
+	* trigwait=us: minimum time from arming to the trigger, on top of filling the pre-trigger part of the buffer
+	* latency=us: time every call takes, to see how the server copes with a slow SDK (default 0)
+
+	Captures take as long as they would on a real device: the pre-trigger samples have to fill, then the trigger
+	comes at the next crossing of the trigger level (somewhere within one period), then the post-trigger samples
+	are acquired at the requested rate. A level the waveform never crosses never triggers, unless there's an auto
+	trigger timeout. In record mode samples pile up at the sample rate between polls, and whatever doesn't fit in
+	the buffer is reported as lost.
+
+	The trigger channel crosses the trigger level right at the trigger point, on the requested edge. Other channels
+	are shifted by a quarter period per channel from it.
+ */
+class SyntheticDevice : public ScopeDevice
+{
+public:
+	SyntheticDevice();
+	virtual ~SyntheticDevice();
+
+	bool Open(const std::string& spec);
+	virtual void Close();
+
+	virtual bool BitsInfo(int& bits);
+	virtual bool FrequencyInfo(double& minHz, double& maxHz);
+	virtual bool BufferSizeInfo(int& minSize, int& maxSize);
+
+	virtual bool Reset();
+	virtual bool Configure(bool reconfigure, bool start);
+	virtual bool AcquisitionModeSet(ACQMODE mode);
+	virtual bool RecordLengthSet(double seconds);
+	virtual bool FrequencySet(double hz);
+	virtual bool BufferSizeSet(int size);
+	virtual bool ChannelEnableSet(int channel, bool enable);
+	virtual bool ChannelAttenuationSet(int channel, double attenuation);
+	virtual bool ChannelCouplingSet(int channel, DwfAnalogCoupling coupling);
+	virtual bool ChannelRangeSet(int channel, double volts);
+	virtual bool ChannelRangeGet(int channel, double& volts);
+	virtual bool ChannelOffsetSet(int channel, double volts);
+	virtual bool ChannelOffsetGet(int channel, double& volts);
+	virtual bool TriggerSourceSet(TRIGSRC source);
+	virtual bool TriggerAutoTimeoutSet(double seconds);
+	virtual bool TriggerChannelSet(int channel);
+	virtual bool TriggerLevelSet(double volts);
+	virtual bool TriggerTypeSet(TRIGTYPE type);
+	virtual bool TriggerConditionSet(DwfTriggerSlope slope);
+	virtual bool TriggerPositionSet(double seconds);
+	virtual bool TriggerPositionGet(double& seconds);
+
+	virtual bool Status(bool readData, DwfState& state);
+	virtual bool StatusSamplesLeft(int& samples);
+	virtual bool StatusRecord(int& available, int& lost, int& corrupt);
+	virtual bool StatusTime(unsigned int& sec, unsigned int& tick, unsigned int& ticksPerSecond);
+	virtual bool StatusData(int channel, double* buf, int count);
+	virtual bool StatusData2(int channel, double* buf, int first, int count);
+	virtual bool StatusData16(int channel, short* buf, int first, int count);
+
+protected:
+	enum Waveform
+	{
+		WAVE_SINE,
+		WAVE_SQUARE,
+		WAVE_NOISE
+	};
+
+	void SimulateLatency();
+	bool IsValidChannel(int channel);
+
+	void ResetSettings();
+	void Arm();
+	void CaptureSingle();
+	void CaptureRecord(std::chrono::steady_clock::time_point now);
+
+	size_t GetTriggerIndex();
+	double GetPhase(size_t channel);
+	void Synthesize(double phase, size_t count, double* out);
+	void AddNoise(size_t count, double* out);
+
+	std::mutex m_mutex;
+
+	//What we're pretending to be
+	Waveform m_waveform;
+	double m_frequency;
+	double m_amplitude;
+	double m_noise;
+	size_t m_numChannels;
+	int m_bits;
+	double m_maxRate;
+	int m_maxDepth;
+	std::chrono::microseconds m_triggerWait;
+	std::chrono::microseconds m_latency;
+
+	//Settings
+	ACQMODE m_acquisitionMode;
+	double m_rate;
+	int m_depth;
+	std::vector<bool> m_channelOn;
+	std::vector<double> m_ranges;
+	std::vector<double> m_offsets;
+	TRIGSRC m_triggerSource;
+	double m_autoTimeout;
+	int m_triggerChannel;
+	double m_triggerLevel;
+	DwfTriggerSlope m_triggerSlope;
+	double m_triggerPosition;
+
+	//Acquisition in progress, if any
+	bool m_running;
+	std::chrono::steady_clock::time_point m_armTime;
+	std::chrono::steady_clock::time_point m_prefillTime;
+	std::chrono::steady_clock::time_point m_triggerTime;
+	std::chrono::steady_clock::time_point m_doneTime;
+	bool m_willTrigger;
+	bool m_captured;
+
+	///@brief Status as of the last Status() call, which is what the other Status* calls report on (like the SDK)
+	DwfState m_state;
+	int m_samplesLeft;
+	int m_recordAvailable;
+	int m_recordLost;
+
+	///@brief Samples produced since recording started, and how many of them were collected (or lost) already
+	uint64_t m_recordProduced;
+	uint64_t m_recordCollected;
+
+	///@brief Samples of each channel from the last capture (or record poll), in volts
+	std::vector< std::vector<double> > m_samples;
+	size_t m_sampleCount;
+
+	///@brief The last single capture without noise, reused as long as nothing changes (it's always the same)
+	std::vector< std::vector<double> > m_clean;
+	bool m_cleanValid;
+
+	///@brief Gaussian noise (unit RMS) to take a random window of for each capture
+	std::vector<double> m_noiseTable;
+
+	std::minstd_rand m_rng;
+};
+
+#endif
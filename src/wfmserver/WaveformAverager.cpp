@@ -0,0 +1,339 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Implementation of WaveformAverager
+ */
+#include "WaveformAverager.h"
+#include "CaptureBufferSet.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#ifdef __x86_64__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+/**
+	@brief Fixed point scale of the interpolation weights for raw codes
+ */
+#define AVERAGE_WEIGHT_BITS 8
+
+static void AccumulateShifted(const int16_t* in, int64_t* acc, size_t count, ptrdiff_t shift, int weight);
+static void AccumulateShifted(const double* in, double* acc, size_t count, ptrdiff_t shift, double frac);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Construction / destruction
+
+WaveformAverager::WaveformAverager(SampleBufferPool* pool)
+	: m_pool(pool)
+	, m_count(0)
+	, m_depth(0)
+	, m_format(FORMAT_FLOAT64)
+	, m_interval(0)
+	, m_refPhase(0)
+{
+}
+
+WaveformAverager::~WaveformAverager()
+{
+	Free();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Averaging
+
+/**
+	@brief Adds a capture to the average
+
+	If the capture configuration changed since the last one, the average starts over from this capture.
+
+	@return True if this was the last capture needed, in which case the set's sample buffers now hold the average
+			(aligned to the first capture's trigger phase) and the averager is reset for the next one.
+			Also true if there isn't memory to average with, in which case the capture is left as it was.
+ */
+bool WaveformAverager::Accumulate(CaptureBufferSet* set)
+{
+	if( (!m_count || !IsCompatible(set)) && !Start(set) )
+		return true;
+
+	//Where this capture's samples land on the reference grid: sample i of the average is at i + delta in this one
+	double delta = m_interval ? (m_refPhase - set->m_trigphase) / m_interval : 0;
+	double whole = floor(delta);
+	ptrdiff_t shift = static_cast<ptrdiff_t>(whole);
+	double frac = delta - whole;
+
+	int weight = static_cast<int>(round(frac * (1 << AVERAGE_WEIGHT_BITS)));
+	if(weight == (1 << AVERAGE_WEIGHT_BITS))
+	{
+		shift ++;
+		weight = 0;
+	}
+
+	for(auto it : m_intAccumulators)
+		AccumulateShifted(set->m_rawBuffers[it.first], it.second, m_depth, shift, weight);
+	for(auto it : m_floatAccumulators)
+		AccumulateShifted(set->m_waveformBuffers[it.first], it.second, m_depth, shift, frac);
+
+	m_count ++;
+	if(m_count < set->m_averages)
+		return false;
+
+	Finish(set);
+	Reset();
+	return true;
+}
+
+/**
+	@brief Throws away the average in progress
+ */
+void WaveformAverager::Reset()
+{
+	m_count = 0;
+}
+
+/**
+	@brief Checks if a capture can be added to the average in progress
+ */
+bool WaveformAverager::IsCompatible(CaptureBufferSet* set)
+{
+	return (set->GetSampleCount() == m_depth) &&
+		(set->m_format == m_format) &&
+		(set->m_interval == m_interval) &&
+		(set->m_channelOn == m_channelOn) &&
+		(set->m_scales == m_scales) &&
+		(set->m_offsets == m_offsets);
+}
+
+/**
+	@brief Starts a new average, with this capture's configuration and trigger phase as the reference
+
+	@return False if the accumulators couldn't be allocated
+ */
+bool WaveformAverager::Start(CaptureBufferSet* set)
+{
+	bool raw = (set->m_format == FORMAT_INT16) || (set->m_format == FORMAT_PACKED);
+	size_t depth = set->GetSampleCount();
+
+	//Reallocate only if the shape of the accumulators changed
+	bool wasRaw = (m_format == FORMAT_INT16) || (m_format == FORMAT_PACKED);
+	if( (depth != m_depth) || (raw != wasRaw) || (set->m_channelOn != m_channelOn) )
+	{
+		Free();
+		for(auto it : set->m_channelOn)
+		{
+			if(!it.second)
+				continue;
+			void* acc;
+			if(raw)
+				acc = m_intAccumulators[it.first] = m_pool->Allocate<int64_t>(depth);
+			else
+				acc = m_floatAccumulators[it.first] = m_pool->Allocate<double>(depth);
+
+			if(!acc)
+			{
+				LogError("Not enough memory to average %zu samples per channel\n", depth);
+				Free();
+				return false;
+			}
+		}
+	}
+
+	m_depth = depth;
+	m_format = set->m_format;
+	m_interval = set->m_interval;
+	m_channelOn = set->m_channelOn;
+	m_scales = set->m_scales;
+	m_offsets = set->m_offsets;
+	m_refPhase = set->m_trigphase;
+	m_count = 0;
+
+	for(auto it : m_intAccumulators)
+		memset(it.second, 0, m_depth * sizeof(int64_t));
+	for(auto it : m_floatAccumulators)
+		memset(it.second, 0, m_depth * sizeof(double));
+	return true;
+}
+
+/**
+	@brief Writes the average into a capture's sample buffers
+ */
+void WaveformAverager::Finish(CaptureBufferSet* set)
+{
+	size_t depth = m_depth;
+
+	//Raw codes are rounded back to codes, so sub-LSB resolution needs a floating point format
+	double rawScale = 1.0 / (static_cast<double>(m_count) * (1 << AVERAGE_WEIGHT_BITS));
+	for(auto it : m_intAccumulators)
+	{
+		const int64_t* acc = it.second;
+		int16_t* out = set->m_rawBuffers[it.first];
+
+		#pragma omp parallel for
+		for(size_t i=0; i<depth; i++)
+			out[i] = static_cast<int16_t>(max(-32768.0, min(32767.0, round(acc[i] * rawScale))));
+	}
+
+	double floatScale = 1.0 / m_count;
+	for(auto it : m_floatAccumulators)
+	{
+		const double* acc = it.second;
+		double* out = set->m_waveformBuffers[it.first];
+
+		#pragma omp parallel for
+		for(size_t i=0; i<depth; i++)
+			out[i] = acc[i] * floatScale;
+	}
+
+	set->m_trigphase = m_refPhase;
+	set->m_averaged = m_count;
+}
+
+/**
+	@brief Returns the accumulators to the pool
+ */
+void WaveformAverager::Free()
+{
+	for(auto it : m_intAccumulators)
+		m_pool->Release(it.second);
+	for(auto it : m_floatAccumulators)
+		m_pool->Release(it.second);
+
+	m_intAccumulators.clear();
+	m_floatAccumulators.clear();
+	m_depth = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Kernels
+
+/**
+	@brief Adds in[i + shift] (linearly interpolated towards in[i + shift + 1]) to acc[i]
+
+	Samples off either end of the input are clamped to the first or last one.
+
+	@param weight	Interpolation weight of the second sample, in 1/2^AVERAGE_WEIGHT_BITS
+ */
+static void AccumulateShifted(const int16_t* in, int64_t* acc, size_t count, ptrdiff_t shift, int weight)
+{
+	ptrdiff_t n = count;
+	int w0 = (1 << AVERAGE_WEIGHT_BITS) - weight;
+
+	//Range where both input samples are in bounds
+	ptrdiff_t start = min(max(-shift, ptrdiff_t(0)), n);
+	ptrdiff_t end = max(min(n - 1 - shift, n), start);
+
+	for(ptrdiff_t i=0; i<start; i++)
+		acc[i] += in[0] * (1 << AVERAGE_WEIGHT_BITS);
+	for(ptrdiff_t i=end; i<n; i++)
+	{
+		ptrdiff_t j = min(max(i + shift, ptrdiff_t(0)), n - 1);
+		ptrdiff_t k = min(j + 1, n - 1);
+		acc[i] += in[j] * w0 + in[k] * weight;
+	}
+
+	#pragma omp parallel for
+	for(ptrdiff_t block = start; block < end; block += 65536)
+	{
+		ptrdiff_t i = block;
+		ptrdiff_t blockEnd = min(block + 65536, end);
+
+#ifdef __x86_64__
+		//Interleave each sample with its neighbor so one multiply-add does the interpolation,
+		//then sign extend to 64 bits to accumulate
+		__m128i weights = _mm_set1_epi32( (weight << 16) | w0);
+		for(; i + 8 <= blockEnd; i += 8)
+		{
+			__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + shift));
+			__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + shift + 1));
+			__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights);
+			__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights);
+			__m128i losign = _mm_srai_epi32(lo, 31);
+			__m128i hisign = _mm_srai_epi32(hi, 31);
+
+			__m128i* p = reinterpret_cast<__m128i*>(acc + i);
+			_mm_storeu_si128(p, _mm_add_epi64(_mm_loadu_si128(p), _mm_unpacklo_epi32(lo, losign)));
+			_mm_storeu_si128(p + 1, _mm_add_epi64(_mm_loadu_si128(p + 1), _mm_unpackhi_epi32(lo, losign)));
+			_mm_storeu_si128(p + 2, _mm_add_epi64(_mm_loadu_si128(p + 2), _mm_unpacklo_epi32(hi, hisign)));
+			_mm_storeu_si128(p + 3, _mm_add_epi64(_mm_loadu_si128(p + 3), _mm_unpackhi_epi32(hi, hisign)));
+		}
+#endif
+
+		for(; i < blockEnd; i++)
+			acc[i] += in[i + shift] * w0 + in[i + shift + 1] * weight;
+	}
+}
+
+/**
+	@brief Adds in[i + shift + frac] (linearly interpolated) to acc[i]
+
+	Samples off either end of the input are clamped to the first or last one.
+ */
+static void AccumulateShifted(const double* in, double* acc, size_t count, ptrdiff_t shift, double frac)
+{
+	ptrdiff_t n = count;
+
+	//Range where both input samples are in bounds
+	ptrdiff_t start = min(max(-shift, ptrdiff_t(0)), n);
+	ptrdiff_t end = max(min(n - 1 - shift, n), start);
+
+	for(ptrdiff_t i=0; i<start; i++)
+		acc[i] += in[0];
+	for(ptrdiff_t i=end; i<n; i++)
+	{
+		ptrdiff_t j = min(max(i + shift, ptrdiff_t(0)), n - 1);
+		ptrdiff_t k = min(j + 1, n - 1);
+		acc[i] += in[j] + frac * (in[k] - in[j]);
+	}
+
+	#pragma omp parallel for
+	for(ptrdiff_t block = start; block < end; block += 65536)
+	{
+		ptrdiff_t i = block;
+		ptrdiff_t blockEnd = min(block + 65536, end);
+
+#ifdef __x86_64__
+		__m128d f = _mm_set1_pd(frac);
+		for(; i + 2 <= blockEnd; i += 2)
+		{
+			__m128d a = _mm_loadu_pd(in + i + shift);
+			__m128d b = _mm_loadu_pd(in + i + shift + 1);
+			__m128d v = _mm_add_pd(a, _mm_mul_pd(f, _mm_sub_pd(b, a)));
+			_mm_storeu_pd(acc + i, _mm_add_pd(_mm_loadu_pd(acc + i), v));
+		}
+#endif
+
+		for(; i < blockEnd; i++)
+			acc[i] += in[i + shift] + frac * (in[i + shift + 1] - in[i + shift]);
+	}
+}
@@ -0,0 +1,90 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+#ifndef WaveformAverager_h
+#define WaveformAverager_h
+
+#include "wfmserver.h"
+#include "SampleBufferPool.h"
+
+class CaptureBufferSet;
+
+/**
+	@brief Accumulates trigger-aligned captures into a running average
+
+	Each capture is resampled onto the first capture's sample grid using the sub-sample trigger phase, so jitter in
+	where the trigger lands relative to the sample clock doesn't smear the average. Raw ADC codes are summed into
+	64-bit integer accumulators (interpolated in 8-bit fixed point), volts into double accumulators.
+ */
+class WaveformAverager
+{
+public:
+	WaveformAverager(SampleBufferPool* pool);
+	~WaveformAverager();
+
+	bool Accumulate(CaptureBufferSet* set);
+	void Reset();
+
+	///@brief Number of captures in the average so far
+	size_t GetCount()
+	{ return m_count; }
+
+protected:
+	bool IsCompatible(CaptureBufferSet* set);
+	bool Start(CaptureBufferSet* set);
+	void Finish(CaptureBufferSet* set);
+	void Free();
+
+	SampleBufferPool* m_pool;
+
+	///@brief Number of captures accumulated so far
+	size_t m_count;
+
+	//Configuration of the captures being averaged
+	size_t m_depth;
+	SampleFormat m_format;
+	int64_t m_interval;
+	std::map<size_t, bool> m_channelOn;
+	std::map<size_t, float> m_scales;
+	std::map<size_t, float> m_offsets;
+
+	///@brief Trigger phase of the first capture, which the rest are aligned to
+	float m_refPhase;
+
+	//Accumulators for enabled channels (integer for raw codes, double for volts)
+	std::map<size_t, int64_t*> m_intAccumulators;
+	std::map<size_t, double*> m_floatAccumulators;
+
+private:
+	//Owns buffers, not copyable
+	WaveformAverager(const WaveformAverager&) = delete;
+	WaveformAverager& operator=(const WaveformAverager&) = delete;
+};
+
+#endif
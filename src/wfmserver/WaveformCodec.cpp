@@ -0,0 +1,239 @@
+/***********************************************************************************************************************
+*                                                                                                                      *
+* wfmserver                                                                                                            *
+*                                                                                                                      *
+* Copyright (c) 2012-2023 Andrew D. Zonenberg                                                                          *
+* All rights reserved.                                                                                                 *
+*                                                                                                                      *
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the     *
+* following conditions are met:                                                                                        *
+*                                                                                                                      *
+*    * Redistributions of source code must retain the above copyright notice, this list of conditions, and the         *
+*      following disclaimer.                                                                                           *
+*                                                                                                                      *
+*    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the       *
+*      following disclaimer in the documentation and/or other materials provided with the distribution.                *
+*                                                                                                                      *
+*    * Neither the name of the author nor the names of any contributors may be used to endorse or promote products     *
+*      derived from this software without specific prior written permission.                                           *
+*                                                                                                                      *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   *
+* TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL *
+* THE AUTHORS BE HELD LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES        *
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR       *
+* BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT *
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       *
+* POSSIBILITY OF SUCH DAMAGE.                                                                                          *
+*                                                                                                                      *
+***********************************************************************************************************************/
+
+/**
+	@file
+	@author Andrew D. Zonenberg
+	@brief Lossless waveform codec (first order delta prediction + adaptive Rice coding)
+
+	Operates on N-bit ADC codes (the top N bits of each raw 16-bit code). The stream is a little-endian bitstream,
+	LSB first, made of partitions of 32 samples. Each partition starts with a 4-bit Rice parameter k, followed by
+	one codeword per sample: the zigzag-mapped difference from the previous sample (zero before the first sample)
+	as q = u >> k ones, a zero, then the low k bits of u. If q >= 31 the codeword is instead 31 ones followed by
+	u in N+1 bits.
+ */
+#include "WaveformCodec.h"
+
+/**
+	@brief Samples per Rice parameter
+ */
+#define RICE_PARTITION_SIZE 32
+
+/**
+	@brief Unary prefix length which marks an escaped (raw) codeword
+ */
+#define RICE_ESCAPE 31
+
+/**
+	@brief Helper for writing the bitstream 32 bits at a time
+ */
+struct RiceBitWriter
+{
+	uint8_t* m_ptr;
+	uint8_t* m_end;
+	uint64_t m_acc;
+	int m_bits;
+	bool m_overflow;
+
+	void Put(uint32_t value, int nbits)
+	{
+		m_acc |= static_cast<uint64_t>(value) << m_bits;
+		m_bits += nbits;
+		if(m_bits >= 32)
+			Flush32();
+	}
+
+	void Flush32()
+	{
+		if(m_ptr + 4 > m_end)
+		{
+			m_overflow = true;
+			m_bits -= 32;
+			m_acc >>= 32;
+			return;
+		}
+
+		for(int i=0; i<4; i++)
+			*m_ptr++ = (m_acc >> (8*i)) & 0xff;
+		m_acc >>= 32;
+		m_bits -= 32;
+	}
+};
+
+/**
+	@brief Compresses a waveform
+
+	@param in		Raw 16-bit ADC codes
+	@param out		Output buffer
+	@param count	Number of samples
+	@param maxlen	Size of the output buffer
+	@param nbits	Number of significant bits per code
+
+	@return Compressed size in bytes, or zero if the compressed waveform would not fit in maxlen
+ */
+size_t CompressSamples(const int16_t* in, uint8_t* out, size_t count, size_t maxlen, int nbits)
+{
+	RiceBitWriter w = { out, out + maxlen, 0, 0, false };
+
+	int shift = 16 - nbits;
+	int escbits = nbits + 1;
+	int32_t prev = 0;
+	uint32_t zz[RICE_PARTITION_SIZE];
+	for(size_t base = 0; base < count; base += RICE_PARTITION_SIZE)
+	{
+		size_t len = count - base;
+		if(len > RICE_PARTITION_SIZE)
+			len = RICE_PARTITION_SIZE;
+
+		//Predict and zigzag map the residuals
+		uint64_t sum = 0;
+		for(size_t i=0; i<len; i++)
+		{
+			int32_t code = in[base + i] >> shift;
+			int32_t delta = code - prev;
+			prev = code;
+
+			zz[i] = (static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31);
+			sum += zz[i];
+		}
+
+		//Pick k so that the mean residual is about 2^k
+		int k = 0;
+		while( (k < 15) && ( (static_cast<uint64_t>(len) << (k+1)) <= sum) )
+			k ++;
+		w.Put(k, 4);
+
+		//Emit codewords
+		uint32_t kmask = (1 << k) - 1;
+		for(size_t i=0; i<len; i++)
+		{
+			uint32_t q = zz[i] >> k;
+			if(q < RICE_ESCAPE)
+			{
+				w.Put( (1 << q) - 1, q + 1);
+				w.Put(zz[i] & kmask, k);
+			}
+			else
+			{
+				w.Put( (1u << RICE_ESCAPE) - 1, RICE_ESCAPE);
+				w.Put(zz[i], escbits);
+			}
+		}
+
+		if(w.m_overflow)
+			return 0;
+	}
+
+	//Flush partial word at the end
+	while(w.m_bits > 0)
+	{
+		if(w.m_ptr >= w.m_end)
+			return 0;
+		*w.m_ptr++ = w.m_acc & 0xff;
+		w.m_acc >>= 8;
+		w.m_bits -= 8;
+	}
+
+	return w.m_ptr - out;
+}
+
+/**
+	@brief Reference decoder, returns sign-extended N-bit codes
+
+	Not used by the server itself; this is the decoding clients must implement for compressed waveforms.
+
+	@return False if the stream is truncated
+ */
+bool DecompressSamples(const uint8_t* in, int16_t* out, size_t len, size_t count, int nbits)
+{
+	size_t bitpos = 0;
+	size_t bitlen = len * 8;
+	int escbits = nbits + 1;
+
+	//Read one bit at a time for clarity, not speed
+	#define READ_BIT(dst) \
+	{ \
+		if(bitpos >= bitlen) \
+			return false; \
+		dst = (in[bitpos / 8] >> (bitpos % 8)) & 1; \
+		bitpos ++; \
+	}
+
+	int32_t prev = 0;
+	for(size_t base = 0; base < count; base += RICE_PARTITION_SIZE)
+	{
+		size_t plen = count - base;
+		if(plen > RICE_PARTITION_SIZE)
+			plen = RICE_PARTITION_SIZE;
+
+		int k = 0;
+		for(int i=0; i<4; i++)
+		{
+			uint32_t b;
+			READ_BIT(b);
+			k |= b << i;
+		}
+
+		for(size_t i=0; i<plen; i++)
+		{
+			//Unary prefix
+			uint32_t q = 0;
+			while(q < RICE_ESCAPE)
+			{
+				uint32_t b;
+				READ_BIT(b);
+				if(!b)
+					break;
+				q ++;
+			}
+
+			uint32_t u = 0;
+			int rawbits = k;
+			if(q == RICE_ESCAPE)
+				rawbits = escbits;
+			for(int j=0; j<rawbits; j++)
+			{
+				uint32_t b;
+				READ_BIT(b);
+				u |= b << j;
+			}
+			if(q != RICE_ESCAPE)
+				u |= q << k;
+
+			//Undo zigzag and prediction
+			int32_t delta = static_cast<int32_t>(u >> 1) ^ -static_cast<int32_t>(u & 1);
+			prev += delta;
+			out[base + i] = prev;
+		}
+	}
+
+	#undef READ_BIT
+
+	return true;
+}
@@ -34,199 +34,2290 @@
  */
 #include "wfmserver.h"
 #include <string.h>
+#include <condition_variable>
 #include "DigilentSCPIServer.h"
+#include "CaptureBufferSet.h"
+#include "CaptureQueue.h"
+#include "DataPlaneSubscriber.h"
+#include "CaptureRecorder.h"
+#include "CaptureReplay.h"
+#include "ScopeDevice.h"
+#include "AcquisitionConfig.h"
+#include "SamplePacking.h"
+#include "WaveformCodec.h"
+#include "Decimation.h"
+#include "WaveformAverager.h"
+#include "PersistenceHistogram.h"
+#include "SpectrumAnalyzer.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
 
 using namespace std;
 
 volatile bool g_waveformThreadQuit = false;
-float InterpolateTriggerTime(double* buf);
 
+//Fraction of time the hardware spent disarmed between captures, over the last stats interval
+double g_deadTimeRatio = 0;
+
+//Average number of device status polls it took to see each capture complete, over the last stats interval
+double g_pollsPerCapture = 0;
+
+//Status polls made so far this session, and how long we expect to wait for a trigger once the buffer could have
+//filled (in seconds), which is how long we sleep past the earliest possible end of a capture before polling.
+//Only used by the acquisition thread, with g_mutex held.
+size_t g_statusPolls = 0;
+double g_triggerWaitEstimate = 0;
+
+//Number of captures that may be waiting for the sender
+size_t g_queueDepth = 2;
+
+//Frames discarded by the overflow policy this session
+atomic<size_t> g_framesDropped(0);
+
+//Captures in the average currently being accumulated
+atomic<size_t> g_averageProgress(0);
+
+//Set by the control plane to throw away the persistence histograms accumulated so far
+atomic<bool> g_persistClear(false);
+
+//Set by the control plane to restart spectral averaging and peak hold
+atomic<bool> g_spectrumClear(false);
+
+//Samples the device reported lost or corrupt while streaming this session
+atomic<size_t> g_samplesLost(0);
+atomic<size_t> g_samplesCorrupt(0);
+
+/**
+	@brief Largest tile the client can fetch in one request, in buckets
+ */
+#define MAX_TILE_BUCKETS (1024 * 1024)
+
+/**
+	@brief A client request for part of one level of the most recent capture's pyramid
+
+	Sent on the data plane socket as four little-endian uint64s. Start and count are in buckets of that level.
+ */
+struct TileRequest
+{
+	uint64_t m_channel;
+	uint64_t m_level;
+	uint64_t m_start;
+	uint64_t m_count;
+};
+
+/**
+	@brief A tile request waiting for the sender, and who to send the tile to
+ */
+struct PendingTile
+{
+	std::shared_ptr<DataPlaneSubscriber> m_subscriber;
+	TileRequest m_request;
+};
+
+/**
+	@brief Shortest interval between device status polls while waiting for a capture, in microseconds
+ */
+#define MIN_POLL_INTERVAL 50
+
+/**
+	@brief Longest interval between device status polls while waiting for a trigger, in microseconds
+ */
+#define MAX_POLL_INTERVAL 10000
+
+/**
+	@brief Longest interval between polls while streaming, in microseconds
+
+	Only bounds how stale a chunk can get at very low sample rates. Stopping doesn't wait for it, the sleep between
+	polls is woken by g_armCond.
+ */
+#define MAX_STREAM_POLL_INTERVAL 1000000
+
+/**
+	@brief Most data plane connections served at once (the session's own client plus extra subscribers)
+ */
+#define MAX_DATA_SUBSCRIBERS 8
+
+/**
+	@brief Buffer sets added for each subscriber, so captures it's still sending don't starve the acquisition loop
+ */
+#define SETS_PER_SUBSCRIBER (SUBSCRIBER_QUEUE_DEPTH + 1)
+
+/**
+	@brief Buffer sets added while recording, so captures still being copied to disk don't starve the acquisition loop
+ */
+#define SETS_PER_RECORDER (RECORDER_QUEUE_DEPTH + 1)
+
+/**
+	@brief A data plane connection and the thread reading its tile requests
+ */
+struct Subscription
+{
+	std::shared_ptr<DataPlaneSubscriber> m_subscriber;
+	std::thread m_requests;
+	std::atomic<bool> m_requestsDone;
+};
+
+//Handoff of buffer sets between the acquisition and sender threads.
+//The queues themselves are lock-free, the mutex is only for sleeping on the condition variable (and for the tile
+//request list, which also wakes the sender). Sets go back on the free queue from whichever thread drops the last
+//reference to them, so pushes there are made with the mutex held to keep them from racing.
+CaptureQueue* g_readyQueue = NULL;
+CaptureQueue* g_freeQueue = NULL;
+vector< unique_ptr<CaptureBufferSet> > g_bufferSets;
+atomic<size_t> g_setsOutstanding(0);
+mutex g_bufferSetMutex;
+condition_variable g_bufferSetCond;
+atomic<bool> g_senderQuit(false);
+atomic<bool> g_senderFailed(false);
+vector<PendingTile> g_tileRequests;
+
+//Everyone receiving this session's frames. The first is the client that connected along with the control plane
+//session: the overflow policy applies only to it, and the session ends if it goes away. Everyone else drops frames
+//rather than hold anything up.
+mutex g_subscriberMutex;
+vector< unique_ptr<Subscription> > g_subscribers;
+size_t g_subscriberSets = 0;
+
+//The current (or most recent) recording, started and stopped from the control plane
+mutex g_recorderMutex;
+shared_ptr<CaptureRecorder> g_recorder;
+
+void WaveformSenderThread(SampleBufferPool* pool);
+void WaveformRequestThread(Subscription* sub);
+void WaveformAcceptThread(SampleBufferPool* pool);
+bool AcceptDataClient(ZSOCKET& sock, bool& local);
+void AddSubscriber(ZSOCKET sock, bool local, const string& name, SampleBufferPool* pool);
+void RemoveSubscriber(Subscription* sub);
+void RemoveDisconnectedSubscribers();
+shared_ptr<DataPlaneSubscriber> GetPrimarySubscriber();
+bool Publish(
+	shared_ptr<const DataPlaneFrame> frame,
+	OverflowPolicy policy,
+	vector< shared_ptr<DataPlaneSubscriber> >& subs,
+	CaptureRecorder* recorder);
+bool SendTile(DataPlaneSubscriber* sub, CaptureBufferSet* set, const TileRequest& req, vector<float>& buf);
+void WakeBufferSetWaiters();
+void AddBufferSets(SampleBufferPool* pool, size_t count);
+void ReleaseBufferSet(CaptureBufferSet* set);
+CaptureBufferSet* GetFreeBufferSet(vector<CaptureBufferSet*>& spares, OverflowPolicy policy);
+void QueueCapture(CaptureBufferSet* set, vector<CaptureBufferSet*>& spares, OverflowPolicy policy);
+bool WaitForSenderIdle();
+bool StreamChunk(
+	shared_ptr<const AcquisitionConfig>& config,
+	vector<CaptureBufferSet*>& spares,
+	size_t& generation,
+	uint64_t& sequence,
+	uint64_t& nextSample);
+bool WaitForCapture(const AcquisitionConfig& config);
+bool CaptureSegments(CaptureBufferSet* set, size_t armCount);
+bool DownloadCapture(CaptureBufferSet* set, const shared_ptr<const AcquisitionConfig>& config, size_t generation);
+void SnapshotConfiguration(CaptureBufferSet* set, const shared_ptr<const AcquisitionConfig>& config);
+void DownloadSegment(CaptureBufferSet* set, size_t segment);
+void DownloadSamples(CaptureBufferSet* set, size_t first);
+float InterpolateTriggerPhase(CaptureBufferSet* set, size_t first);
+void GetTriggerTime(uint64_t& ticks, uint64_t& ticksPerSecond);
+void EncodeCapture(CaptureBufferSet* set);
+void BuildFrame(CaptureBufferSet* set);
+void DecimateCapture(CaptureBufferSet* set);
+void BuildPreviewFrame(CaptureBufferSet* set);
+void AddTimingHeader(DataPlaneFrame& frame, CaptureBufferSet* set);
+void BuildPyramid(CaptureBufferSet* set);
+float GetRawScale(CaptureBufferSet* set, size_t channel);
+bool RearmAfterCapture();
+void ReplayRecording();
+string GetRecordingMetadata();
+
+template<class T>
+float InterpolateTriggerTime(const T* buf, size_t index, size_t count, float scale, float offset, float level);
+
+/**
+	@brief Number of bytes of sample data sent per channel
+ */
+size_t GetWaveformSize(SampleFormat format, size_t depth)
+{
+	switch(format)
+	{
+		case FORMAT_PACKED:
+			return GetPackedSize(depth, g_adcBits);
+
+		case FORMAT_INT16:
+			return depth * sizeof(int16_t);
+
+		case FORMAT_FLOAT32:
+			return depth * sizeof(float);
+
+		case FORMAT_FLOAT64:
+		default:
+			return depth * sizeof(double);
+	}
+}
+
+/**
+	@brief Acquisition side of the data plane: waits for captures, downloads them, and re-arms the trigger
+
+	Downloaded captures are handed off to WaveformSenderThread(). In pipelined mode the trigger is re-armed as soon
+	as the download finishes, so the next capture acquires while this one is still going out over the network.
+	Otherwise we wait for the send to complete before re-arming, same as a single-threaded server.
+
+	In streaming mode there's no re-arming at all, we just keep forwarding chunks of the record (see StreamChunk()).
+	In burst mode the trigger is re-armed straight after each segment is downloaded, and the whole burst is handed
+	off once the last segment is in (see CaptureSegments()).
+ */
 void WaveformServerThread()
 {
 	#ifdef __linux__
 	pthread_setname_np(pthread_self(), "WaveformThread");
 	#endif
 
-	Socket client = g_dataSocket.Accept();
-	LogVerbose("Client connected to data plane socket\n");
+	ZSOCKET client;
+	bool local;
+	while(!AcceptDataClient(client, local))
+	{
+		if(g_waveformThreadQuit)
+			return;
+	}
+	LogVerbose("Client connected to %s data plane socket\n", local ? "local" : "TCP");
 
-	if(!client.IsValid())
-		return;
-	if(!client.DisableNagle())
-		LogWarning("Failed to disable Nagle on socket, performance may be poor\n");
+	//Set up buffer sets: one being downloaded into, one being encoded, one holding the last capture for tile
+	//requests, and the rest waiting in between. Each subscriber gets a few more for the frames it's still sending,
+	//and so does the recorder if there is one.
+	//Buffers are allocated on first use, so sets that are never needed cost nothing.
+	SampleBufferPool pool;
+	size_t maxSets = g_queueDepth + 3 + MAX_DATA_SUBSCRIBERS * SETS_PER_SUBSCRIBER + SETS_PER_RECORDER;
+	CaptureQueue readyQueue(maxSets);
+	CaptureQueue freeQueue(maxSets);
+	g_readyQueue = &readyQueue;
+	g_freeQueue = &freeQueue;
+	g_setsOutstanding = 0;
+	g_senderQuit = false;
+	g_senderFailed = false;
+	{
+		lock_guard<mutex> lock(g_bufferSetMutex);
+		g_tileRequests.clear();
+	}
+	AddBufferSets(&pool, g_queueDepth + 3);
 
-	map<size_t, double*> waveformBuffers;
-	uint16_t numchans = 0;
+	//The session's own client, then anyone else who connects while it's running
+	g_subscriberSets = 0;
+	AddSubscriber(client, local, "Data client", &pool);
+	thread sender(WaveformSenderThread, &pool);
+	thread acceptor(WaveformAcceptThread, &pool);
 
-	while(!g_waveformThreadQuit)
+	//Sets reclaimed from the ready queue by the overflow policy
+	vector<CaptureBufferSet*> spares;
+
+	//Bumped whenever the control plane asks for new buffers
+	size_t generation = 0;
+
+	//Every capture (or streaming chunk) gets the next sequence number, even if it's later dropped or averaged
+	uint64_t sequence = 0;
+
+	//Streaming state
+	uint64_t nextSample = 0;
+
+	//Configuration we're capturing with, checked for updates before every capture
+	shared_ptr<const AcquisitionConfig> config;
+
+	//Dead time and polling statistics
+	auto statsStart = chrono::steady_clock::now();
+	auto lastArm = statsStart;
+	bool haveLastArm = false;
+	double deadTime = 0;
+	double liveTime = 0;
+	size_t statsCaptures = 0;
+	size_t statsPolls = 0;
+	{
+		lock_guard<mutex> lock(g_mutex);
+		g_statusPolls = 0;
+		g_triggerWaitEstimate = 0;
+	}
+
+	//Replaying a recording? That stands in for the whole acquisition loop
+	if(g_replay)
+		ReplayRecording();
+
+	while(!g_waveformThreadQuit && !g_replay)
 	{
+		//Sleep until armed. The timeout is only so we notice being told to quit.
 		if(!g_triggerArmed)
 		{
-			std::this_thread::sleep_for(std::chrono::microseconds(1000));
+			haveLastArm = false;
+			unique_lock<mutex> lock(g_mutex);
+			g_armCond.wait_for(lock, chrono::milliseconds(100), []{ return g_triggerArmed || g_waveformThreadQuit; });
 			continue;
 		}
 
-		//Poll until we have a fully acquired waveform
-		while(true)
-		{
-			lock_guard<mutex> lock(g_mutex);
-
-			//Get status
-			DwfState state;
-			FDwfAnalogInStatus(g_hScope, true, &state);
+		UpdateConfig(config);
 
-			int samplesLeft;
-			FDwfAnalogInStatusSamplesLeft(g_hScope, &samplesLeft);
-
-			if(samplesLeft == 0)
+		//Streaming? Just forward whatever the device has recorded since last time
+		if(config->m_acquisitionMode == ACQUISITION_STREAM)
+		{
+			haveLastArm = false;
+			if(!StreamChunk(config, spares, generation, sequence, nextSample))
 				break;
-
-			std::this_thread::sleep_for(std::chrono::microseconds(1000));
+			continue;
 		}
 
-		int64_t interval;
-		uint64_t depth;
-		map<size_t, bool> channelOn;
+		//Wait until we have a fully acquired waveform
+		if(!WaitForCapture(*config))
+			continue;
+		auto readyTime = chrono::steady_clock::now();
+
+		//Find somewhere to put it
+		OverflowPolicy policy;
 		{
 			lock_guard<mutex> lock(g_mutex);
+			policy = g_overflowPolicy;
+		}
+		CaptureBufferSet* set = GetFreeBufferSet(spares, policy);
+		if(!set)
+			break;
 
-			interval = g_sampleIntervalDuringArm;
-			channelOn = g_channelOnDuringArm;
-			depth = g_captureMemDepth;
+		//Download the data from the scope, then re-arm right away if we're pipelining
+		bool pipeline;
+		bool rearmed = false;
+		bool burst;
+		size_t armCount;
+		{
+			lock_guard<mutex> lock(g_mutex);
 
-			//Set up buffers if needed
-			if(g_memDepthChanged || waveformBuffers.empty())
+			//Reconfigured since the capture completed? The device has been re-armed with the new settings, so
+			//what it had is gone.
+			if(UpdateConfig(config))
 			{
-				LogTrace("Reallocating buffers\n");
-
-				//Clear out old buffers
-				for(size_t i=0; i<g_numAnalogInChannels; i++)
-				{
-					if(waveformBuffers[i])
-					{
-						delete[] waveformBuffers[i];
-						waveformBuffers[i] = NULL;
-					}
-				}
-
-				//Set up new ones
-				//TODO: Only allocate memory if the channel is actually enabled
-				for(size_t i=0; i<g_numAnalogInChannels; i++)
-				{
-					//Allocate memory if needed
-					waveformBuffers[i] = new double[g_captureMemDepth];
-					memset(waveformBuffers[i], 0x00, g_captureMemDepth * sizeof(double));
-				}
+				spares.push_back(set);
+				haveLastArm = false;
+				continue;
+			}
 
+			if(g_memDepthChanged)
+			{
+				generation ++;
 				g_memDepthChanged = false;
-
 			}
 
-			//Download the data from the scope
-			for(size_t i=0; i<g_numAnalogInChannels; i++)
+			//Out of memory for these settings? Stop rather than fail every capture the same way
+			if(!DownloadCapture(set, config, generation))
 			{
-				//TODO: only if channel is enabled?
-
-				FDwfAnalogInStatusData(g_hScope, i, waveformBuffers[i], g_captureMemDepth);
+				DigilentSCPIServer::Stop();
+				spares.push_back(set);
+				haveLastArm = false;
+				continue;
 			}
+			set->m_sequence = sequence ++;
+			armCount = g_armCount;
 
-			//Figure out how many channels are active in this capture
-			numchans = 0;
-			for(size_t i=0; i<g_numAnalogInChannels; i++)
+			pipeline = g_pipelineEnabled;
+			burst = (set->m_segments > 1);
+			if(pipeline && !burst)
+				rearmed = RearmAfterCapture();
+		}
+
+		//Burst capture? Collect the rest of the segments before doing anything else
+		if(burst)
+		{
+			if(!CaptureSegments(set, armCount))
 			{
-				if(g_channelOnDuringArm[i])
-					numchans ++;
+				//Stopped or reconfigured partway through, the partial burst is useless
+				spares.push_back(set);
+				haveLastArm = false;
+				continue;
 			}
-			/*
-			for(size_t i=0; i<g_numDigitalPods; i++)
+			readyTime = chrono::steady_clock::now();
+
+			if(pipeline)
 			{
-				if(g_msoPodEnabledDuringArm[i])
-					numchans ++;
+				lock_guard<mutex> lock(g_mutex);
+				rearmed = RearmAfterCapture();
 			}
-			*/
 		}
+		auto armTime = chrono::steady_clock::now();
 
-		//Send the channel count and sample rate to the client
-		if(!client.SendLooped((uint8_t*)&numchans, sizeof(numchans)))
-			break;
-		if(!client.SendLooped((uint8_t*)&g_sampleIntervalDuringArm, sizeof(interval)))
-			break;
+		statsCaptures += set->m_segments;
 
-		//Interpolate trigger position if we're using an analog level trigger
-		//bool triggerIsAnalog = (g_triggerChannel < g_numChannels);
-		bool triggerIsAnalog = true;
-		float trigphase = 0;
-		if(triggerIsAnalog)
-		{
-			//Interpolate zero crossing to get sub-sample precision
-			trigphase = -InterpolateTriggerTime(waveformBuffers[g_triggerChannel]) * interval;
+		//Hand it off to the sender
+		QueueCapture(set, spares, policy);
 
-			//Cap interpolation error
-			if(trigphase > 10*interval)
-				trigphase = 10*interval;
-			if(trigphase < -10*interval)
-				trigphase = -10*interval;
+		//Not pipelining? Wait for the whole thing to go out before re-arming
+		if(!pipeline)
+		{
+			if(!WaitForSenderIdle())
+				break;
 
-			//Correct for set point error
-			trigphase += (interval  + g_triggerDeltaSec*FS_PER_SECOND);
+			lock_guard<mutex> lock(g_mutex);
+			rearmed = RearmAfterCapture();
+			armTime = chrono::steady_clock::now();
 		}
 
-		//Send data for each channel to the client
-		for(size_t i=0; i<g_numAnalogInChannels; i++)
+		//Dead time is from the end of one capture to re-arming for the next
+		if(haveLastArm)
+			liveTime += chrono::duration<double>(readyTime - lastArm).count();
+		if(rearmed)
+			deadTime += chrono::duration<double>(armTime - readyTime).count();
+		lastArm = armTime;
+		haveLastArm = rearmed;
+
+		double dt = chrono::duration<double>(armTime - statsStart).count();
+		if( (dt >= STATS_INTERVAL) && (deadTime + liveTime > 0) )
 		{
-			//Analog channels
-			if((i < g_numAnalogInChannels) && (channelOn[i]) )
-			{
-				//Send channel ID, memory depth, and trigger phase
-				uint64_t header[2] = {i, depth};
-				if(!client.SendLooped((uint8_t*)&header, sizeof(header)))
-					break;
-				if(!client.SendLooped((uint8_t*)&trigphase, sizeof(trigphase)))
-					break;
+			double ratio = deadTime / (deadTime + liveTime);
 
-				//Send the actual waveform data
-				if(!client.SendLooped((uint8_t*)waveformBuffers[i], depth * sizeof(double)))
-					break;
+			double polls;
+			{
+				lock_guard<mutex> lock(g_mutex);
+				polls = static_cast<double>(g_statusPolls - statsPolls) / max<size_t>(statsCaptures, 1);
+				statsPolls = g_statusPolls;
+				g_deadTimeRatio = ratio;
+				g_pollsPerCapture = polls;
 			}
 
-			/*
-			//Digital channels
-			else if( (i >= g_numChannels) && (g_msoPodEnabledDuringArm[i - g_numChannels]) )
+			LogVerbose("Dead time %.2f%% (%s), %.1f polls per capture, %zu frames dropped so far\n",
+				ratio * 100, pipeline ? "pipelined" : "not pipelined", polls, g_framesDropped.load());
+
+			statsStart = armTime;
+			deadTime = 0;
+			liveTime = 0;
+			statsCaptures = 0;
+		}
+	}
+
+	//Shut down the sender, and stop taking new subscribers
+	g_senderQuit = true;
+	WakeBufferSetWaiters();
+	sender.join();
+	acceptor.join();
+
+	//Finish the recording (if any) before its frames' buffer sets go away
+	StopRecording();
+
+	//Disconnect everyone. Once their writers are gone, every buffer set is back on the free queue.
+	vector< unique_ptr<Subscription> > subscribers;
+	{
+		lock_guard<mutex> lock(g_subscriberMutex);
+		subscribers.swap(g_subscribers);
+	}
+	for(auto& sub : subscribers)
+		RemoveSubscriber(sub.get());
+	subscribers.clear();
+	{
+		lock_guard<mutex> lock(g_bufferSetMutex);
+		g_tileRequests.clear();
+	}
+	g_readyQueue = NULL;
+	g_freeQueue = NULL;
+
+	//Buffer sets have to go before the pool does.
+	//This is safe even with zero-copy sends in flight, since the kernel holds its own references to the pages.
+	{
+		lock_guard<mutex> lock(g_bufferSetMutex);
+		g_bufferSets.clear();
+	}
+}
+
+/**
+	@brief Creates more buffer sets and puts them on the free queue
+ */
+void AddBufferSets(SampleBufferPool* pool, size_t count)
+{
+	{
+		lock_guard<mutex> lock(g_bufferSetMutex);
+		for(size_t i=0; i<count; i++)
+		{
+			g_bufferSets.push_back(unique_ptr<CaptureBufferSet>(new CaptureBufferSet(pool)));
+			g_freeQueue->Push(g_bufferSets.back().get());
+		}
+	}
+	g_bufferSetCond.notify_all();
+}
+
+/**
+	@brief Puts a buffer set back on the free queue once nobody is using it any more
+
+	Called when the last reference to a capture's frames goes away, which may be on any subscriber's writer thread.
+ */
+void ReleaseBufferSet(CaptureBufferSet* set)
+{
+	{
+		lock_guard<mutex> lock(g_bufferSetMutex);
+		g_freeQueue->Push(set);
+	}
+	g_bufferSetCond.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Recording
+
+/**
+	@brief Starts recording every frame sent to a new file in the recording directory, replacing any current recording
+
+	@param name	File name, which must not point outside the recording directory
+
+	@return False if recording is disabled, or the file couldn't be created
+ */
+bool StartRecording(const string& name)
+{
+	if(g_recordDir.empty())
+	{
+		LogWarning("Recording is disabled, use --record-dir to enable it\n");
+		return false;
+	}
+	if(name.empty() || (name[0] == '.') || (name.find_first_of("/\\") != string::npos) )
+	{
+		LogWarning("Invalid recording name %s\n", name.c_str());
+		return false;
+	}
+
+	StopRecording();
+
+	auto recorder = make_shared<CaptureRecorder>(g_recordDir + "/" + name, GetRecordingMetadata(), g_recordDirect);
+	if(!recorder->IsRecording())
+		return false;
+	LogVerbose("Recording to %s\n", name.c_str());
+
+	lock_guard<mutex> lock(g_recorderMutex);
+	g_recorder = recorder;
+	return true;
+}
+
+/**
+	@brief Describes the device, so a recording can stand in for it later (see CaptureReplay)
+
+	Also has the settings that change how clients parse frames, which can't change while recording.
+ */
+string GetRecordingMetadata()
+{
+	lock_guard<mutex> lock(g_mutex);
+	return
+		string("model=") + g_model + "\n" +
+		"serial=" + g_serial + "\n" +
+		"firmware=" + g_fwver + "\n" +
+		"channels=" + to_string(g_numAnalogInChannels) + "\n" +
+		"adcbits=" + to_string(g_adcBits) + "\n" +
+		"minrate=" + to_string(g_minSampleRate) + "\n" +
+		"maxrate=" + to_string(g_maxSampleRate) + "\n" +
+		"maxdepth=" + to_string(g_maxMemDepth) + "\n" +
+		"format=" + to_string(g_sampleFormat) + "\n" +
+		"codec=" + to_string(g_codec) + "\n" +
+		"headerversion=" + to_string(g_headerVersion) + "\n" +
+		"acqmode=" + to_string(g_acquisitionMode) + "\n" +
+		"preview=" + to_string(g_previewBuckets) + "\n" +
+		"previewmode=" + to_string(g_previewMode) + "\n" +
+		"pyramid=" + to_string(g_pyramidEnabled) + "\n" +
+		"average=" + to_string(g_averageCount) + "\n" +
+		"persistcols=" + to_string(g_persistColumns) + "\n" +
+		"spectrum=" + to_string(g_spectrumMode) + "\n";
+}
+
+/**
+	@brief Finishes the current recording, if there is one
+
+	The recorder stays around (closed) so its statistics can still be queried.
+ */
+void StopRecording()
+{
+	shared_ptr<CaptureRecorder> recorder = GetRecorder();
+	if(recorder)
+		recorder->Close();
+}
+
+/**
+	@brief Gets the current (or most recent) recording, or NULL if nothing has been recorded
+ */
+shared_ptr<CaptureRecorder> GetRecorder()
+{
+	lock_guard<mutex> lock(g_recorderMutex);
+	return g_recorder;
+}
+
+/**
+	@brief Stands in for the acquisition loop when replaying a recording
+
+	Recorded frames go out exactly as they were recorded, straight from the mapped file, for as long as the trigger
+	is armed, starting over at the end of the recording. A one-shot arm sends a single frame.
+
+	Frames are spaced out as they were when recorded, unless replaying as fast as possible. Either way, the session's
+	own client can hold things up (or miss frames) according to the overflow policy, same as with a real device.
+ */
+void ReplayRecording()
+{
+	size_t count = g_replay->GetFrameCount();
+	size_t next = 0;
+	vector< shared_ptr<DataPlaneSubscriber> > subscribers;
+
+	//Pacing: when the next frame should go out, and when the last one was recorded
+	bool paced = false;
+	auto nextSend = chrono::steady_clock::now();
+	int64_t lastTimestamp = 0;
+
+	//Throughput statistics
+	auto statsStart = chrono::steady_clock::now();
+	size_t statsFrames = 0;
+	size_t statsBytes = 0;
+
+	while(!g_waveformThreadQuit)
+	{
+		bool armed;
+		bool oneShot;
+		OverflowPolicy policy;
+		{
+			lock_guard<mutex> lock(g_mutex);
+			armed = g_triggerArmed;
+			oneShot = g_triggerOneShot;
+			policy = g_overflowPolicy;
+		}
+		if(!armed || (count == 0) )
+		{
+			paced = false;
+			unique_lock<mutex> lock(g_mutex);
+			g_armCond.wait_for(lock, chrono::milliseconds(100),
+				[count]{ return (g_triggerArmed && count) || g_waveformThreadQuit; });
+			continue;
+		}
+
+		const uint8_t* data;
+		size_t len;
+		int64_t timestamp;
+		g_replay->GetFrame(next, data, len, timestamp);
+
+		//Keep the recorded spacing, but if the client held us up, carry on from now rather than trying to catch up
+		if(!g_replayFast)
+		{
+			auto now = chrono::steady_clock::now();
+			if(paced)
+				nextSend += chrono::nanoseconds(max<int64_t>(timestamp - lastTimestamp, 0));
+			if(!paced || (nextSend < now) )
+				nextSend = now;
+
+			//Gaps in the recording may be long, so wake up if we're stopped
+			if(now < nextSend)
 			{
-				client.SendLooped((uint8_t*)&i, sizeof(i));
-				client.SendLooped((uint8_t*)&numSamples, sizeof(numSamples));
-				client.SendLooped((uint8_t*)&trigphase, sizeof(trigphase));
-				client.SendLooped((uint8_t*)waveformBuffers[i], numSamples * sizeof(int16_t));
+				unique_lock<mutex> lock(g_mutex);
+				if(g_armCond.wait_until(lock, nextSend, []{ return !g_triggerArmed || g_waveformThreadQuit; }))
+					continue;
 			}
-			*/
+		}
+		paced = true;
+		lastTimestamp = timestamp;
+
+		//Subscribers send it straight out of the mapping
+		auto frame = make_shared<DataPlaneFrame>();
+		frame->AddPayload(data, len);
+
+		shared_ptr<CaptureRecorder> recorder = GetRecorder();
+		if(recorder && !recorder->IsRecording())
+			recorder.reset();
+		if(!Publish(frame, policy, subscribers, recorder.get()))
+			break;
+		statsFrames ++;
+		statsBytes += len;
+
+		//Start over (including the pacing) at the end
+		next ++;
+		if(next == count)
+		{
+			next = 0;
+			paced = false;
 		}
 
+		if(oneShot)
 		{
 			lock_guard<mutex> lock(g_mutex);
+			g_triggerArmed = false;
+		}
 
-			//Re-arm the trigger if doing repeating triggers
-			if(g_triggerOneShot)
-				g_triggerArmed = false;
-			else
-				DigilentSCPIServer::Start();
+		//Report throughput every few seconds
+		auto now = chrono::steady_clock::now();
+		double dt = chrono::duration<double>(now - statsStart).count();
+		if(dt >= STATS_INTERVAL)
+		{
+			LogVerbose("Replay: %.2f frames/s, %.2f MB/s\n", statsFrames / dt, statsBytes / (dt * 1e6));
+			statsStart = now;
+			statsFrames = 0;
+			statsBytes = 0;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Subscribers
+
+/**
+	@brief Accepts extra subscribers on the data plane socket until the session ends
+ */
+void WaveformAcceptThread(SampleBufferPool* pool)
+{
+	#ifdef __linux__
+	pthread_setname_np(pthread_self(), "WaveformAccept");
+	#endif
+
+	size_t count = 0;
+	while(!g_senderQuit)
+	{
+		RemoveDisconnectedSubscribers();
+
+		ZSOCKET client;
+		bool local;
+		if(!AcceptDataClient(client, local))
+			continue;
+
+		size_t active;
+		{
+			lock_guard<mutex> lock(g_subscriberMutex);
+			active = g_subscribers.size();
+		}
+		if(g_senderQuit || (active >= MAX_DATA_SUBSCRIBERS) )
+		{
+			if(!g_senderQuit)
+				LogWarning("Too many data plane subscribers, dropping new connection\n");
+			Socket dropped(client, local ? AF_UNIX : AF_INET6);
+			continue;
 		}
+
+		count ++;
+		LogVerbose("Subscriber %zu connected to %s data plane socket\n", count, local ? "local" : "TCP");
+		AddSubscriber(client, local, string("Subscriber ") + to_string(count), pool);
+	}
+}
+
+/**
+	@brief Waits briefly for a connection on the data plane socket, or the local socket if there is one
+
+	Returns every now and then even if nobody connects, so the caller can check if it should quit.
+
+	@param local	Set if the client is on the local socket, and wants frames through shared memory
+
+	@return False if nobody connected
+ */
+bool AcceptDataClient(ZSOCKET& sock, bool& local)
+{
+	pollfd pfd[2];
+	size_t count = 1;
+	pfd[0].fd = g_dataSocket;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	#ifndef _WIN32
+	if(g_localSocket >= 0)
+	{
+		pfd[1].fd = g_localSocket;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		count = 2;
+	}
+	#endif
+
+	#ifdef _WIN32
+	int ready = WSAPoll(pfd, count, 100);
+	#else
+	int ready = poll(pfd, count, 100);
+	#endif
+	if(ready <= 0)
+		return false;
+
+	if(pfd[0].revents & POLLIN)
+	{
+		Socket client = g_dataSocket.Accept();
+		if(!client.IsValid())
+			return false;
+		sock = client.Detach();
+		local = false;
+		return true;
+	}
+
+	#ifndef _WIN32
+	if( (count > 1) && (pfd[1].revents & POLLIN) )
+	{
+		sock = accept(g_localSocket, NULL, NULL);
+		local = true;
+		return (sock >= 0);
 	}
+	#endif
+
+	return false;
+}
 
-	//Clean up temporary buffers
-	for(auto it : waveformBuffers)
-		delete[] it.second;
+/**
+	@brief Starts sending frames to a new connection, and reading its tile requests
+
+	@param local	True if the client is on the local socket, and gets its own shared memory ring
+ */
+void AddSubscriber(ZSOCKET sock, bool local, const string& name, SampleBufferPool* pool)
+{
+	unique_ptr<Subscription> sub(new Subscription);
+	sub->m_subscriber = make_shared<DataPlaneSubscriber>(sock, name, local ? g_shmRingSize : 0);
+	sub->m_requestsDone = false;
+	sub->m_requests = thread(WaveformRequestThread, sub.get());
+
+	size_t active;
+	{
+		lock_guard<mutex> lock(g_subscriberMutex);
+		g_subscribers.push_back(move(sub));
+		active = g_subscribers.size();
+	}
+
+	//Only add sets when there are more subscribers than ever before, so churn doesn't keep adding more
+	if(active > g_subscriberSets)
+	{
+		AddBufferSets(pool, (active - g_subscriberSets) * SETS_PER_SUBSCRIBER);
+		g_subscriberSets = active;
+	}
+}
+
+/**
+	@brief Stops sending to a subscriber and waits for its request reader to finish
+
+	Must not be in g_subscribers any more. The connection is closed once the last reference to the subscriber (which
+	may be a pending tile request) goes away.
+ */
+void RemoveSubscriber(Subscription* sub)
+{
+	//Shut the connection down first, so a writer blocked sending to (or waiting for zero-copy completions from) a
+	//stalled client fails instead of holding up the join forever. This also unblocks the request reader.
+	ZSOCKET sock = sub->m_subscriber->GetSocket();
+	#ifdef _WIN32
+	shutdown(sock, SD_BOTH);
+	#else
+	shutdown(sock, SHUT_RDWR);
+	#endif
+
+	sub->m_subscriber->Stop();
+	sub->m_requests.join();
+}
+
+/**
+	@brief Gets rid of extra subscribers that have gone away (the session's own client stays until the session ends)
+ */
+void RemoveDisconnectedSubscribers()
+{
+	vector< unique_ptr<Subscription> > gone;
+	{
+		lock_guard<mutex> lock(g_subscriberMutex);
+		for(size_t i=1; i<g_subscribers.size(); )
+		{
+			auto& sub = g_subscribers[i];
+			if(sub->m_subscriber->IsFailed() || sub->m_requestsDone)
+			{
+				gone.push_back(move(sub));
+				g_subscribers.erase(g_subscribers.begin() + i);
+			}
+			else
+				i ++;
+		}
+	}
+
+	for(auto& sub : gone)
+	{
+		LogVerbose("%s removed, %zu frames dropped\n", sub->m_subscriber->GetName().c_str(),
+			sub->m_subscriber->GetFramesDropped());
+		RemoveSubscriber(sub.get());
+	}
+}
+
+/**
+	@brief Gets the session's own data plane client
+ */
+shared_ptr<DataPlaneSubscriber> GetPrimarySubscriber()
+{
+	lock_guard<mutex> lock(g_subscriberMutex);
+	if(g_subscribers.empty())
+		return NULL;
+	return g_subscribers[0]->m_subscriber;
+}
+
+/**
+	@brief Posts a frame to every subscriber, and the recorder
+
+	The recorder and extra subscribers get it first, so they aren't held up if the session's own client is lossless
+	and falling behind.
+
+	@param policy	Overflow policy for the session's own client
+	@param subs		Scratch space for the list of subscribers
+	@param recorder	The recorder, or NULL if not recording
+
+	@return False if the session's own client has gone away
+ */
+bool Publish(
+	shared_ptr<const DataPlaneFrame> frame,
+	OverflowPolicy policy,
+	vector< shared_ptr<DataPlaneSubscriber> >& subs,
+	CaptureRecorder* recorder)
+{
+	if(recorder)
+		recorder->Post(frame);
+
+	subs.clear();
+	{
+		lock_guard<mutex> lock(g_subscriberMutex);
+		for(auto& sub : g_subscribers)
+			subs.push_back(sub->m_subscriber);
+	}
+	if(subs.empty())
+		return false;
+
+	for(size_t i=1; i<subs.size(); i++)
+		subs[i]->Post(frame, OVERFLOW_DROP_OLDEST);
+	bool ok = subs[0]->Post(frame, policy);
+
+	subs.clear();
+	return ok;
+}
+
+/**
+	@brief Sender side of the data plane: encodes downloaded captures and hands them to the subscribers
+
+	When averaging, captures are folded into the average here and only the finished average goes on to be encoded
+	and sent. In persistence mode, captures (or averages) are folded into the histograms, and only those are sent,
+	no more often than the client asked for. In spectrum mode, only the (averaged) spectra are sent.
+
+	Frames of a capture point straight into its buffers, and share its reference count: the set only goes back on the
+	free queue once every subscriber is done with them. Persistence and spectrum frames are built from state that
+	keeps changing, so each subscriber gets a copy.
+ */
+void WaveformSenderThread(SampleBufferPool* pool)
+{
+	#ifdef __linux__
+	pthread_setname_np(pthread_self(), "WaveformSender");
+	#endif
+
+	//Throughput statistics
+	auto statsStart = chrono::steady_clock::now();
+	size_t statsWaveforms = 0;
+	size_t statsBytes = 0;
+	size_t statsUncompressedBytes = 0;
+	size_t statsCompressedBytes = 0;
+	double statsEncodeTime = 0;
+	double statsPyramidTime = 0;
+
+	//Most recent capture with a pyramid, kept back from the free queue so tile requests can be served from it
+	shared_ptr<CaptureBufferSet> lastSet;
+	vector<float> tileBuffer;
+
+	vector< shared_ptr<DataPlaneSubscriber> > subscribers;
+
+	WaveformAverager averager(pool);
+
+	PersistenceHistogram persistence;
+	auto nextPersistSend = chrono::steady_clock::now();
+
+	SpectrumAnalyzer spectrum;
+
+	bool recorderSets = false;
+
+	while(true)
+	{
+		//Wait for a capture to send, or tile requests
+		CaptureBufferSet* set = NULL;
+		vector<PendingTile> tiles;
+		{
+			unique_lock<mutex> lock(g_bufferSetMutex);
+			while(!g_senderQuit)
+			{
+				if(!g_tileRequests.empty())
+				{
+					tiles.swap(g_tileRequests);
+					break;
+				}
+
+				set = g_readyQueue->Pop();
+				if(set)
+					break;
+				g_bufferSetCond.wait(lock);
+			}
+		}
+
+		//Tiles jump the queue, they're small and someone is waiting on them interactively
+		//A subscriber that went away before its tile was sent just doesn't get it
+		if(!tiles.empty())
+		{
+			for(auto& t : tiles)
+				SendTile(t.m_subscriber.get(), lastSet.get(), t.m_request, tileBuffer);
+			continue;
+		}
+
+		if(!set)
+			break;
+
+		//The set goes back on the free queue when we and every subscriber are done with it
+		shared_ptr<CaptureBufferSet> ref(set, ReleaseBufferSet);
+		OverflowPolicy policy;
+		{
+			lock_guard<mutex> lock(g_mutex);
+			policy = g_overflowPolicy;
+		}
+
+		//Every frame this capture produces also goes to disk, if we're recording
+		shared_ptr<CaptureRecorder> recorder = GetRecorder();
+		if(recorder && !recorder->IsRecording())
+			recorder.reset();
+		if(recorder && !recorderSets)
+		{
+			AddBufferSets(pool, SETS_PER_RECORDER);
+			recorderSets = true;
+		}
+
+		//Fold into the average, and don't send anything until it's complete.
+		//Streaming chunks and bursts are sent as is, they have no single trigger to align on.
+		set->m_averaged = 1;
+		if( (set->m_averages > 1) && !set->m_stream && (set->m_segments == 1) )
+		{
+			bool done = averager.Accumulate(set);
+			g_averageProgress = averager.GetCount();
+			if(!done)
+			{
+				ref.reset();
+				g_setsOutstanding --;
+				WakeBufferSetWaiters();
+				continue;
+			}
+		}
+		else
+			averager.Reset();
+
+		//Persistence: accumulate every capture at full rate, but only send the histograms at the display rate
+		bool ok = true;
+		if(set->m_persistColumns)
+		{
+			if(g_persistClear.exchange(false))
+				persistence.Clear();
+
+			auto accumulateStart = chrono::steady_clock::now();
+			persistence.Accumulate(set);
+			auto now = chrono::steady_clock::now();
+			statsEncodeTime += chrono::duration<double>(now - accumulateStart).count();
+
+			if(now >= nextPersistSend)
+			{
+				auto frame = make_shared<DataPlaneFrame>(persistence.BuildFrame());
+				frame->MakeSelfContained();
+				ok = Publish(frame, policy, subscribers, recorder.get());
+				statsBytes += frame->GetSize();
+
+				nextPersistSend = now + chrono::duration_cast<chrono::steady_clock::duration>(
+					chrono::duration<double>(1.0 / set->m_persistRate));
+			}
+		}
+
+		//Spectra: transform every capture, and send each average once it's complete
+		if(set->m_spectrum != SPECTRUM_OFF)
+		{
+			if(g_spectrumClear.exchange(false))
+				spectrum.Clear();
+
+			auto fftStart = chrono::steady_clock::now();
+			bool ready = spectrum.Accumulate(set);
+			statsEncodeTime += chrono::duration<double>(chrono::steady_clock::now() - fftStart).count();
+
+			if(ready)
+			{
+				auto frame = make_shared<DataPlaneFrame>(spectrum.BuildFrame());
+				frame->MakeSelfContained();
+				ok = Publish(frame, policy, subscribers, recorder.get());
+				statsBytes += frame->GetSize();
+			}
+		}
+
+		//The envelope preview goes out first, so viewers can redraw before the full record arrives
+		if(set->m_previewBuckets)
+		{
+			auto decimateStart = chrono::steady_clock::now();
+			DecimateCapture(set);
+			statsEncodeTime += chrono::duration<double>(chrono::steady_clock::now() - decimateStart).count();
+
+			set->m_sendTime = GetHostTimestamp();
+			BuildPreviewFrame(set);
+			ok = Publish(
+				shared_ptr<const DataPlaneFrame>(ref, &set->m_previewFrame), policy, subscribers, recorder.get());
+			statsBytes += set->m_previewFrame.GetSize();
+		}
+
+		//Pyramid for tile requests
+		if(set->m_pyramid)
+		{
+			auto pyramidStart = chrono::steady_clock::now();
+			BuildPyramid(set);
+			statsPyramidTime += chrono::duration<double>(chrono::steady_clock::now() - pyramidStart).count();
+		}
+
+		size_t samples = set->GetSampleCount();
+		size_t wfmsize = GetWaveformSize(set->m_format, samples);
+		bool sendFull = !set->m_persistColumns && (set->m_spectrum == SPECTRUM_OFF) &&
+			( (set->m_previewBuckets == 0) || (set->m_previewMode == PREVIEW_AHEAD) );
+		if(ok && sendFull)
+		{
+			//Convert, pack, or compress as needed
+			auto encodeStart = chrono::steady_clock::now();
+			EncodeCapture(set);
+			statsEncodeTime += chrono::duration<double>(chrono::steady_clock::now() - encodeStart).count();
+
+			//Each subscriber sends the whole thing in one go
+			set->m_sendTime = GetHostTimestamp();
+			BuildFrame(set);
+			ok = Publish(
+				shared_ptr<const DataPlaneFrame>(ref, &set->m_frame), policy, subscribers, recorder.get());
+			statsBytes += set->m_frame.GetSize();
+		}
+
+		//Update statistics
+		statsWaveforms ++;
+		if( (set->m_codec != CODEC_NONE) && sendFull)
+		{
+			for(size_t i=0; i<g_numAnalogInChannels; i++)
+			{
+				if(!set->m_channelOn[i])
+					continue;
+				statsUncompressedBytes += wfmsize;
+				statsCompressedBytes += set->m_compressedLen[i] ? set->m_compressedLen[i] : wfmsize;
+			}
+		}
+
+		//Done with the buffers, except for the newest pyramid (which replaces whatever we were holding on to)
+		lastSet.reset();
+		if(set->m_pyramid)
+			lastSet = ref;
+		ref.reset();
+		g_setsOutstanding --;
+		if(!ok)
+			g_senderFailed = true;
+		WakeBufferSetWaiters();
+
+		if(!ok)
+			break;
+
+		//Report throughput every few seconds
+		auto now = chrono::steady_clock::now();
+		double dt = chrono::duration<double>(now - statsStart).count();
+		if(dt >= STATS_INTERVAL)
+		{
+			LogVerbose("%.2f WFM/s, %zu bytes/WFM, %.2f MB/s (%.2f bits/sample) to each subscriber\n",
+				statsWaveforms / dt,
+				statsBytes / statsWaveforms,
+				statsBytes / (dt * 1e6),
+				wfmsize * 8.0 / samples);
+			LogVerbose("Encoding %.2f ms/WFM\n", statsEncodeTime * 1e3 / statsWaveforms);
+			if(statsPyramidTime > 0)
+				LogVerbose("Pyramid build %.2f ms/WFM\n", statsPyramidTime * 1e3 / statsWaveforms);
+			if(statsCompressedBytes)
+				LogVerbose("Compression ratio %.2f\n", statsUncompressedBytes * 1.0 / statsCompressedBytes);
+
+			statsStart = now;
+			statsWaveforms = 0;
+			statsBytes = 0;
+			statsUncompressedBytes = 0;
+			statsCompressedBytes = 0;
+			statsEncodeTime = 0;
+			statsPyramidTime = 0;
+		}
+	}
+}
+
+/**
+	@brief Reads tile requests from a subscriber on the data plane socket and passes them to the sender
+ */
+void WaveformRequestThread(Subscription* sub)
+{
+	#ifdef __linux__
+	pthread_setname_np(pthread_self(), "WaveformRequest");
+	#endif
+
+	Socket& client = sub->m_subscriber->GetSocket();
+	while(true)
+	{
+		PendingTile tile;
+		tile.m_subscriber = sub->m_subscriber;
+		if(!client.RecvLooped(reinterpret_cast<unsigned char*>(&tile.m_request), sizeof(tile.m_request)))
+			break;
+
+		{
+			lock_guard<mutex> lock(g_bufferSetMutex);
+			g_tileRequests.push_back(tile);
+		}
+		g_bufferSetCond.notify_all();
+	}
+
+	sub->m_requestsDone = true;
+}
+
+/**
+	@brief Sends one tile of the most recent capture's pyramid to the subscriber that asked for it
+
+	Same global header as a full frame (with one channel) and the frame type, then uint64 {channel, level, start,
+	count}, float trigphase, and the tile: count float volts at level 0, or count float {min, max} volts above that.
+	Bucket i of level L covers samples [i*2^L, (i+1)*2^L). Requests that can't be satisfied get an empty tile.
+
+	Levels below PYRAMID_BASE_LEVEL aren't stored, those are decimated from the samples on demand.
+
+	The tile is copied into the frame, so it doesn't hold on to the capture.
+
+	@param set	Most recent capture with a pyramid, or NULL if there isn't one
+	@param buf	Scratch space for on-demand tiles
+
+	@return False if the subscriber has gone away
+ */
+bool SendTile(DataPlaneSubscriber* sub, CaptureBufferSet* set, const TileRequest& req, vector<float>& buf)
+{
+	size_t channel = req.m_channel;
+	size_t level = req.m_level;
+	size_t count = 0;
+	const float* tile = NULL;
+	int64_t interval = 0;
+	float trigphase = 0;
+
+	if(set && set->m_pyramid && (channel < g_numAnalogInChannels) && set->m_channelOn[channel] &&
+		(level < set->m_pyramidBuckets.size()) )
+	{
+		interval = set->m_interval;
+		trigphase = set->m_trigphase;
+
+		size_t available = set->m_pyramidBuckets[level];
+		if(req.m_start < available)
+			count = min<uint64_t>(min<uint64_t>(req.m_count, available - req.m_start), MAX_TILE_BUCKETS);
+	}
+
+	if(count)
+	{
+		SampleFormat format = set->m_format;
+		bool raw = (format == FORMAT_INT16) || (format == FORMAT_PACKED);
+		float scale = raw ? GetRawScale(set, channel) : 1;
+		float offset = set->m_offsets[channel];
+		size_t first = req.m_start << level;
+		size_t len = min(count << level, set->GetSampleCount() - first);
+
+		if(level == 0)
+		{
+			buf.resize(count);
+			if(raw)
+			{
+				const int16_t* p = set->m_rawBuffers[channel] + first;
+				for(size_t i=0; i<count; i++)
+					buf[i] = p[i] * scale + offset;
+			}
+			else
+			{
+				const double* p = set->m_waveformBuffers[channel] + first;
+				for(size_t i=0; i<count; i++)
+					buf[i] = p[i];
+			}
+			tile = buf.data();
+		}
+
+		else if(level < PYRAMID_BASE_LEVEL)
+		{
+			buf.resize(count * 2);
+			if(raw)
+				MinMaxDecimatePow2(set->m_rawBuffers[channel] + first, len, buf.data(), level, scale, offset);
+			else
+				MinMaxDecimatePow2(set->m_waveformBuffers[channel] + first, len, buf.data(), level);
+			tile = buf.data();
+		}
+
+		else
+			tile = set->m_pyramidBuffers[channel] + set->m_pyramidOffsets[level] + req.m_start*2;
+	}
+
+	uint16_t numchans = 1;
+	uint64_t header[4] = {channel, level, req.m_start, count};
+	auto frame = make_shared<DataPlaneFrame>();
+	frame->AddHeader(numchans);
+	frame->AddHeader(interval);
+	frame->AddHeader(static_cast<uint64_t>(FRAME_TILE));
+	frame->AddHeader(header);
+	frame->AddHeader(trigphase);
+	if(count)
+		frame->AddHeaderBytes(reinterpret_cast<const uint8_t*>(tile), count * (level ? 2 : 1) * sizeof(float));
+
+	return sub->PostReply(frame);
+}
+
+/**
+	@brief Wakes up anything waiting on the buffer set queues
+ */
+void WakeBufferSetWaiters()
+{
+	//Taking the mutex means a waiter can't miss the wakeup between checking the queue and going to sleep
+	{
+		lock_guard<mutex> lock(g_bufferSetMutex);
+	}
+	g_bufferSetCond.notify_all();
+}
+
+/**
+	@brief Finds a buffer set for the next capture, applying the overflow policy if the sender is falling behind
+
+	Only called from the acquisition thread.
+
+	@param spares	Sets previously reclaimed by the overflow policy
+	@param policy	What to do if no set is free
+
+	@return The buffer set, or NULL if the sender failed or we're shutting down
+ */
+CaptureBufferSet* GetFreeBufferSet(vector<CaptureBufferSet*>& spares, OverflowPolicy policy)
+{
+	unique_lock<mutex> lock(g_bufferSetMutex);
+	while(!g_senderFailed && !g_waveformThreadQuit)
+	{
+		if(!spares.empty())
+		{
+			CaptureBufferSet* set = spares.back();
+			spares.pop_back();
+			return set;
+		}
+
+		CaptureBufferSet* set = g_freeQueue->Pop();
+		if(set)
+			return set;
+
+		//Nothing free, so the sender is behind. Unless we're lossless, take the oldest capture it hasn't started on.
+		if(policy != OVERFLOW_BLOCK)
+		{
+			set = g_readyQueue->Pop();
+			if(set)
+			{
+				g_framesDropped ++;
+				g_setsOutstanding --;
+				return set;
+			}
+		}
+
+		g_bufferSetCond.wait_for(lock, chrono::milliseconds(100));
+	}
+
+	return NULL;
+}
+
+/**
+	@brief Hands a downloaded capture off to the sender
+
+	Only called from the acquisition thread.
+ */
+void QueueCapture(CaptureBufferSet* set, vector<CaptureBufferSet*>& spares, OverflowPolicy policy)
+{
+	//Only the newest capture is worth sending, drop anything still waiting
+	if(policy == OVERFLOW_KEEP_LATEST)
+	{
+		CaptureBufferSet* stale;
+		while( (stale = g_readyQueue->Pop()) != NULL)
+		{
+			spares.push_back(stale);
+			g_framesDropped ++;
+			g_setsOutstanding --;
+		}
+	}
+
+	//Can't fail, the queue has room for every set
+	g_setsOutstanding ++;
+	g_readyQueue->Push(set);
+	WakeBufferSetWaiters();
+}
+
+/**
+	@brief Blocks until everything handed off to the sender has been sent
+
+	@return False if the sender failed or we're shutting down
+ */
+bool WaitForSenderIdle()
+{
+	{
+		unique_lock<mutex> lock(g_bufferSetMutex);
+		while( (g_setsOutstanding != 0) && !g_senderFailed && !g_waveformThreadQuit)
+			g_bufferSetCond.wait_for(lock, chrono::milliseconds(100));
+
+		if(g_senderFailed || (g_setsOutstanding != 0) )
+			return false;
+	}
+
+	//Then for the session's own client to finish sending it (extra subscribers don't hold us up)
+	auto primary = GetPrimarySubscriber();
+	while(primary && !primary->WaitForIdle(chrono::milliseconds(100)))
+	{
+		if(primary->IsFailed() || g_waveformThreadQuit)
+			return false;
+	}
+	return true;
+}
+
+/**
+	@brief Waits for the scope to finish acquiring a waveform, then reads it from the device
+
+	The capture can't be done before the whole buffer has been acquired at the sample rate, plus however long the
+	trigger takes (going by recent captures), so we sleep until then. After that we poll status only,
+	without reading any samples, backing off while there's no trigger. Once triggered, the device says how many
+	samples are left, so we sleep for that long. Sample data is read once, when the capture is complete.
+
+	Stopping or re-arming the trigger wakes us up right away.
+
+	@return False if the trigger was stopped or re-armed while waiting
+ */
+bool WaitForCapture(const AcquisitionConfig& config)
+{
+	unique_lock<mutex> lock(g_mutex);
+	if(!g_triggerArmed)
+		return false;
+
+	size_t armCount = g_armCount;
+	auto armTime = g_armSteadyTime;
+	double interval = config.m_sampleInterval * SECONDS_PER_FS;
+	double captureTime = config.m_memDepth * interval;
+
+	//Poll more often for short captures, but not so often we hog the lock
+	auto minPoll = chrono::microseconds(MIN_POLL_INTERVAL);
+	auto maxPoll = chrono::microseconds(MAX_POLL_INTERVAL);
+	auto basePoll = min(max(chrono::microseconds(static_cast<int64_t>(captureTime * 1e6 / 16)), minPoll), maxPoll);
+	auto poll = basePoll;
+
+	//Earliest the capture could be done
+	auto deadline = armTime + chrono::nanoseconds(static_cast<int64_t>( (captureTime + g_triggerWaitEstimate) * 1e9));
+
+	auto stopped = [armCount]
+		{ return !g_triggerArmed || g_waveformThreadQuit || (g_armCount != armCount); };
+
+	size_t polls = 0;
+	auto lastNotDone = armTime;
+	while(true)
+	{
+		g_armCond.wait_until(lock, deadline, stopped);
+		if(stopped())
+			return false;
+
+		auto pollTime = chrono::steady_clock::now();
+		DwfState state;
+		g_device->Status(false, state);
+		g_statusPolls ++;
+		polls ++;
+		if(state == DwfStateDone)
+			break;
+		lastNotDone = pollTime;
+
+		auto now = chrono::steady_clock::now();
+		if(state == DwfStateTriggered)
+		{
+			int samplesLeft = 0;
+			g_device->StatusSamplesLeft(samplesLeft);
+			auto left = chrono::microseconds(static_cast<int64_t>(max(samplesLeft, 0) * interval * 1e6));
+			deadline = now + max(left, minPoll);
+			poll = basePoll;
+		}
+		else
+		{
+			deadline = now + poll;
+			poll = min(poll * 2, maxPoll);
+		}
+	}
+
+	//Done, read the data
+	DwfState state;
+	g_device->Status(true, state);
+
+	//Learn how long the trigger takes. If the capture was done the first time we looked, we may have slept too long,
+	//so try a shorter wait next time. Otherwise it took at least until the last time we found it not done.
+	if(polls == 1)
+		g_triggerWaitEstimate /= 2;
+	else
+	{
+		double wait = max(chrono::duration<double>(lastNotDone - armTime).count() - captureTime, 0.0);
+		g_triggerWaitEstimate = (g_triggerWaitEstimate * 7 + wait) / 8;
+	}
+
+	return true;
+}
+
+/**
+	@brief Captures the remaining segments of a burst, re-arming as soon as each one is downloaded
+
+	The first segment has already been downloaded by DownloadCapture(). Nothing is encoded or sent until the burst
+	is complete, so the gap between segments is just the download time.
+
+	Only called from the acquisition thread.
+
+	@param armCount	Value of g_armCount when the first segment was captured
+
+	@return False if the trigger was stopped or reconfigured partway through the burst
+ */
+bool CaptureSegments(CaptureBufferSet* set, size_t armCount)
+{
+	for(size_t i=1; i<set->m_segments; i++)
+	{
+		{
+			lock_guard<mutex> lock(g_mutex);
+			if(!g_triggerArmed || (g_armCount != armCount) )
+				return false;
+
+			DigilentSCPIServer::Start();
+			armCount = g_armCount;
+			if(GetPublishedConfig() != set->m_config)
+				return false;
+		}
+
+		if(!WaitForCapture(*set->m_config))
+			return false;
+
+		{
+			lock_guard<mutex> lock(g_mutex);
+			if(g_armCount != armCount)
+				return false;
+
+			DownloadSegment(set, i);
+		}
+	}
+
+	return true;
+}
+
+/**
+	@brief Re-arms the trigger after a capture, if doing repeating triggers
+
+	Must be called with g_mutex held.
+
+	@return True if the trigger was re-armed
+ */
+bool RearmAfterCapture()
+{
+	if(g_triggerOneShot)
+	{
+		g_triggerArmed = false;
+		return false;
+	}
+
+	DigilentSCPIServer::Start();
+	return true;
+}
+
+/**
+	@brief Forwards everything the device has recorded since the last poll as one chunk
+
+	Chunks are numbered sequentially and carry the index of their first sample in the record, so the client can
+	tell a chunk we dropped (gap in sequence numbers) from samples the device lost (gap in sample indexes).
+
+	Only called from the acquisition thread.
+
+	@return False if the sender failed or we're shutting down
+ */
+bool StreamChunk(
+	shared_ptr<const AcquisitionConfig>& config,
+	vector<CaptureBufferSet*>& spares,
+	size_t& generation,
+	uint64_t& sequence,
+	uint64_t& nextSample)
+{
+	OverflowPolicy policy;
+	{
+		lock_guard<mutex> lock(g_mutex);
+		policy = g_overflowPolicy;
+	}
+	CaptureBufferSet* set = GetFreeBufferSet(spares, policy);
+	if(!set)
+		return false;
+
+	//The device buffer fills in depth*interval. Poll often enough to drain it well before then, but no faster than
+	//needed at low sample rates, so chunks don't degenerate into a handful of samples each.
+	int64_t pollInterval;
+	{
+		lock_guard<mutex> lock(g_mutex);
+
+		//Stopped or reconfigured while we were waiting for a buffer
+		if(!g_triggerArmed || UpdateConfig(config))
+		{
+			spares.push_back(set);
+			return true;
+		}
+
+		if(g_streamRestarted)
+		{
+			nextSample = 0;
+			g_streamRestarted = false;
+		}
+		if(g_memDepthChanged)
+		{
+			generation ++;
+			g_memDepthChanged = false;
+		}
+
+		//Fill time in us. Not in integer fs, since depth * interval overflows 64 bits at low sample rates.
+		double fillTime = config->m_memDepth * (config->m_sampleInterval * SECONDS_PER_FS) * 1e6;
+		pollInterval = static_cast<int64_t>(min<double>(MAX_STREAM_POLL_INTERVAL, fillTime / 4));
+
+		DwfState state;
+		g_device->Status(true, state);
+
+		int available = 0;
+		int lost = 0;
+		int corrupt = 0;
+		g_device->StatusRecord(available, lost, corrupt);
+
+		//Lost samples are the ones that should have come before this chunk.
+		//Anything that doesn't fit in our buffers is lost after it.
+		size_t count = min<size_t>(max(available, 0), config->m_memDepth);
+		size_t overrun = max(available, 0) - count;
+		lost = max(lost, 0);
+		corrupt = max(corrupt, 0);
+		if(lost || overrun || corrupt)
+		{
+			g_samplesLost += lost + overrun;
+			g_samplesCorrupt += corrupt;
+			LogDebug("Stream: %d samples lost, %zu overrun, %d corrupt\n", lost, overrun, corrupt);
+		}
+		nextSample += lost;
+
+		if(count)
+		{
+			SnapshotConfiguration(set, config);
+			set->m_segments = 1;
+			if(!set->EnsureAllocated(
+				set->m_depth,
+				set->m_format,
+				set->m_codec,
+				set->m_previewBuckets,
+				set->m_pyramid,
+				set->m_channelOn,
+				generation))
+			{
+				LogError("Can't stream with the current settings, stopping the trigger\n");
+				DigilentSCPIServer::Stop();
+				spares.push_back(set);
+				return true;
+			}
+
+			set->m_depth = count;
+			set->m_readyTime = GetHostTimestamp();
+			DownloadSamples(set, 0);
+			GetTriggerTime(set->m_triggerTicks, set->m_ticksPerSecond);
+
+			set->m_stream = true;
+			set->m_sequence = sequence ++;
+			set->m_firstSample = nextSample;
+			set->m_lost = lost;
+			set->m_corrupt = corrupt;
+			set->m_trigphase = 0;
+		}
+		else
+		{
+			spares.push_back(set);
+			set = NULL;
+		}
+
+		nextSample += count + overrun;
+	}
+
+	if(set)
+		QueueCapture(set, spares, policy);
+
+	//Sleep until the next poll, unless we're stopped
+	unique_lock<mutex> lock(g_mutex);
+	g_armCond.wait_for(lock, chrono::microseconds(max<int64_t>(pollInterval, 100)),
+		[]{ return !g_triggerArmed || g_waveformThreadQuit; });
+	return true;
+}
+
+/**
+	@brief Sets up a buffer set for a capture made with a given configuration
+
+	The set keeps a reference to the configuration, which never changes, for anything that needs it later. Copying
+	the channel map is the only part that could allocate, so that's only done when the configuration is new to the set.
+
+	Must be called with g_mutex held.
+ */
+void SnapshotConfiguration(CaptureBufferSet* set, const shared_ptr<const AcquisitionConfig>& config)
+{
+	if(set->m_config != config)
+	{
+		set->m_channelOn = config->m_channelOn;
+		set->m_config = config;
+	}
+
+	set->m_interval = config->m_sampleInterval;
+	set->m_depth = config->m_memDepth;
+	set->m_format = config->m_sampleFormat;
+	set->m_codec = config->m_codec;
+	set->m_segments = config->m_segmentCount;
+	set->m_previewBuckets = config->m_previewBuckets;
+	set->m_previewMode = config->m_previewMode;
+	set->m_pyramid = config->m_pyramidEnabled;
+	set->m_averages = config->m_averageCount;
+	set->m_persistColumns = config->m_persistColumns;
+	set->m_persistRows = config->m_persistRows;
+	set->m_persistRate = config->m_persistRate;
+	set->m_spectrum = config->m_spectrumMode;
+	set->m_window = config->m_fftWindow;
+	set->m_spectrumAverages = config->m_spectrumAverages;
+	set->m_peakHold = config->m_peakHold;
+	set->m_spectrogramBins = config->m_spectrogramBins;
+	set->m_headerVersion = config->m_headerVersion;
+	set->m_numchans = config->m_numChannelsOn;
+	set->m_armTime = g_armTime;
+	set->m_stream = false;
+
+	//Region of interest: only download and send a slice of the record around the trigger (clipped to the record)
+	bool stream = (config->m_acquisitionMode == ACQUISITION_STREAM);
+	set->m_fullDepth = config->m_memDepth;
+	set->m_sliceOffset = 0;
+	set->m_roi = (config->m_roiLength != 0) && !stream;
+	if(set->m_roi)
+	{
+		int64_t first = static_cast<int64_t>(config->m_triggerSampleIndex) + config->m_roiStart;
+		first = max<int64_t>(0, min<int64_t>(first, config->m_memDepth - 1));
+		set->m_sliceOffset = first;
+		set->m_depth = min<size_t>(config->m_roiLength, config->m_memDepth - first);
+	}
+
+	//Spectra and persistence replace all per-capture output (spectra win if both are on).
+	//Neither applies when streaming, since chunks vary in length and have no trigger to line up on.
+	if(stream)
+	{
+		set->m_persistColumns = 0;
+		set->m_spectrum = SPECTRUM_OFF;
+	}
+	if(set->m_spectrum != SPECTRUM_OFF)
+		set->m_persistColumns = 0;
+	if(set->m_persistColumns || (set->m_spectrum != SPECTRUM_OFF) )
+	{
+		set->m_previewBuckets = 0;
+		set->m_pyramid = false;
+	}
+
+	//Preview buffers are allocated at this size, so no more buckets than there are samples to put in them
+	size_t samples = stream ? set->m_depth : set->GetSampleCount();
+	set->m_previewBuckets = min(set->m_previewBuckets, samples);
+}
+
+/**
+	@brief Downloads a completed capture from the scope and snapshots its configuration
+
+	Must be called with g_mutex held.
+
+	@return False if there isn't enough memory for a capture with this configuration
+ */
+bool DownloadCapture(CaptureBufferSet* set, const shared_ptr<const AcquisitionConfig>& config, size_t generation)
+{
+	SnapshotConfiguration(set, config);
+
+	//Set up buffers if needed (all segments of a burst share one arena per channel)
+	if(!set->EnsureAllocated(
+		set->GetSampleCount(),
+		set->m_format,
+		set->m_codec,
+		set->m_previewBuckets,
+		set->m_pyramid,
+		set->m_channelOn,
+		generation))
+	{
+		LogError("Can't capture with the current settings, stopping the trigger\n");
+		return false;
+	}
+	set->m_segmentTrigphase.resize(set->m_segments);
+	set->m_segmentTime.resize(set->m_segments);
+
+	DownloadSegment(set, 0);
+	set->m_trigphase = set->m_segmentTrigphase[0];
+	return true;
+}
+
+/**
+	@brief Downloads one segment of a capture into its slot in the buffers, along with its trigger phase and time
+
+	Must be called with g_mutex held.
+ */
+void DownloadSegment(CaptureBufferSet* set, size_t segment)
+{
+	//A burst is ready when its last segment is
+	set->m_readyTime = GetHostTimestamp();
+
+	size_t first = segment * set->m_depth;
+	DownloadSamples(set, first);
+	set->m_segmentTrigphase[segment] = InterpolateTriggerPhase(set, first);
+
+	uint64_t ticks;
+	uint64_t ticksPerSecond;
+	GetTriggerTime(ticks, ticksPerSecond);
+	if(segment == 0)
+	{
+		set->m_triggerTicks = ticks;
+		set->m_ticksPerSecond = ticksPerSecond;
+	}
+	set->m_segmentTime[segment] = (ticks - set->m_triggerTicks) * FS_PER_SECOND / set->m_ticksPerSecond;
+}
+
+/**
+	@brief Gets the time of the last trigger
+
+	Uses the device's trigger timestamp if it has one, otherwise the host clock.
+
+	Must be called with g_mutex held.
+ */
+void GetTriggerTime(uint64_t& ticks, uint64_t& ticksPerSecond)
+{
+	unsigned int sec;
+	unsigned int tick;
+	unsigned int rate;
+	if(g_device->StatusTime(sec, tick, rate) && (rate != 0) )
+	{
+		ticks = static_cast<uint64_t>(sec) * rate + tick;
+		ticksPerSecond = rate;
+	}
+	else
+	{
+		ticks = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+		ticksPerSecond = 1000000000;
+	}
+}
+
+/**
+	@brief Gets the host time in ns since the Unix epoch, for timestamps that can be lined up with other machines
+ */
+int64_t GetHostTimestamp()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+	@brief Downloads set->m_depth samples of each enabled channel from the scope, along with their scaling
+
+	Must be called with g_mutex held.
+
+	@param first	Index in the buffers to put the first sample at
+ */
+void DownloadSamples(CaptureBufferSet* set, size_t first)
+{
+	SampleFormat format = set->m_format;
+
+	//Download the data from the scope (only for enabled channels, the rest is junk anyway)
+	for(size_t i=0; i<g_numAnalogInChannels; i++)
+	{
+		if(!set->m_channelOn[i])
+			continue;
+
+		double range;
+		double offset;
+		g_device->ChannelRangeGet(i, range);
+		g_device->ChannelOffsetGet(i, offset);
+		set->m_ranges[i] = range;
+		set->m_centers[i] = offset;
+
+		if( (format == FORMAT_INT16) || (format == FORMAT_PACKED) )
+		{
+			g_device->StatusData16(i, set->m_rawBuffers[i] + first, set->m_sliceOffset, set->m_depth);
+
+			//Raw codes are full scale signed 16 bit, centered on the channel offset.
+			//Packed codes keep only the top g_adcBits of each.
+			if(format == FORMAT_PACKED)
+				set->m_scales[i] = range / (1 << g_adcBits);
+			else
+				set->m_scales[i] = range / 65536;
+			set->m_offsets[i] = offset;
+		}
+		else
+		{
+			//Only the region of interest, if there is one
+			double* buf = set->m_waveformBuffers[i] + first;
+			if(set->m_sliceOffset)
+				g_device->StatusData2(i, buf, set->m_sliceOffset, set->m_depth);
+			else
+				g_device->StatusData(i, buf, set->m_depth);
+			set->m_scales[i] = 1;
+			set->m_offsets[i] = 0;
+		}
+	}
+}
+
+/**
+	@brief Calculates the sub-sample trigger position of a capture (or one segment of a burst)
+
+	Must be called with g_mutex held.
+
+	@param first	Index in the buffers of the first sample of the capture
+ */
+float InterpolateTriggerPhase(CaptureBufferSet* set, size_t first)
+{
+	SampleFormat format = set->m_format;
+	const AcquisitionConfig& config = *set->m_config;
+	size_t triggerIndex = config.m_triggerSampleIndex;
+	size_t triggerChannel = config.m_triggerChannel;
+
+	//Interpolate trigger position if we're using an analog level trigger.
+	//This has to happen before re-arming since it uses the trigger configuration.
+	//bool triggerIsAnalog = (triggerChannel < g_numChannels);
+	bool triggerIsAnalog = true;
+	float trigphase = 0;
+	int64_t interval = set->m_interval;
+	if(triggerIsAnalog)
+	{
+		//Where the trigger is in what we downloaded. If the region of interest doesn't cover it,
+		//download just the two samples around it.
+		size_t index = triggerIndex - set->m_sliceOffset;
+		size_t count = set->m_depth;
+		bool inSlice = (triggerIndex >= set->m_sliceOffset) && (index + 1 < count);
+		bool fetchPair = !inSlice && (triggerIndex + 1 < config.m_memDepth);
+		if(!inSlice)
+		{
+			index = 0;
+			count = fetchPair ? 2 : 0;
+		}
+
+		//Interpolate zero crossing to get sub-sample precision.
+		//Can't do this if the trigger channel is off, since we didn't download it.
+		if(!set->m_channelOn[triggerChannel])
+			trigphase = 0;
+		else if( (format == FORMAT_INT16) || (format == FORMAT_PACKED) )
+		{
+			const int16_t* buf = set->m_rawBuffers[triggerChannel] + first;
+			int16_t pair[2];
+			if(fetchPair)
+			{
+				g_device->StatusData16(triggerChannel, pair, triggerIndex, 2);
+				buf = pair;
+			}
+
+			//Interpolate on the unpacked codes, so always use 16-bit scaling
+			float scale = GetRawScale(set, triggerChannel);
+			trigphase = -InterpolateTriggerTime(buf, index, count, scale, set->m_offsets[triggerChannel], config.m_triggerVoltage) * interval;
+		}
+		else
+		{
+			const double* buf = set->m_waveformBuffers[triggerChannel] + first;
+			double pair[2];
+			if(fetchPair)
+			{
+				g_device->StatusData2(triggerChannel, pair, triggerIndex, 2);
+				buf = pair;
+			}
+
+			trigphase = -InterpolateTriggerTime(buf, index, count, 1.0f, 0.0f, config.m_triggerVoltage) * interval;
+		}
+
+		//Cap interpolation error
+		if(trigphase > 10*interval)
+			trigphase = 10*interval;
+		if(trigphase < -10*interval)
+			trigphase = -10*interval;
+
+		//Correct for set point error
+		trigphase += (interval  + config.m_triggerDeltaSec*FS_PER_SECOND);
+	}
+	return trigphase;
+}
+
+/**
+	@brief Converts downloaded samples to the wire format
+ */
+void EncodeCapture(CaptureBufferSet* set)
+{
+	SampleFormat format = set->m_format;
+	size_t depth = set->GetSampleCount();
+
+	//Compress raw codes, one channel per thread
+	for(size_t i=0; i<g_numAnalogInChannels; i++)
+		set->m_compressedLen[i] = 0;
+	if( (set->m_codec != CODEC_NONE) && ( (format == FORMAT_INT16) || (format == FORMAT_PACKED) ) )
+	{
+		vector<size_t> chans;
+		vector<int16_t*> srcs;
+		vector<uint8_t*> dsts;
+		for(size_t i=0; i<g_numAnalogInChannels; i++)
+		{
+			if(!set->m_channelOn[i])
+				continue;
+			chans.push_back(i);
+			srcs.push_back(set->m_rawBuffers[i]);
+			dsts.push_back(set->m_compressedBuffers[i]);
+		}
+
+		int nbits = (format == FORMAT_PACKED) ? g_adcBits : 16;
+		size_t maxlen = GetWaveformSize(format, depth);
+
+		#pragma omp parallel for
+		for(size_t j=0; j<chans.size(); j++)
+			set->m_compressedLen[chans[j]] = CompressSamples(srcs[j], dsts[j], depth, maxlen, nbits);
+	}
+
+	//Narrow to float32
+	if(format == FORMAT_FLOAT32)
+	{
+		for(size_t i=0; i<g_numAnalogInChannels; i++)
+		{
+			if(!set->m_channelOn[i])
+				continue;
+
+			double* src = set->m_waveformBuffers[i];
+			float* dst = set->m_floatBuffers[i];
+			#pragma omp parallel for simd
+			for(size_t j=0; j<depth; j++)
+				dst[j] = src[j];
+		}
+	}
+
+	//Pack to N bits (unless we're sending it compressed)
+	else if(format == FORMAT_PACKED)
+	{
+		for(size_t i=0; i<g_numAnalogInChannels; i++)
+		{
+			if(set->m_channelOn[i] && !set->m_compressedLen[i])
+				PackSamples(set->m_rawBuffers[i], set->m_packedBuffers[i], depth, g_adcBits);
+		}
+	}
+}
+
+/**
+	@brief Serializes an encoded capture into its data plane frame
+ */
+void BuildFrame(CaptureBufferSet* set)
+{
+	SampleFormat format = set->m_format;
+	WaveformCodec codec = set->m_codec;
+	DataPlaneFrame& frame = set->m_frame;
+
+	//Channel count and sample rate
+	frame.Clear();
+	frame.AddHeader(set->m_numchans);
+	frame.AddHeader(set->m_interval);
+	AddTimingHeader(frame, set);
+
+	//Streaming chunks say where they belong in the record
+	if(set->m_stream)
+	{
+		uint64_t chunk[4] = {set->m_sequence, set->m_firstSample, set->m_lost, set->m_corrupt};
+		frame.AddHeader(chunk);
+	}
+
+	//Let the client tell full records from previews and tiles
+	if(set->m_previewBuckets || set->m_pyramid)
+		frame.AddHeader(static_cast<uint64_t>(FRAME_FULL));
+
+	//Number of captures that went into an averaged frame
+	if(set->m_averages > 1)
+		frame.AddHeader(static_cast<uint64_t>(set->m_averaged));
+
+	//Where the region of interest is in the full record. Sample i of each channel (and segment) is at
+	//(offset + i) * interval + trigphase.
+	if(set->m_roi)
+	{
+		uint64_t roi[2] = {set->m_sliceOffset, set->m_fullDepth};
+		frame.AddHeader(roi);
+	}
+
+	//Burst captures list the trigger phase and time of each segment.
+	//Each channel's samples are then all of its segments back to back.
+	if(set->m_segments > 1)
+	{
+		frame.AddHeader(static_cast<uint64_t>(set->m_segments));
+		for(size_t i=0; i<set->m_segments; i++)
+		{
+			frame.AddHeader(set->m_segmentTrigphase[i]);
+			frame.AddHeader(set->m_segmentTime[i]);
+		}
+	}
+
+	//Data for each channel
+	size_t wfmsize = GetWaveformSize(format, set->GetSampleCount());
+	for(size_t i=0; i<g_numAnalogInChannels; i++)
+	{
+		//Analog channels
+		if((i < g_numAnalogInChannels) && (set->m_channelOn[i]) )
+		{
+			//Channel ID, memory depth, and trigger phase
+			uint64_t header[2] = {i, set->m_depth};
+			frame.AddHeader(header);
+			frame.AddHeader(set->m_trigphase);
+
+			//Extended header: volts/LSB and offset so the client can scale the samples itself
+			uint8_t* samples = (uint8_t*)set->m_waveformBuffers[i];
+			if(format != FORMAT_FLOAT64)
+			{
+				float scaling[2] = {set->m_scales[i], set->m_offsets[i]};
+				frame.AddHeader(scaling);
+
+				if(format == FORMAT_INT16)
+					samples = (uint8_t*)set->m_rawBuffers[i];
+				else if(format == FORMAT_PACKED)
+					samples = set->m_packedBuffers[i];
+				else
+					samples = (uint8_t*)set->m_floatBuffers[i];
+			}
+
+			//Codec header: codec actually used for this channel and payload length
+			size_t len = wfmsize;
+			if(codec != CODEC_NONE)
+			{
+				uint64_t codecinfo[2] = {CODEC_NONE, wfmsize};
+				if(set->m_compressedLen[i])
+				{
+					codecinfo[0] = codec;
+					codecinfo[1] = set->m_compressedLen[i];
+					samples = set->m_compressedBuffers[i];
+					len = set->m_compressedLen[i];
+				}
+				frame.AddHeader(codecinfo);
+			}
+
+			//The actual waveform data
+			frame.AddPayload(samples, len);
+		}
+
+		/*
+		//Digital channels
+		else if( (i >= g_numChannels) && (g_msoPodEnabledDuringArm[i - g_numChannels]) )
+		{
+			frame.AddHeader(i);
+			frame.AddHeader(numSamples);
+			frame.AddHeader(trigphase);
+			frame.AddPayload((uint8_t*)waveformBuffers[i], numSamples * sizeof(int16_t));
+		}
+		*/
+	}
+}
+
+/**
+	@brief Reduces each channel to a min/max envelope for the preview frame
+ */
+void DecimateCapture(CaptureBufferSet* set)
+{
+	SampleFormat format = set->m_format;
+	size_t count = set->GetSampleCount();
+	size_t buckets = min(set->m_previewBuckets, count);
+
+	for(size_t i=0; i<g_numAnalogInChannels; i++)
+	{
+		if(!set->m_channelOn[i])
+			continue;
+
+		//Envelope is always in volts
+		if( (format == FORMAT_INT16) || (format == FORMAT_PACKED) )
+		{
+			MinMaxDecimate(
+				set->m_rawBuffers[i], count, set->m_previewBuffers[i], buckets, GetRawScale(set, i), set->m_offsets[i]);
+		}
+		else
+			MinMaxDecimate(set->m_waveformBuffers[i], count, set->m_previewBuffers[i], buckets);
+	}
+}
+
+/**
+	@brief Adds the header extension the client asked for (see MAX_HEADER_VERSION), if any
+
+	The length lets clients skip fields added by versions newer than they know about.
+ */
+void AddTimingHeader(DataPlaneFrame& frame, CaptureBufferSet* set)
+{
+	if(set->m_headerVersion < 1)
+		return;
+
+	uint64_t ext[2] = {1, 6 * sizeof(uint64_t)};
+	frame.AddHeader(ext);
+
+	uint64_t device[3] = {set->m_sequence, set->m_triggerTicks, set->m_ticksPerSecond};
+	frame.AddHeader(device);
+	int64_t host[3] = {set->m_armTime, set->m_readyTime, set->m_sendTime};
+	frame.AddHeader(host);
+}
+
+/**
+	@brief Serializes the min/max envelope of a capture into its preview frame
+
+	Same global header (and header extension) as a full frame, then the frame type, uint64 {slice offset, full depth}
+	if there's a region of interest, and per channel: uint64 {id, samples, buckets}, float trigphase, and the
+	envelope as float {min, max} volts for each bucket.
+ */
+void BuildPreviewFrame(CaptureBufferSet* set)
+{
+	DataPlaneFrame& frame = set->m_previewFrame;
+	size_t count = set->GetSampleCount();
+	size_t buckets = min(set->m_previewBuckets, count);
+
+	frame.Clear();
+	frame.AddHeader(set->m_numchans);
+	frame.AddHeader(set->m_interval);
+	AddTimingHeader(frame, set);
+	frame.AddHeader(static_cast<uint64_t>(FRAME_PREVIEW));
+	if(set->m_roi)
+	{
+		uint64_t roi[2] = {set->m_sliceOffset, set->m_fullDepth};
+		frame.AddHeader(roi);
+	}
+
+	for(size_t i=0; i<g_numAnalogInChannels; i++)
+	{
+		if(!set->m_channelOn[i])
+			continue;
+
+		uint64_t header[3] = {i, count, buckets};
+		frame.AddHeader(header);
+		frame.AddHeader(set->m_trigphase);
+		frame.AddPayload(reinterpret_cast<uint8_t*>(set->m_previewBuffers[i]), buckets * 2 * sizeof(float));
+	}
+}
+
+/**
+	@brief Builds the min/max pyramid of each channel, one channel per thread
+ */
+void BuildPyramid(CaptureBufferSet* set)
+{
+	//Too short to have any stored levels
+	if(set->m_pyramidBuffers.empty())
+		return;
+
+	SampleFormat format = set->m_format;
+	bool raw = (format == FORMAT_INT16) || (format == FORMAT_PACKED);
+	size_t count = set->GetSampleCount();
+	const vector<size_t>& buckets = set->m_pyramidBuckets;
+	const vector<size_t>& offsets = set->m_pyramidOffsets;
+
+	vector<float*> pyramids;
+	vector<int16_t*> rawSrcs;
+	vector<double*> srcs;
+	vector<float> scales;
+	vector<float> voltOffsets;
+	for(size_t i=0; i<g_numAnalogInChannels; i++)
+	{
+		if(!set->m_channelOn[i])
+			continue;
+		pyramids.push_back(set->m_pyramidBuffers[i]);
+		rawSrcs.push_back(raw ? set->m_rawBuffers[i] : NULL);
+		srcs.push_back(raw ? NULL : set->m_waveformBuffers[i]);
+		scales.push_back(raw ? GetRawScale(set, i) : 1);
+		voltOffsets.push_back(set->m_offsets[i]);
+	}
+
+	#pragma omp parallel for
+	for(size_t j=0; j<pyramids.size(); j++)
+	{
+		float* pyramid = pyramids[j];
+
+		//Base level straight from the samples, then each level from the one below
+		if(raw)
+		{
+			MinMaxDecimatePow2(
+				rawSrcs[j], count, pyramid + offsets[PYRAMID_BASE_LEVEL], PYRAMID_BASE_LEVEL, scales[j], voltOffsets[j]);
+		}
+		else
+			MinMaxDecimatePow2(srcs[j], count, pyramid + offsets[PYRAMID_BASE_LEVEL], PYRAMID_BASE_LEVEL);
+
+		for(size_t level = PYRAMID_BASE_LEVEL + 1; level < buckets.size(); level++)
+			MinMaxMerge(pyramid + offsets[level-1], buckets[level-1], pyramid + offsets[level]);
+	}
+}
+
+/**
+	@brief Volts per LSB of a channel's 16-bit raw codes
+
+	Packed captures store their scaling in packed LSBs, which are coarser.
+ */
+float GetRawScale(CaptureBufferSet* set, size_t channel)
+{
+	float scale = set->m_scales[channel];
+	if(set->m_format == FORMAT_PACKED)
+		scale /= (1 << (16 - g_adcBits));
+	return scale;
 }
 
-float InterpolateTriggerTime(double* buf)
+template<class T>
+float InterpolateTriggerTime(const T* buf, size_t index, size_t count, float scale, float offset, float level)
 {
-	if(g_triggerSampleIndex >= g_memDepth-1)
+	if(index + 1 >= count)
 		return 0;
 
-	float fa = buf[g_triggerSampleIndex];
-	float fb = buf[g_triggerSampleIndex+1];
+	float fa = buf[index] * scale + offset;
+	float fb = buf[index+1] * scale + offset;
 
 	//no need to divide by time, sample spacing is normalized to 1 timebase unit
 	float slope = (fb - fa);
-	float delta = g_triggerVoltage - fa;
+	float delta = level - fa;
 	return delta / slope;
 }
@@ -35,26 +35,59 @@
 
 #include "wfmserver.h"
 #include <signal.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 #include "DigilentSCPIServer.h"
+#include "SampleBufferPool.h"
+#include "SpectrumAnalyzer.h"
+#include "CaptureReplay.h"
+#include "DwfDevice.h"
+#include "SyntheticDevice.h"
 
 using namespace std;
 
 void help();
+bool OpenDevice(int device, int config, const string& host, const string& synthetic);
+void CloseDevice();
+bool ListenOnLocalSocket(const string& path);
 
 void help()
 {
 	fprintf(stderr,
-			"wfmserver [general options] [USB or IP device options] [logger options]\n"
+			"wfmserver [general options] [USB, IP or synthetic device options] [logger options]\n"
 			"\n"
 			"  [general options]:\n"
 			"    --help                        : this message...\n"
 			"    --scpi-port nnn               : specifies the SCPI control plane port (default 5025)\n"
 			"    --waveform-port nnn           : specifies the binary waveform data port (default 5026)\n"
+			"    --zerocopy                    : send waveform data with MSG_ZEROCOPY (Linux only)\n"
+			"    --local-socket path           : also accept same-host waveform clients on this Unix socket, and send\n"
+			"                                    them data through shared memory (not on Windows)\n"
+			"    --shm-size nnn                : size of each local client's shared memory ring in MB (default 256)\n"
+			"    --record-dir path             : allow clients to record waveforms to files in this directory\n"
+			"    --replay path                 : serve a recording instead of opening a device\n"
+			"    --replay-pacing original|max  : replay frames at the rate they were recorded (default), or as fast as\n"
+			"                                    the client takes them\n"
+			"    --record-direct               : write recordings with O_DIRECT, bypassing the page cache\n"
+			"    --queue-depth nnn             : max captures waiting for a slow client in pipelined mode (default 2)\n"
+			"    --hugepages                   : back large sample buffers with huge pages (Linux only)\n"
+			"    --mlock                       : lock sample buffers in RAM\n"
+			"    --benchmark-fft               : measure spectrum mode FFT throughput at each memory depth, then exit\n"
 			"  [USB device options]:\n"
 			"    --device nnn                  : specifies the device to open if more than one is present\n"
 			"    --config nnn                  : specifies the configuration for the device to use\n"
 			"  [IP device options]:\n"
 			"    --host hostname_or_ip         : hostname or IP address of the embedded server\n"
+			"  [synthetic device options]:\n"
+			"    --synthetic opt[,opt...]      : generate waveforms instead of opening a device. Options:\n"
+			"                                    sine|square|noise, freq=Hz, amp=V, noise=V (RMS), channels=n,\n"
+			"                                    bits=n, maxrate=Hz, maxdepth=n, trigwait=us (extra trigger delay),\n"
+			"                                    latency=us (added to every device call)\n"
 			"\n"
 			"  [logger options]:\n"
 			"    levels: ERROR, WARNING, NOTICE, VERBOSE, DEBUG\n"
@@ -73,8 +106,26 @@ string g_model;
 string g_serial;
 string g_fwver;
 
-HDWF g_hScope;
+ScopeDevice* g_device = NULL;
 size_t g_numAnalogInChannels = 0;
+int g_adcBits = 16;
+bool g_zeroCopy = false;
+
+double g_minSampleRate = 0;
+double g_maxSampleRate = 0;
+int g_maxMemDepth = 0;
+
+//The recording being replayed, or NULL if we have a real device
+CaptureReplay* g_replay = NULL;
+bool g_replayFast = false;
+
+//Listening socket for same-host clients (-1 if disabled), and how much shared memory each one gets
+int g_localSocket = -1;
+size_t g_shmRingSize = 256 * 1024 * 1024;
+
+//Where clients may record to (empty if they can't), and whether to bypass the page cache doing so
+string g_recordDir;
+bool g_recordDirect = false;
 
 Socket g_scpiSocket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
 Socket g_dataSocket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
@@ -90,6 +141,12 @@ int main(int argc, char* argv[])
 	uint16_t scpi_port = 5025;
 	uint16_t waveform_port = 5026;
 	string host;
+	string localPath;
+	string replayPath;
+	string synthetic;
+	bool hugePages = false;
+	bool lockMemory = false;
+	bool benchmarkFFT = false;
 	int device = 0;
 	int config = 0;
 	for(int i=1; i<argc; i++)
@@ -117,6 +174,46 @@ int main(int argc, char* argv[])
 			if(i+1 < argc)
 				waveform_port = atoi(argv[++i]);
 		}
+		else if(s == "--zerocopy")
+			g_zeroCopy = true;
+		else if(s == "--local-socket")
+		{
+			if(i+1 < argc)
+				localPath = argv[++i];
+		}
+		else if(s == "--shm-size")
+		{
+			if(i+1 < argc)
+				g_shmRingSize = static_cast<size_t>(atoi(argv[++i])) * 1024 * 1024;
+		}
+		else if(s == "--record-dir")
+		{
+			if(i+1 < argc)
+				g_recordDir = argv[++i];
+		}
+		else if(s == "--record-direct")
+			g_recordDirect = true;
+		else if(s == "--replay")
+		{
+			if(i+1 < argc)
+				replayPath = argv[++i];
+		}
+		else if(s == "--replay-pacing")
+		{
+			if(i+1 < argc)
+				g_replayFast = (string(argv[++i]) == "max");
+		}
+		else if(s == "--hugepages")
+			hugePages = true;
+		else if(s == "--mlock")
+			lockMemory = true;
+		else if(s == "--benchmark-fft")
+			benchmarkFFT = true;
+		else if(s == "--queue-depth")
+		{
+			if(i+1 < argc)
+				g_queueDepth = atoi(argv[++i]);
+		}
 		else if(s == "--device")
 		{
 			if(i+1 < argc)
@@ -132,6 +229,11 @@ int main(int argc, char* argv[])
 			if(i+1 < argc)
 				host = argv[++i];
 		}
+		else if(s == "--synthetic")
+		{
+			if(i+1 < argc)
+				synthetic = argv[++i];
+		}
 
 		else
 		{
@@ -143,133 +245,26 @@ int main(int argc, char* argv[])
 	//Set up logging
 	g_log_sinks.emplace(g_log_sinks.begin(), new ColoredSTDLogSink(console_verbosity));
 
-	//Dump the Digilent API version
-	char version[32] = "";
-	if(!FDwfGetVersion(version))
-	{
-		LogError("FDwfGetVersion failed\n");
-		return 1;
-	}
-	LogDebug("Digilent API %s\n", version);
+	//Decide how to back sample buffers
+	SampleBufferPool::ConfigureMemory(hugePages, lockMemory);
 
-	if(host.empty())
+	//Open the device, or stand in for it with a recording
+	if(!replayPath.empty())
 	{
-		//Initial setup: enumerate devices
-		LogNotice("Looking for Digilent devices...\n");
-		int numDevices;
-		if(!FDwfEnum(enumfilterAll, &numDevices))
-		{
-			LogError("FDwfEnum failed\n");
+		g_replay = new CaptureReplay;
+		if(!g_replay->Open(replayPath))
 			return 1;
-		}
-		LogDebug("%d devices found\n", numDevices);
-		if(numDevices == 0)
-		{
-			LogNotice("No devices found, exiting\n");
-			return 0;
-		}
-
-		//Print out list of all devices found
-		char username[32];
-		char devname[32];
-		char serial[32];
-		for(int i=0; i<numDevices; i++)
-		{
-			LogIndenter li;
-
-			FDwfEnumUserName(i, username);
-			FDwfEnumDeviceName(i, devname);
-			FDwfEnumSN(i, serial);
-			LogVerbose("[%d] %s (user name %s), serial %s\n", i, devname, username, serial);
-		}
-
-		//Print out the selected device
-		FDwfEnumUserName(device, username);
-		FDwfEnumDeviceName(device, devname);
-		FDwfEnumSN(device, serial);
-		LogVerbose("Using device %d: %s (user name %s), serial %s\n", device, devname, username, serial);
-		g_model = devname;
-		g_serial = serial;
-		g_fwver = "FIXME";
-
-		//Enum configurations and decide which one to use
-		int configsFound;
-		LogVerbose("Checking possible device configurations...\n");
-		if(!FDwfEnumConfig(device, &configsFound))
-		{
-			LogError("FDwfEnumConfig failed\n");
-			return 1;
-		}
-		LogDebug("%d configs found\n", configsFound);
-		{
-			LogIndenter li;
-			for(int i=0; i<configsFound; i++)
-			{
-				LogDebug("Config %d:\n", i);
-				LogIndenter li2;
-
-				int analogInCount;
-				int analogIOCount;
-				int analogOutCount;
-				int digitalInCount;
-				int digitalOutCount;
-				int digitalIOCount;
-
-				int analogInBufferSize;
-				int analogOutBufferSize;
-				int digitalInBufferSize;
-				int digitalOutBufferSize;
-
-				FDwfEnumConfigInfo(i, DECIAnalogInChannelCount, &analogInCount);
-				FDwfEnumConfigInfo(i, DECIAnalogOutChannelCount, &analogOutCount);
-				FDwfEnumConfigInfo(i, DECIAnalogIOChannelCount, &analogIOCount);
-				FDwfEnumConfigInfo(i, DECIDigitalInChannelCount, &digitalInCount);
-				FDwfEnumConfigInfo(i, DECIDigitalOutChannelCount, &digitalOutCount);
-				FDwfEnumConfigInfo(i, DECIDigitalIOChannelCount, &digitalIOCount);
-
-				FDwfEnumConfigInfo(i, DECIAnalogInBufferSize, &analogInBufferSize);
-				FDwfEnumConfigInfo(i, DECIAnalogOutBufferSize, &analogOutBufferSize);
-				FDwfEnumConfigInfo(i, DECIDigitalInBufferSize, &digitalInBufferSize);
-				FDwfEnumConfigInfo(i, DECIDigitalOutBufferSize, &digitalOutBufferSize);
-
-				LogDebug("Analog in:   %d\n", analogInCount);
-				LogDebug("Analog out:  %d\n", analogOutCount);
-				LogDebug("Analog IO:   %d\n", analogIOCount);
-				LogDebug("Digital in:  %d\n", digitalInCount);
-				LogDebug("Digital out: %d\n", digitalOutCount);
-				LogDebug("Digital IO:  %d\n", digitalIOCount);
-
-				g_numAnalogInChannels = analogInCount;
-
-				LogDebug("Analog buffer: %d in, %d out\n", analogInBufferSize, analogOutBufferSize);
-				LogDebug("Digital buffer: %d in, %d out\n", digitalInBufferSize, digitalOutBufferSize);
-			}
-		}
-
-		//Open the device
-		LogDebug("Opening device %d in config %d\n", device, config);
-		if(!FDwfDeviceConfigOpen(device, config, &g_hScope))
-		{
-			LogError("Failed to open device\n");
-			return 1;
-		}
+		LogNotice("Replaying %s (%s, serial %s)\n", replayPath.c_str(), g_model.c_str(), g_serial.c_str());
 	}
-	else
-	{
-		LogDebug("Opening Ethernet device\n");
-
-		//TODO: figure out how to get this info
-		g_model = "Analog Discovery Pro 3450";
-		g_serial = "Unknown";
-		g_fwver = "FIXME";
-		g_numAnalogInChannels = 4;
+	else if(!OpenDevice(device, config, host, synthetic))
+		return 1;
 
-		string connstr = string("ip:") + host + "\nuser:admin\npass:admin\nsecure:1";
-		if(!FDwfDeviceOpenEx(connstr.c_str(), &g_hScope))
-		{
-			LogError("Failed to open device\n");
-			return 1;
-		}
+	//Benchmark spectrum mode, if requested, instead of serving clients
+	if(benchmarkFFT)
+	{
+		SpectrumAnalyzer::Benchmark(DigilentSCPIServer::GetSupportedSampleDepths());
+		CloseDevice();
+		return 0;
 	}
 
 	//Initialize analog channels
@@ -283,6 +278,8 @@ int main(int argc, char* argv[])
 	//Configure the data plane socket
 	g_dataSocket.Bind(waveform_port);
 	g_dataSocket.Listen();
+	if(!localPath.empty() && !ListenOnLocalSocket(localPath))
+		return 1;
 
 	//Launch the control plane socket server
 	g_scpiSocket.Bind(scpi_port);
@@ -304,21 +301,140 @@ int main(int argc, char* argv[])
 		server.MainLoop();
 
 		g_waveformThreadQuit = true;
+		g_armCond.notify_all();
 		dataThread.join();
 		g_waveformThreadQuit = false;
 	}
 
 	//Done, clean up
-	FDwfDeviceClose(g_hScope);
+	CloseDevice();
 
 	return 0;
 }
 
+/**
+	@brief Opens the device (real or synthetic), and reads everything we need to know about it
+
+	@param host			Hostname or IP of an Ethernet device, or empty to use a USB device
+	@param synthetic	Options for a synthetic device (see SyntheticDevice), or empty to use a real one
+ */
+bool OpenDevice(int device, int config, const string& host, const string& synthetic)
+{
+	if(!synthetic.empty())
+	{
+		SyntheticDevice* dev = new SyntheticDevice;
+		g_device = dev;
+		if(!dev->Open(synthetic))
+			return false;
+	}
+	else
+	{
+		DwfDevice* dev = new DwfDevice;
+		g_device = dev;
+		if(!dev->Open(device, config, host))
+			return false;
+	}
+
+	//Get ADC resolution for packed sample transport
+	if(!g_device->BitsInfo(g_adcBits))
+	{
+		LogWarning("BitsInfo failed, packed samples will be 16 bits\n");
+		g_adcBits = 16;
+	}
+	LogDebug("ADC resolution: %d bits\n", g_adcBits);
+
+	//Limits on sample rate and memory depth
+	if(!g_device->FrequencyInfo(g_minSampleRate, g_maxSampleRate))
+		LogError("FrequencyInfo failed\n");
+	int minDepth;
+	if(!g_device->BufferSizeInfo(minDepth, g_maxMemDepth))
+		LogError("BufferSizeInfo failed\n");
+
+	return true;
+}
+
+/**
+	@brief Closes the device (or the recording standing in for it)
+ */
+void CloseDevice()
+{
+	if(g_replay)
+	{
+		delete g_replay;
+		g_replay = NULL;
+	}
+	else
+	{
+		delete g_device;
+		g_device = NULL;
+	}
+}
+
+/**
+	@brief Sets up the Unix socket that same-host clients connect to for shared memory transport
+ */
+bool ListenOnLocalSocket(const string& path)
+{
+#ifdef _WIN32
+	(void)path;
+	LogError("Local socket transport is not supported on Windows\n");
+	return false;
+#else
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(addr.sun_path))
+	{
+		LogError("Local socket path \"%s\" is too long\n", path.c_str());
+		return false;
+	}
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	//Get rid of the socket left over from the last run, if any. Only if it's a socket nobody is listening on,
+	//so a mistyped path or a second server doesn't delete a file or another server's socket.
+	struct stat st;
+	if(0 == lstat(path.c_str(), &st))
+	{
+		if(!S_ISSOCK(st.st_mode))
+		{
+			LogError("Local socket path \"%s\" already exists and isn't a socket\n", path.c_str());
+			return false;
+		}
+
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		bool live = (probe >= 0) && (0 == connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+		bool stale = !live && (errno == ECONNREFUSED);
+		if(probe >= 0)
+			close(probe);
+		if(!stale)
+		{
+			LogError("Local socket \"%s\" is in use (is another server running?)\n", path.c_str());
+			return false;
+		}
+		unlink(path.c_str());
+	}
+
+	g_localSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if( (g_localSocket < 0) ||
+		(0 != ::bind(g_localSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) ||
+		(0 != listen(g_localSocket, 4)) )
+	{
+		LogError("Failed to listen on local socket \"%s\": %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	LogVerbose("Accepting local waveform clients on %s\n", path.c_str());
+	return true;
+#endif
+}
+
 void OnQuit(int /*signal*/)
 {
 	LogNotice("Shutting down...\n");
 
+	//A recording being replayed is unmapped on exit, and may still be in use until then
 	lock_guard<mutex> lock(g_mutex);
-	FDwfDeviceClose(g_hScope);
+	if(g_device)
+		g_device->Close();
 	exit(0);
 }
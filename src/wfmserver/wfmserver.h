@@ -39,31 +39,225 @@
 #endif
 
 #include <thread>
+#include <chrono>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <digilent/waveforms/dwf.h>
 
 extern Socket g_scpiSocket;
 extern Socket g_dataSocket;
+extern int g_localSocket;
+extern size_t g_shmRingSize;
 
 void ScpiServerThread();
 void WaveformServerThread();
 
-extern HDWF g_hScope;
+//The instrument (a real one through the SDK, or a SyntheticDevice). NULL when replaying a recording.
+class ScopeDevice;
+extern ScopeDevice* g_device;
 
 extern std::string g_model;
 extern std::string g_serial;
 extern std::string g_fwver;
 
 extern size_t g_numAnalogInChannels;
+extern int g_adcBits;
+
+//Device limits, read when it's opened
+extern double g_minSampleRate;
+extern double g_maxSampleRate;
+extern int g_maxMemDepth;
+
+//Replay of a recording instead of a real device (see CaptureReplay). There's nothing to configure, so settings are
+//accepted but have no effect on the recorded frames.
+class CaptureReplay;
+extern CaptureReplay* g_replay;
+extern bool g_replayFast;
+extern bool g_zeroCopy;
 extern volatile bool g_waveformThreadQuit;
 
-extern size_t g_captureMemDepth;
 extern size_t g_memDepth;
-extern std::map<size_t, bool> g_channelOnDuringArm;
 extern std::map<size_t, bool> g_channelOn;
 
+/**
+	@brief Encoding of sample data on the data plane socket
+ */
+enum SampleFormat
+{
+	FORMAT_FLOAT64,		//Volts as double, legacy channel header (default)
+	FORMAT_FLOAT32,		//Volts as float, extended channel header
+	FORMAT_INT16,		//Raw ADC codes, extended channel header carries volts/LSB and offset
+	FORMAT_PACKED		//N-bit ADC codes packed contiguously (N = g_adcBits), extended channel header
+};
+
+extern SampleFormat g_sampleFormat;
+
+/**
+	@brief Lossless compression applied to sample data on the data plane socket
+
+	Only the raw code formats (INT16 and PACKED) are compressed.
+ */
+enum WaveformCodec
+{
+	CODEC_NONE,			//Uncompressed, legacy channel header (default)
+	CODEC_DELTA_RICE	//Delta prediction + Rice coding, channel header carries codec and compressed length
+};
+
+extern WaveformCodec g_codec;
+
+extern bool g_pipelineEnabled;
+extern double g_deadTimeRatio;
+extern double g_pollsPerCapture;
+
+/**
+	@brief What to do with new captures when the client can't keep up
+ */
+enum OverflowPolicy
+{
+	OVERFLOW_BLOCK,			//Stall acquisition until the sender catches up (lossless, default)
+	OVERFLOW_DROP_OLDEST,	//Discard the oldest capture the sender hasn't started on yet
+	OVERFLOW_KEEP_LATEST	//Only ever queue the newest capture (minimum latency)
+};
+
+extern OverflowPolicy g_overflowPolicy;
+extern size_t g_queueDepth;
+
+/**
+	@brief Interval between throughput reports, in seconds
+ */
+#define STATS_INTERVAL 5
+
+extern std::atomic<size_t> g_framesDropped;
+
+/**
+	@brief How the hardware acquires data
+ */
+enum AcquisitionMode
+{
+	ACQUISITION_TRIGGERED,	//One buffer per trigger, re-armed after each (default)
+	ACQUISITION_STREAM		//Record mode: continuous gap-free chunks, no retriggering
+};
+
+extern AcquisitionMode g_acquisitionMode;
+extern bool g_streamRestarted;
+extern std::atomic<size_t> g_samplesLost;
+extern std::atomic<size_t> g_samplesCorrupt;
+
+/**
+	@brief Whether the full record follows the min/max envelope preview
+ */
+enum PreviewMode
+{
+	PREVIEW_AHEAD,		//Preview frame, then the full frame (default)
+	PREVIEW_ONLY		//Preview frame only
+};
+
+/**
+	@brief Kind of data plane frame, sent after the global header when any alternate output is enabled
+ */
+enum FrameType
+{
+	FRAME_FULL,
+	FRAME_PREVIEW,
+	FRAME_TILE,
+	FRAME_PERSISTENCE,
+	FRAME_SPECTRUM,
+	FRAME_SPECTROGRAM
+};
+
+/**
+	@brief Most min/max buckets per channel in a preview frame
+ */
+#define MAX_PREVIEW_BUCKETS (1024 * 1024)
+
+extern size_t g_previewBuckets;
+extern PreviewMode g_previewMode;
+
+extern bool g_pyramidEnabled;
+
+extern size_t g_averageCount;
+extern std::atomic<size_t> g_averageProgress;
+
+/**
+	@brief Limits on the persistence histogram grid
+ */
+#define MAX_PERSIST_COLUMNS 16384
+#define MAX_PERSIST_ROWS 4096
+
+extern size_t g_persistColumns;
+extern size_t g_persistRows;
+extern double g_persistRate;
+extern std::atomic<bool> g_persistClear;
+
+/**
+	@brief What the server sends in place of captures in spectrum mode
+ */
+enum SpectrumMode
+{
+	SPECTRUM_OFF,		//Send captures as usual (default)
+	SPECTRUM_BINS,		//Every bin of each averaged spectrum
+	SPECTRUM_ROWS		//Spectrogram rows: each averaged spectrum reduced to a client-chosen number of bins
+};
+
+/**
+	@brief Window applied to each capture before its FFT
+ */
+enum FFTWindow
+{
+	WINDOW_RECTANGULAR,
+	WINDOW_HANN,
+	WINDOW_HAMMING,
+	WINDOW_BLACKMAN_HARRIS
+};
+
+extern SpectrumMode g_spectrumMode;
+extern FFTWindow g_fftWindow;
+extern size_t g_spectrumAverages;
+extern bool g_peakHold;
+extern size_t g_spectrogramBins;
+extern std::atomic<bool> g_spectrumClear;
+
+extern int64_t g_roiStart;
+extern size_t g_roiLength;
+
+/**
+	@brief Newest data plane header extension we can send
+
+	Version 1 adds capture timing after the global header: uint64 {version, length of the rest in bytes}, then
+	uint64 {sequence, device ticks, device ticks per second} and int64 {arm, ready, send} host times in ns since the
+	Unix epoch.
+ */
+#define MAX_HEADER_VERSION 1
+
+extern size_t g_headerVersion;
+
+/**
+	@brief Most samples per channel in a burst (segment count times memory depth)
+
+	Every buffer set holds a whole burst, so this bounds how much memory a client can make us allocate.
+ */
+#define MAX_BURST_SAMPLES (256 * 1024 * 1024)
+
+extern size_t g_segmentCount;
+extern size_t g_armCount;
+extern int64_t g_armTime;
+extern std::chrono::steady_clock::time_point g_armSteadyTime;
+
+size_t GetWaveformSize(SampleFormat format, size_t depth);
+int64_t GetHostTimestamp();
+
+//Recording of every frame to disk (see CaptureRecorder). Disabled unless a directory is given on the command line.
+class CaptureRecorder;
+extern std::string g_recordDir;
+extern bool g_recordDirect;
+bool StartRecording(const std::string& name);
+void StopRecording();
+std::shared_ptr<CaptureRecorder> GetRecorder();
+
 /*
 extern bool g_msoPodEnabled[2];
 extern bool g_msoPodEnabledDuringArm[2];
@@ -72,10 +266,8 @@ extern PICO_DIGITAL_PORT_HYSTERESIS g_msoHysteresis[2];
 
 */
 extern int64_t g_sampleInterval;
-extern int64_t g_sampleIntervalDuringArm;
 
 extern int64_t g_triggerDelay;
-extern size_t g_triggerSampleIndex;
 extern size_t g_triggerChannel;
 extern double g_triggerDeltaSec;
 extern double g_triggerVoltage;
@@ -85,6 +277,9 @@ extern bool g_memDepthChanged;
 
 extern std::mutex g_mutex;
 
+//Notified (with g_mutex held) when the trigger is armed or stopped, so the acquisition thread can sleep until then
+extern std::condition_variable g_armCond;
+
 #define FS_PER_SECOND 1e15
 #define SECONDS_PER_FS 1e-15
 